@@ -0,0 +1,394 @@
+#include "bitmap.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define WORD_BITS 64
+#define ALL_SET (~(uint64_t)0)
+
+/**
+ * @brief Return a word of the bitmap with the bits past the end forced set.
+ *
+ * Only the last word can contain such bits, they are never handed out.
+ *
+ * @param bm Bitmap to read.
+ * @param w Index of the word.
+ * @return uint64_t The word value.
+ */
+static uint64_t word_value(const struct bitmap *bm, int w) {
+  uint64_t word = bm->words[w];
+  int tail_bits = bm->bit_count - w * WORD_BITS;
+  if (tail_bits < WORD_BITS)
+    word |= ALL_SET << tail_bits;
+  return word;
+}
+
+/**
+ * @brief Recompute the summary bit of one word.
+ *
+ * @param bm Bitmap to update.
+ * @param w Index of the word whose bit changed.
+ */
+static void update_summary(struct bitmap *bm, int w) {
+  uint64_t mask = (uint64_t)1 << (w % WORD_BITS);
+  if (word_value(bm, w) == ALL_SET)
+    bm->summary[w / WORD_BITS] |= mask;
+  else
+    bm->summary[w / WORD_BITS] &= ~mask;
+}
+
+/**
+ * @brief Extend the dirty byte range of a bitmap to include a byte.
+ *
+ * @param bm Bitmap to mark.
+ * @param byte_index Index of the modified byte.
+ */
+static void mark_dirty(struct bitmap *bm, int byte_index) {
+  if (bm->dirty_start < 0) {
+    bm->dirty_start = byte_index;
+    bm->dirty_end = byte_index + 1;
+    return;
+  }
+  if (byte_index < bm->dirty_start)
+    bm->dirty_start = byte_index;
+  if (byte_index + 1 > bm->dirty_end)
+    bm->dirty_end = byte_index + 1;
+}
+
+/**
+ * @brief Read a bitmap from the image into memory and build its summary.
+ *
+ * Any previously loaded copy is released first.
+ *
+ * @param bm Bitmap to fill.
+ * @param st Image storage.
+ * @param disk_offset Byte offset of the bitmap in the image.
+ * @param bit_count Number of bits in the bitmap.
+ * @return int 0 on success, -1 on allocation or read failure.
+ */
+int bitmap_load(struct bitmap *bm, struct storage *st, int disk_offset,
+                int bit_count) {
+  bitmap_release(bm);
+  if (bit_count <= 0)
+    return 0;
+
+  int byte_count = (bit_count + 7) / 8;
+  int word_count = (bit_count + WORD_BITS - 1) / WORD_BITS;
+  int summary_count = (word_count + WORD_BITS - 1) / WORD_BITS;
+  uint64_t *words = calloc(word_count, sizeof(uint64_t));
+  uint64_t *summary = calloc(summary_count, sizeof(uint64_t));
+  if (!words || !summary) {
+    free(words);
+    free(summary);
+    return -1;
+  }
+
+  if (storage_read(st, words, byte_count, disk_offset)) {
+    free(words);
+    free(summary);
+    return -1;
+  }
+
+  bm->words = words;
+  bm->summary = summary;
+  bm->bit_count = bit_count;
+  bm->byte_count = byte_count;
+  bm->word_count = word_count;
+  bm->disk_offset = disk_offset;
+
+  // summary bits past the last word count as full
+  int tail_words = word_count % WORD_BITS;
+  if (tail_words)
+    summary[summary_count - 1] = ALL_SET << tail_words;
+  for (int w = 0; w < word_count; w++)
+    update_summary(bm, w);
+  return 0;
+}
+
+/**
+ * @brief Write the dirty byte range of a bitmap back to the image.
+ *
+ * Does not flush the storage, the caller decides when to do that.
+ *
+ * @param bm Bitmap to write back.
+ * @param st Image storage.
+ * @return int 0 on success, -1 on write failure.
+ */
+int bitmap_flush(struct bitmap *bm, struct storage *st) {
+  if (!bm->data || bm->dirty_start < 0)
+    return 0;
+
+  int length = bm->dirty_end - bm->dirty_start;
+  if (storage_write(st, bm->data + bm->dirty_start, length,
+                    bm->disk_offset + bm->dirty_start))
+    return -1;
+
+  bm->dirty_start = -1;
+  bm->dirty_end = 0;
+  return 0;
+}
+
+/**
+ * @brief Mark the whole bitmap dirty again after a failed commit.
+ *
+ * @param bm Bitmap to mark.
+ */
+void bitmap_mark_dirty(struct bitmap *bm) {
+  if (!bm->data || !bm->byte_count)
+    return;
+  bm->dirty_start = 0;
+  bm->dirty_end = bm->byte_count;
+}
+
+/**
+ * @brief Drop the in-memory copy of a bitmap without writing it back.
+ *
+ * @param bm Bitmap to release.
+ */
+void bitmap_release(struct bitmap *bm) {
+  free(bm->words);
+  free(bm->summary);
+  memset(bm, 0, sizeof(*bm));
+  bm->dirty_start = -1;
+}
+
+/**
+ * @brief Set i-th bit of the bitmap.
+ *
+ * @param bm Bitmap to modify.
+ * @param i Index of bit, starting from 0.
+ * @return int 1 if the bit changed, 0 if it was already set or out of range.
+ */
+int bitmap_set(struct bitmap *bm, int i) {
+  if (!bm->data || i < 0 || i >= bm->bit_count)
+    return 0;
+  uint8_t mask = 1 << (i % 8);
+  if (bm->data[i / 8] & mask)
+    return 0;
+  bm->data[i / 8] |= mask;
+  mark_dirty(bm, i / 8);
+  update_summary(bm, i / WORD_BITS);
+  return 1;
+}
+
+/**
+ * @brief Clear i-th bit of the bitmap.
+ *
+ * @param bm Bitmap to modify.
+ * @param i Index of bit, starting from 0.
+ * @return int 1 if the bit changed, 0 if it was already clear or out of range.
+ */
+int bitmap_clear(struct bitmap *bm, int i) {
+  if (!bm->data || i < 0 || i >= bm->bit_count)
+    return 0;
+  uint8_t mask = 1 << (i % 8);
+  if (!(bm->data[i / 8] & mask))
+    return 0;
+  bm->data[i / 8] &= ~mask;
+  mark_dirty(bm, i / 8);
+  bm->summary[i / WORD_BITS / WORD_BITS] &=
+      ~((uint64_t)1 << (i / WORD_BITS % WORD_BITS));
+  return 1;
+}
+
+/**
+ * @brief Read the value of the i-th bit.
+ *
+ * Bits outside of the bitmap read as set, so they are never handed out.
+ *
+ * @param bm Bitmap to read.
+ * @param i Index of bit, starting from 0.
+ * @return int The value of the bit (0 or 1).
+ */
+int bitmap_test(const struct bitmap *bm, int i) {
+  if (!bm->data || i < 0 || i >= bm->bit_count)
+    return 1;
+  return (bm->data[i / 8] >> (i % 8)) & 1;
+}
+
+/**
+ * @brief Find the first unset bit at or after a given position.
+ *
+ * Checks the word containing start, then walks the summary level where one
+ * summary word covers 64 bitmap words, so fully used regions are skipped
+ * 4096 bits at a time.
+ *
+ * @param bm Bitmap to search.
+ * @param start Index of the first bit to consider.
+ * @return int Index of the free bit, or -1 if there is none after start.
+ */
+static int find_zero_from(const struct bitmap *bm, int start) {
+  if (start >= bm->bit_count)
+    return -1;
+
+  int w = start / WORD_BITS;
+  uint64_t free_bits = ~word_value(bm, w) & (ALL_SET << (start % WORD_BITS));
+  if (free_bits)
+    return w * WORD_BITS + __builtin_ctzll(free_bits);
+
+  int next_word = w + 1;
+  int summary_count = (bm->word_count + WORD_BITS - 1) / WORD_BITS;
+  for (int s = next_word / WORD_BITS; s < summary_count; s++) {
+    uint64_t free_words = ~bm->summary[s];
+    if (s == next_word / WORD_BITS)
+      free_words &= ALL_SET << (next_word % WORD_BITS);
+    if (!free_words)
+      continue;
+    int found = s * WORD_BITS + __builtin_ctzll(free_words);
+    return found * WORD_BITS + __builtin_ctzll(~word_value(bm, found));
+  }
+  return -1;
+}
+
+/**
+ * @brief Find a free bit using next-fit from the bitmap cursor.
+ *
+ * The search continues where the previous allocation ended and wraps around
+ * to the start once, so allocating N bits is linear in N rather than in the
+ * number of bits already used.
+ *
+ * @param bm Bitmap to search.
+ * @return int Index of a free bit, or -1 if the bitmap is full.
+ */
+int bitmap_find_free(struct bitmap *bm) {
+  if (!bm->data)
+    return -1;
+  int found = find_zero_from(bm, bm->cursor);
+  if (found < 0 && bm->cursor > 0)
+    found = find_zero_from(bm, 0);
+  if (found >= 0)
+    bm->cursor = found + 1 < bm->bit_count ? found + 1 : 0;
+  return found;
+}
+
+/**
+ * @brief Find the first set bit at or after a given position.
+ *
+ * @param bm Bitmap to search.
+ * @param start Index of the first bit to consider.
+ * @param limit Index where the search stops.
+ * @return int Index of the set bit, or limit if all bits before it are free.
+ */
+static int find_one_from(const struct bitmap *bm, int start, int limit) {
+  if (start >= limit)
+    return limit;
+  int w = start / WORD_BITS;
+  uint64_t used_bits = word_value(bm, w) & (ALL_SET << (start % WORD_BITS));
+  while (!used_bits) {
+    if (++w >= bm->word_count)
+      return limit;
+    used_bits = word_value(bm, w);
+  }
+  int found = w * WORD_BITS + __builtin_ctzll(used_bits);
+  return found < limit ? found : limit;
+}
+
+/**
+ * @brief Scan free runs in [from, limit) for a run of the wanted length.
+ *
+ * @param bm Bitmap to search.
+ * @param from Index where the scan starts.
+ * @param limit Index where the scan stops.
+ * @param wanted Number of bits wanted.
+ * @param best_start In/out start of the longest run seen so far.
+ * @param best_length In/out length of the longest run seen so far.
+ * @return int 1 if a run of the wanted length was found.
+ */
+static int scan_runs(const struct bitmap *bm, int from, int limit, int wanted,
+                     int *best_start, int *best_length) {
+  int position = from;
+  while (position < limit) {
+    int start = find_zero_from(bm, position);
+    if (start < 0 || start >= limit)
+      return 0;
+    int end = find_one_from(bm, start, limit);
+    if (end - start > *best_length) {
+      *best_start = start;
+      *best_length = end - start;
+      if (*best_length >= wanted)
+        return 1;
+    }
+    position = end;
+  }
+  return 0;
+}
+
+/**
+ * @brief Find a run of consecutive free bits.
+ *
+ * Looks for the first run of at least the wanted length, starting at the
+ * next-fit cursor and wrapping around. If no run is that long, the longest
+ * free run is returned instead so the caller can continue with the rest.
+ * The bits are not marked, see bitmap_set_range.
+ *
+ * @param bm Bitmap to search.
+ * @param wanted Number of bits wanted.
+ * @param run_start Output index of the first bit of the run.
+ * @return int Length of the run (at most wanted), 0 if the bitmap is full.
+ */
+int bitmap_find_run(struct bitmap *bm, int wanted, int *run_start) {
+  int best_start = 0, best_length = 0;
+  if (!bm->data || wanted <= 0)
+    return 0;
+
+  if (!scan_runs(bm, bm->cursor, bm->bit_count, wanted, &best_start,
+                 &best_length))
+    scan_runs(bm, 0, bm->cursor, wanted, &best_start, &best_length);
+
+  *run_start = best_start;
+  return best_length < wanted ? best_length : wanted;
+}
+
+/**
+ * @brief Set a range of bits and move the next-fit cursor past it.
+ *
+ * @param bm Bitmap to modify.
+ * @param start Index of the first bit.
+ * @param length Number of bits to set.
+ * @return int Number of bits which were not set before.
+ */
+int bitmap_set_range(struct bitmap *bm, int start, int length) {
+  if (!bm->data || length <= 0)
+    return 0;
+  int end = start + length;
+  if (start < 0)
+    start = 0;
+  if (end > bm->bit_count)
+    end = bm->bit_count;
+
+  int changed = 0;
+  for (int i = start; i < end; i++) {
+    uint8_t mask = 1 << (i % 8);
+    if (!(bm->data[i / 8] & mask)) {
+      bm->data[i / 8] |= mask;
+      changed++;
+    }
+  }
+  if (start >= end)
+    return 0;
+  mark_dirty(bm, start / 8);
+  mark_dirty(bm, (end - 1) / 8);
+  for (int w = start / WORD_BITS; w <= (end - 1) / WORD_BITS; w++)
+    update_summary(bm, w);
+  bm->cursor = end < bm->bit_count ? end : 0;
+  return changed;
+}
+
+/**
+ * @brief Count the set bits of the bitmap.
+ *
+ * @param bm Bitmap to count.
+ * @return int Number of set bits.
+ */
+int bitmap_count(const struct bitmap *bm) {
+  if (!bm->data)
+    return 0;
+  int count = 0;
+  for (int w = 0; w < bm->word_count; w++) {
+    uint64_t word = bm->words[w];
+    int tail_bits = bm->bit_count - w * WORD_BITS;
+    if (tail_bits < WORD_BITS)
+      word &= ~(ALL_SET << tail_bits);
+    count += __builtin_popcountll(word);
+  }
+  return count;
+}
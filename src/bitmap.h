@@ -0,0 +1,39 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include "storage.h"
+#include <stdint.h>
+
+// In-memory copy of one on-disk bitmap (inodes or clusters).
+// Bit i lives in byte i / 8 at position i % 8, which on little-endian hosts is
+// also bit i % 64 of word i / 64, so the search can work on whole words.
+struct bitmap {
+  union {
+    uint8_t *data;   // cached bitmap bytes
+    uint64_t *words; // the same bytes viewed as 64-bit words
+  };
+  uint64_t *summary; // bit w set when word w has no free bit left
+  int bit_count;     // number of valid bits
+  int byte_count;    // size of the bitmap on disk in bytes
+  int word_count;    // number of words in data
+  int disk_offset;   // byte offset of the bitmap in the image
+  int dirty_start;   // first dirty byte (inclusive), -1 when clean
+  int dirty_end;     // last dirty byte (exclusive)
+  int cursor;        // next-fit position where the next search starts
+};
+
+int bitmap_load(struct bitmap *bm, struct storage *st, int disk_offset,
+                int bit_count);
+int bitmap_flush(struct bitmap *bm, struct storage *st);
+void bitmap_mark_dirty(struct bitmap *bm);
+void bitmap_release(struct bitmap *bm);
+
+int bitmap_set(struct bitmap *bm, int i);
+int bitmap_clear(struct bitmap *bm, int i);
+int bitmap_test(const struct bitmap *bm, int i);
+int bitmap_find_free(struct bitmap *bm);
+int bitmap_find_run(struct bitmap *bm, int wanted, int *run_start);
+int bitmap_set_range(struct bitmap *bm, int start, int length);
+int bitmap_count(const struct bitmap *bm);
+
+#endif
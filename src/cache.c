@@ -0,0 +1,907 @@
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Byte offset of a position inside a cluster in the image.
+ *
+ * @param cache Cache attached to an image.
+ * @param cluster Cluster ID.
+ * @param offset Byte offset from the start of the cluster.
+ * @return long Byte offset in the image.
+ */
+static long image_offset(const struct block_cache *cache, int cluster,
+                         long offset) {
+  return cache->data_start + (long)cluster * cache->cluster_size + offset;
+}
+
+/**
+ * @brief Whether the image bytes are addressable, so caching is pointless.
+ *
+ * @param cache Cache attached to an image.
+ * @return bool true for the mmap and memory backends, unless writes have to
+ * wait for the commit.
+ */
+static bool in_place(const struct block_cache *cache) {
+  return cache->storage && cache->storage->map && !cache->deferred;
+}
+
+/**
+ * @brief Compute the hash bucket of a cluster.
+ *
+ * @param cache Cache to look into.
+ * @param cluster Cluster ID.
+ * @return int Index of the bucket.
+ */
+static int bucket_of(const struct block_cache *cache, int cluster) {
+  return (unsigned int)cluster % cache->bucket_count;
+}
+
+/**
+ * @brief Find the cached block of a cluster.
+ *
+ * @param cache Cache to look into.
+ * @param cluster Cluster ID.
+ * @return struct cache_block* The block, or NULL if the cluster is not cached.
+ */
+static struct cache_block *lookup(const struct block_cache *cache,
+                                  int cluster) {
+  struct cache_block *block = cache->buckets[bucket_of(cache, cluster)];
+  while (block && block->cluster != cluster)
+    block = block->hash_next;
+  return block;
+}
+
+/**
+ * @brief Remove a block from its hash bucket.
+ *
+ * @param cache Cache holding the block.
+ * @param block Block to unlink.
+ */
+static void hash_remove(struct block_cache *cache, struct cache_block *block) {
+  struct cache_block **link = &cache->buckets[bucket_of(cache, block->cluster)];
+  while (*link && *link != block)
+    link = &(*link)->hash_next;
+  if (*link)
+    *link = block->hash_next;
+  block->hash_next = NULL;
+}
+
+/**
+ * @brief Unlink a block from the LRU list.
+ *
+ * @param cache Cache holding the block.
+ * @param block Block to unlink.
+ */
+static void lru_unlink(struct block_cache *cache, struct cache_block *block) {
+  if (block->prev)
+    block->prev->next = block->next;
+  else
+    cache->lru_head = block->next;
+  if (block->next)
+    block->next->prev = block->prev;
+  else
+    cache->lru_tail = block->prev;
+  block->prev = block->next = NULL;
+}
+
+/**
+ * @brief Move a block to the most recently used end of the LRU list.
+ *
+ * @param cache Cache holding the block.
+ * @param block Block which was just used.
+ */
+static void lru_touch(struct block_cache *cache, struct cache_block *block) {
+  if (cache->lru_head == block)
+    return;
+  lru_unlink(cache, block);
+  block->next = cache->lru_head;
+  if (cache->lru_head)
+    cache->lru_head->prev = block;
+  cache->lru_head = block;
+  if (!cache->lru_tail)
+    cache->lru_tail = block;
+}
+
+/**
+ * @brief Write one block to its cluster in the image.
+ *
+ * @param cache Cache holding the block.
+ * @param block Block to write.
+ * @return int 0 on success, -1 on write failure.
+ */
+static int write_block(struct block_cache *cache, struct cache_block *block) {
+  if (storage_write(cache->storage, block->data, cache->cluster_size,
+                    image_offset(cache, block->cluster, 0)))
+    return -1;
+  block->dirty = false;
+  return 0;
+}
+
+/**
+ * @brief Allocate a block past the capacity, used when every block holds a
+ * deferred dirty cluster.
+ *
+ * @param cache Cache to grow.
+ * @return struct cache_block* Unused block at the LRU tail, or NULL on
+ * allocation failure.
+ */
+static struct cache_block *add_extra(struct block_cache *cache) {
+  struct cache_block *block = calloc(1, sizeof(struct cache_block));
+  uint8_t *data = malloc(cache->cluster_size);
+  if (!block || !data) {
+    free(block);
+    free(data);
+    return NULL;
+  }
+  block->cluster = -1;
+  block->data = data;
+  block->extra_next = cache->extra;
+  cache->extra = block;
+  cache->extra_count++;
+
+  block->prev = cache->lru_tail;
+  if (cache->lru_tail)
+    cache->lru_tail->next = block;
+  cache->lru_tail = block;
+  if (!cache->lru_head)
+    cache->lru_head = block;
+  return block;
+}
+
+/**
+ * @brief Free the blocks allocated past the capacity.
+ *
+ * @param cache Cache to shrink.
+ * @param keep_dirty Keep dirty and pinned blocks, otherwise all are dropped.
+ */
+static void drop_extra(struct block_cache *cache, bool keep_dirty) {
+  struct cache_block **link = &cache->extra;
+  while (*link) {
+    struct cache_block *block = *link;
+    if (keep_dirty && (block->dirty || block->pins)) {
+      link = &block->extra_next;
+      continue;
+    }
+    *link = block->extra_next;
+    if (block->cluster >= 0)
+      hash_remove(cache, block);
+    lru_unlink(cache, block);
+    free(block->data);
+    free(block);
+    cache->extra_count--;
+  }
+}
+
+/**
+ * @brief Find the least recently used unpinned block and free it for reuse.
+ *
+ * Clean blocks are preferred, dirty ones would reach the image outside of
+ * the journal transaction. With deferred writes the cache grows rather than
+ * evicting a dirty block, otherwise a dirty victim is written back first.
+ *
+ * @param cache Cache to evict from.
+ * @return struct cache_block* Unused block, or NULL if every block is pinned.
+ */
+static struct cache_block *evict(struct block_cache *cache) {
+  struct cache_block *block = cache->lru_tail;
+  while (block && (block->pins || block->dirty))
+    block = block->prev;
+  if (!block && cache->deferred)
+    block = add_extra(cache);
+  if (!block) {
+    block = cache->lru_tail;
+    while (block && block->pins)
+      block = block->prev;
+  }
+  if (!block)
+    return NULL;
+  if (block->cluster >= 0) {
+    if (block->dirty && write_block(cache, block))
+      return NULL;
+    cache->data_written |= block->file_data;
+    hash_remove(cache, block);
+    block->cluster = -1;
+  }
+  return block;
+}
+
+/**
+ * @brief Allocate the blocks of a cache.
+ *
+ * @param cache Cache to initialize.
+ * @param capacity Number of clusters the cache can hold.
+ * @param cluster_size Size of one cluster in bytes.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+int cache_init(struct block_cache *cache, int capacity, int cluster_size) {
+  memset(cache, 0, sizeof(*cache));
+  pthread_mutex_init(&cache->lock, NULL);
+  if (capacity < 1)
+    capacity = 1;
+  cache->capacity = capacity;
+  cache->cluster_size = cluster_size;
+  cache->bucket_count = capacity * 2 + 1;
+  cache->blocks = calloc(capacity, sizeof(struct cache_block));
+  cache->buckets = calloc(cache->bucket_count, sizeof(struct cache_block *));
+  cache->memory = malloc((size_t)capacity * cluster_size);
+  if (!cache->blocks || !cache->buckets || !cache->memory) {
+    cache_destroy(cache);
+    return -1;
+  }
+
+  for (int i = 0; i < capacity; i++) {
+    struct cache_block *block = &cache->blocks[i];
+    block->cluster = -1;
+    block->data = cache->memory + (size_t)i * cluster_size;
+    block->prev = i ? &cache->blocks[i - 1] : NULL;
+    block->next = i + 1 < capacity ? &cache->blocks[i + 1] : NULL;
+  }
+  cache->lru_head = &cache->blocks[0];
+  cache->lru_tail = &cache->blocks[capacity - 1];
+  return 0;
+}
+
+/**
+ * @brief Free all memory of a cache without writing anything back.
+ *
+ * @param cache Cache to destroy.
+ */
+void cache_destroy(struct block_cache *cache) {
+  drop_extra(cache, false);
+  free(cache->blocks);
+  free(cache->buckets);
+  free(cache->memory);
+  pthread_mutex_destroy(&cache->lock);
+  memset(cache, 0, sizeof(*cache));
+}
+
+/**
+ * @brief Drop all cached clusters and attach the cache to an image layout.
+ *
+ * Used after open and format, dirty blocks are discarded.
+ *
+ * @param cache Cache to reset.
+ * @param storage Image storage. When its bytes are addressable (mmap) the
+ * cache is bypassed and clusters are copied to and from them directly.
+ * @param data_start Byte offset of cluster 0 in the image.
+ */
+void cache_reset(struct block_cache *cache, struct storage *storage,
+                 long data_start) {
+  drop_extra(cache, false);
+  for (int i = 0; i < cache->capacity; i++) {
+    cache->blocks[i].cluster = -1;
+    cache->blocks[i].dirty = false;
+    cache->blocks[i].hash_next = NULL;
+  }
+  if (cache->buckets)
+    memset(cache->buckets, 0,
+           cache->bucket_count * sizeof(struct cache_block *));
+  cache->storage = storage;
+  cache->data_start = data_start;
+  cache->hits = cache->misses = 0;
+}
+
+/**
+ * @brief Get a cluster into the cache and pin it.
+ *
+ * The block stays valid until released with cache_put. Several threads may
+ * get blocks at the same time, a pinned block is never evicted.
+ *
+ * @param cache Cache to use.
+ * @param cluster Cluster ID.
+ * @param read Whether the current contents are needed, pass false when the
+ * caller overwrites the whole cluster.
+ * @return struct cache_block* The pinned block, or NULL if all blocks are
+ * pinned.
+ */
+struct cache_block *cache_get(struct block_cache *cache, int cluster,
+                              bool read) {
+  if (!cache->blocks || in_place(cache))
+    return NULL;
+  pthread_mutex_lock(&cache->lock);
+  struct cache_block *block = lookup(cache, cluster);
+  if (block) {
+    cache->hits++;
+  } else {
+    cache->misses++;
+    block = evict(cache);
+    if (!block) {
+      pthread_mutex_unlock(&cache->lock);
+      return NULL;
+    }
+    block->cluster = cluster;
+    block->dirty = false;
+    block->file_data = false;
+    block->flushed = 0;
+    block->hash_next = cache->buckets[bucket_of(cache, cluster)];
+    cache->buckets[bucket_of(cache, cluster)] = block;
+
+    memset(block->data, 0, cache->cluster_size);
+    if (read)
+      storage_read(cache->storage, block->data, cache->cluster_size,
+                   image_offset(cache, cluster, 0));
+  }
+  block->pins++;
+  lru_touch(cache, block);
+  pthread_mutex_unlock(&cache->lock);
+  return block;
+}
+
+/**
+ * @brief Release a block obtained by cache_get.
+ *
+ * @param cache Cache holding the block.
+ * @param block Block to release.
+ * @param dirty Whether the caller modified the block.
+ */
+void cache_put(struct block_cache *cache, struct cache_block *block,
+               bool dirty) {
+  pthread_mutex_lock(&cache->lock);
+  if (block->pins > 0)
+    block->pins--;
+  if (dirty)
+    block->dirty = true;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * @brief Copy bytes of one cluster out of the cache.
+ *
+ * Falls back to reading the image directly when no block can be used.
+ *
+ * @param cache Cache to use.
+ * @param cluster Cluster ID.
+ * @param offset Byte offset within the cluster.
+ * @param buf Destination buffer.
+ * @param length Number of bytes, offset + length must fit into the cluster.
+ * @return int 0 on success, -1 on failure.
+ */
+int cache_read(struct block_cache *cache, int cluster, int offset, void *buf,
+               int length) {
+  struct cache_block *block = cache_get(cache, cluster, true);
+  if (!block)
+    return storage_read(cache->storage, buf, length,
+                        image_offset(cache, cluster, offset));
+  memcpy(buf, block->data + offset, length);
+  cache_put(cache, block, false);
+  return 0;
+}
+
+/**
+ * @brief Copy bytes into one cluster in the cache, marking it dirty.
+ *
+ * @param cache Cache to use.
+ * @param cluster Cluster ID.
+ * @param offset Byte offset within the cluster.
+ * @param buf Source buffer.
+ * @param length Number of bytes, offset + length must fit into the cluster.
+ * @param file_data The bytes are file contents rather than metadata.
+ * @return int 0 on success, -1 on failure.
+ */
+static int write_cluster(struct block_cache *cache, int cluster, int offset,
+                         const void *buf, int length, bool file_data) {
+  bool whole = offset == 0 && length == cache->cluster_size;
+  struct cache_block *block = cache_get(cache, cluster, !whole);
+  if (!block) {
+    cache->data_written |= file_data;
+    return storage_write(cache->storage, buf, length,
+                         image_offset(cache, cluster, offset));
+  }
+  memcpy(block->data + offset, buf, length);
+  block->file_data = file_data;
+  cache_put(cache, block, true);
+  return 0;
+}
+
+/**
+ * @brief Copy metadata bytes into one cluster in the cache, marking it dirty.
+ *
+ * Falls back to writing the image directly when no block can be used.
+ *
+ * @param cache Cache to use.
+ * @param cluster Cluster ID.
+ * @param offset Byte offset within the cluster.
+ * @param buf Source buffer.
+ * @param length Number of bytes, offset + length must fit into the cluster.
+ * @return int 0 on success, -1 on failure.
+ */
+int cache_write(struct block_cache *cache, int cluster, int offset,
+                const void *buf, int length) {
+  return write_cluster(cache, cluster, offset, buf, length, false);
+}
+
+/**
+ * @brief Write file contents within one cluster, see cache_write.
+ *
+ * The cluster is written ahead of the metadata at the next commit, see
+ * cache_flush_data.
+ *
+ * @param cache Cache to use.
+ * @param cluster Cluster ID.
+ * @param offset Byte offset within the cluster.
+ * @param buf Source buffer.
+ * @param length Number of bytes, offset + length must fit into the cluster.
+ * @return int 0 on success, -1 on failure.
+ */
+int cache_write_data(struct block_cache *cache, int cluster, int offset,
+                     const void *buf, int length) {
+  return write_cluster(cache, cluster, offset, buf, length, true);
+}
+
+/**
+ * @brief Start collecting image transfers.
+ *
+ * @param batch Batch to initialize.
+ */
+void cache_batch_init(struct cache_batch *batch) {
+  batch->count = 0;
+  batch->failed = 0;
+}
+
+/**
+ * @brief Add an image transfer to a batch, a full batch is submitted first.
+ *
+ * @param cache Cache the batch belongs to.
+ * @param batch Batch to add to.
+ * @param buf Buffer of the transfer, must stay valid until it is submitted.
+ * @param length Number of bytes.
+ * @param offset Byte offset in the image.
+ * @param write Write the buffer, read into it otherwise.
+ */
+static void batch_add(struct block_cache *cache, struct cache_batch *batch,
+                      void *buf, long length, long offset, bool write) {
+  if (batch->count == CACHE_BATCH_REQUESTS)
+    cache_submit(cache, batch);
+  struct io_request *request = &batch->requests[batch->count++];
+  request->buf = buf;
+  request->length = length;
+  request->offset = offset;
+  request->write = write;
+}
+
+/**
+ * @brief Submit the transfers collected in a batch and wait for all of them.
+ *
+ * @param cache Cache the batch belongs to.
+ * @param batch Batch to submit, it is empty afterwards.
+ * @return int 0 on success, -1 if a transfer since cache_batch_init failed.
+ */
+int cache_submit(struct block_cache *cache, struct cache_batch *batch) {
+  if (batch->count &&
+      storage_submit(cache->storage, batch->requests, batch->count))
+    batch->failed = -1;
+  batch->count = 0;
+  return batch->failed;
+}
+
+/**
+ * @brief Read a run of consecutive clusters once the batch is submitted.
+ *
+ * Cached clusters are copied from the cache right away, the others are read
+ * from the image with one transfer per uncached stretch and are not added to
+ * the cache, so bulk file data does not push metadata out.
+ *
+ * @param cache Cache to use.
+ * @param batch Batch collecting the image reads.
+ * @param cluster First cluster of the run.
+ * @param buf Destination buffer.
+ * @param length Number of bytes to read from the start of the run.
+ */
+void cache_queue_read(struct block_cache *cache, struct cache_batch *batch,
+                      int cluster, void *buf, long length) {
+  if (in_place(cache)) {
+    if (storage_read(cache->storage, buf, length,
+                     image_offset(cache, cluster, 0)))
+      batch->failed = -1;
+    return;
+  }
+  uint8_t *out = buf;
+  long done = 0, miss_start = -1;
+  while (done <= length) {
+    long chunk = length - done < cache->cluster_size ? length - done
+                                                     : cache->cluster_size;
+    // the lock is not held while a full batch is submitted
+    pthread_mutex_lock(&cache->lock);
+    struct cache_block *block =
+        done < length ? lookup(cache, cluster + done / cache->cluster_size)
+                      : NULL;
+    if (block) {
+      cache->hits++;
+      memcpy(out + done, block->data, chunk);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if ((block || done == length) && miss_start >= 0) {
+      batch_add(cache, batch, out + miss_start, done - miss_start,
+                image_offset(cache, cluster, miss_start), false);
+      miss_start = -1;
+    }
+    if (done == length)
+      break;
+    if (!block && miss_start < 0)
+      miss_start = done;
+    done += chunk;
+  }
+}
+
+/**
+ * @brief Write a run of consecutive clusters once the batch is submitted.
+ *
+ * Cached clusters are updated in the cache right away, the others are
+ * written to the image with one transfer per uncached stretch. While the
+ * cache is holding writes the others are cached too. A partial last cluster
+ * only has its first bytes written. The run holds file contents, see
+ * cache_flush_data.
+ *
+ * @param cache Cache to use.
+ * @param batch Batch collecting the image writes.
+ * @param cluster First cluster of the run.
+ * @param buf Source buffer, must not change until the batch is submitted.
+ * @param length Number of bytes to write from the start of the run.
+ */
+void cache_queue_write(struct block_cache *cache, struct cache_batch *batch,
+                       int cluster, const void *buf, long length) {
+  if (in_place(cache)) {
+    if (storage_write(cache->storage, buf, length,
+                      image_offset(cache, cluster, 0)))
+      batch->failed = -1;
+    cache->data_written = true;
+    return;
+  }
+  const uint8_t *in = buf;
+  long done = 0, miss_start = -1;
+  while (done <= length) {
+    long chunk = length - done < cache->cluster_size ? length - done
+                                                     : cache->cluster_size;
+    // the lock is not held while a full batch is submitted
+    pthread_mutex_lock(&cache->lock);
+    struct cache_block *block =
+        done < length ? lookup(cache, cluster + done / cache->cluster_size)
+                      : NULL;
+    if (block) {
+      memcpy(block->data, in + done, chunk);
+      block->dirty = true;
+      block->file_data = true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (!block && done < length && cache->holding &&
+        (block = cache_get(cache, cluster + done / cache->cluster_size,
+                           chunk < cache->cluster_size))) {
+      memcpy(block->data, in + done, chunk);
+      block->file_data = true;
+      cache_put(cache, block, true);
+    }
+
+    if ((block || done == length) && miss_start >= 0) {
+      batch_add(cache, batch, (uint8_t *)in + miss_start, done - miss_start,
+                image_offset(cache, cluster, miss_start), true);
+      cache->data_written = true;
+      miss_start = -1;
+    }
+    if (done == length)
+      break;
+    if (!block && miss_start < 0)
+      miss_start = done;
+    done += chunk;
+  }
+}
+
+/**
+ * @brief Read a run of consecutive clusters, see cache_queue_read.
+ *
+ * @param cache Cache to use.
+ * @param cluster First cluster of the run.
+ * @param buf Destination buffer.
+ * @param length Number of bytes to read from the start of the run.
+ * @return int 0 on success, -1 on failure.
+ */
+int cache_read_range(struct block_cache *cache, int cluster, void *buf,
+                     long length) {
+  struct cache_batch batch;
+  cache_batch_init(&batch);
+  cache_queue_read(cache, &batch, cluster, buf, length);
+  return cache_submit(cache, &batch);
+}
+
+/**
+ * @brief Write a run of consecutive clusters, see cache_queue_write.
+ *
+ * @param cache Cache to use.
+ * @param cluster First cluster of the run.
+ * @param buf Source buffer.
+ * @param length Number of bytes to write from the start of the run.
+ * @return int 0 on success, -1 on failure.
+ */
+int cache_write_range(struct block_cache *cache, int cluster, const void *buf,
+                      long length) {
+  struct cache_batch batch;
+  cache_batch_init(&batch);
+  cache_queue_write(cache, &batch, cluster, buf, length);
+  return cache_submit(cache, &batch);
+}
+
+/**
+ * @brief Read the clusters of a list into one buffer.
+ *
+ * The list is split into runs of consecutive clusters, the image reads of
+ * all runs are submitted together.
+ *
+ * @param cache Cache to use.
+ * @param clusters Cluster IDs in buffer order.
+ * @param buf Destination buffer.
+ * @param length Number of bytes, the last cluster may be partial.
+ * @return int 0 on success, -1 on failure.
+ */
+int cache_read_clusters(struct block_cache *cache, const int *clusters,
+                        void *buf, long length) {
+  uint8_t *out = buf;
+  struct cache_batch batch;
+  cache_batch_init(&batch);
+  int cluster_count = (length + cache->cluster_size - 1) / cache->cluster_size;
+  for (int i = 0; i < cluster_count;) {
+    int run = 1;
+    while (i + run < cluster_count && clusters[i + run] == clusters[i] + run)
+      run++;
+    long offset = (long)i * cache->cluster_size;
+    long bytes = (long)run * cache->cluster_size;
+    if (offset + bytes > length)
+      bytes = length - offset;
+    cache_queue_read(cache, &batch, clusters[i], out + offset, bytes);
+    i += run;
+  }
+  return cache_submit(cache, &batch);
+}
+
+/**
+ * @brief Write one buffer to the clusters of a list.
+ *
+ * The list is split into runs of consecutive clusters, the image writes of
+ * all runs are submitted together.
+ *
+ * @param cache Cache to use.
+ * @param clusters Cluster IDs in buffer order.
+ * @param buf Source buffer.
+ * @param length Number of bytes, the last cluster may be partial.
+ * @return int 0 on success, -1 on failure.
+ */
+int cache_write_clusters(struct block_cache *cache, const int *clusters,
+                         const void *buf, long length) {
+  const uint8_t *in = buf;
+  struct cache_batch batch;
+  cache_batch_init(&batch);
+  int cluster_count = (length + cache->cluster_size - 1) / cache->cluster_size;
+  for (int i = 0; i < cluster_count;) {
+    int run = 1;
+    while (i + run < cluster_count && clusters[i + run] == clusters[i] + run)
+      run++;
+    long offset = (long)i * cache->cluster_size;
+    long bytes = (long)run * cache->cluster_size;
+    if (offset + bytes > length)
+      bytes = length - offset;
+    cache_queue_write(cache, &batch, clusters[i], in + offset, bytes);
+    i += run;
+  }
+  return cache_submit(cache, &batch);
+}
+
+/**
+ * @brief Whether a run holds cached clusters which differ from the image.
+ *
+ * @param cache Cache to use.
+ * @param cluster First cluster of the run.
+ * @param count Number of clusters.
+ * @return bool true if a cluster of the run is dirty in the cache.
+ */
+bool cache_run_dirty(struct block_cache *cache, int cluster, int count) {
+  if (!cache->blocks || in_place(cache))
+    return false;
+  bool dirty = false;
+  pthread_mutex_lock(&cache->lock);
+  for (int c = cluster; c < cluster + count && !dirty; c++) {
+    struct cache_block *block = lookup(cache, c);
+    dirty = block && block->dirty;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return dirty;
+}
+
+/**
+ * @brief Forget a cluster without writing it back, used when it is freed.
+ *
+ * @param cache Cache to use.
+ * @param cluster Cluster ID.
+ */
+void cache_invalidate(struct block_cache *cache, int cluster) {
+  if (!cache->blocks)
+    return;
+  struct cache_block *block = lookup(cache, cluster);
+  if (!block || block->pins)
+    return;
+  hash_remove(cache, block);
+  block->cluster = -1;
+  block->dirty = false;
+
+  // unused blocks are the first candidates for eviction
+  lru_unlink(cache, block);
+  block->prev = cache->lru_tail;
+  if (cache->lru_tail)
+    cache->lru_tail->next = block;
+  cache->lru_tail = block;
+  if (!cache->lru_head)
+    cache->lru_head = block;
+}
+
+/**
+ * @brief Compare two blocks by cluster ID, for qsort.
+ */
+static int compare_blocks(const void *a, const void *b) {
+  const struct cache_block *x = *(struct cache_block *const *)a;
+  const struct cache_block *y = *(struct cache_block *const *)b;
+  return (x->cluster > y->cluster) - (x->cluster < y->cluster);
+}
+
+/**
+ * @brief Write blocks of consecutive clusters with one vectored write.
+ *
+ * @param cache Cache holding the blocks.
+ * @param blocks Blocks sorted by cluster, each one cluster after the previous.
+ * @param count Number of blocks, at most STORAGE_IOV_MAX.
+ * @return int 0 on success, -1 on write failure.
+ */
+static int write_blocks(struct block_cache *cache, struct cache_block **blocks,
+                        int count) {
+  struct iovec iov[STORAGE_IOV_MAX];
+  for (int i = 0; i < count; i++) {
+    iov[i].iov_base = blocks[i]->data;
+    iov[i].iov_len = cache->cluster_size;
+  }
+  if (storage_writev(cache->storage, iov, count,
+                     image_offset(cache, blocks[0]->cluster, 0)))
+    return -1;
+  for (int i = 0; i < count; i++)
+    blocks[i]->dirty = false;
+  return 0;
+}
+
+/**
+ * @brief Start the write back of a commit.
+ *
+ * Blocks allocated past the capacity which are clean again are freed. Until
+ * the next call, cache_mark_dirty() only marks the blocks written from now
+ * on.
+ *
+ * @param cache Cache to flush.
+ */
+void cache_begin_flush(struct block_cache *cache) {
+  if (!cache->blocks)
+    return;
+  drop_extra(cache, true);
+  cache->flush_count++;
+}
+
+/**
+ * @brief Whether a block is written by a flush, the block is recorded as
+ * written by the current write back if so.
+ *
+ * @param cache Cache holding the block.
+ * @param block Block to check.
+ * @param file_data_only Only blocks holding file contents are written.
+ * @return bool true if the block is to be written.
+ */
+static bool to_flush(struct block_cache *cache, struct cache_block *block,
+                     bool file_data_only) {
+  if (block->cluster < 0 || !block->dirty ||
+      (file_data_only && !block->file_data))
+    return false;
+  block->flushed = cache->flush_count;
+  cache->data_written |= block->file_data;
+  return true;
+}
+
+/**
+ * @brief Write dirty blocks back to the image in cluster order.
+ *
+ * Dirty blocks of consecutive clusters go out with one vectored write.
+ *
+ * @param cache Cache to flush.
+ * @param file_data_only Write only the blocks holding file contents.
+ * @return int 0 on success, -1 if a write failed.
+ */
+static int flush_blocks(struct block_cache *cache, bool file_data_only) {
+  struct cache_block **dirty = malloc((cache->capacity + cache->extra_count) *
+                                      sizeof(struct cache_block *));
+  int dirty_count = 0, failed = 0;
+  for (int i = 0; i < cache->capacity; i++) {
+    struct cache_block *block = &cache->blocks[i];
+    if (to_flush(cache, block, file_data_only)) {
+      if (dirty)
+        dirty[dirty_count++] = block;
+      else
+        failed |= write_block(cache, block);
+    }
+  }
+  for (struct cache_block *block = cache->extra; block;
+       block = block->extra_next) {
+    if (to_flush(cache, block, file_data_only)) {
+      if (dirty)
+        dirty[dirty_count++] = block;
+      else
+        failed |= write_block(cache, block);
+    }
+  }
+  if (!dirty)
+    return failed;
+
+  qsort(dirty, dirty_count, sizeof(struct cache_block *), compare_blocks);
+  for (int i = 0; i < dirty_count;) {
+    int run = 1;
+    while (i + run < dirty_count && run < STORAGE_IOV_MAX &&
+           dirty[i + run]->cluster == dirty[i]->cluster + run)
+      run++;
+    failed |= write_blocks(cache, dirty + i, run);
+    i += run;
+  }
+  free(dirty);
+  return failed;
+}
+
+/**
+ * @brief Write the dirty blocks holding file contents back to the image.
+ *
+ * Commits write file data in place ahead of the metadata pointing at it, so
+ * only metadata goes through the journal (ordered mode). Does not flush the
+ * storage, the caller does that before the metadata is committed.
+ *
+ * @param cache Cache to flush.
+ * @return int 1 if file data reached the image since the previous call,
+ * cached or not, 0 if none did, -1 if a write failed.
+ */
+int cache_flush_data(struct block_cache *cache) {
+  if (cache->blocks && flush_blocks(cache, true))
+    return -1;
+  int written = cache->data_written;
+  cache->data_written = false;
+  return written;
+}
+
+/**
+ * @brief Write all dirty blocks back to the image in cluster order.
+ *
+ * In a commit, after cache_flush_data(), only metadata is left. Does not
+ * flush the storage, the caller decides when to do that.
+ *
+ * @param cache Cache to flush.
+ * @return int 0 on success, -1 if a write failed.
+ */
+int cache_flush(struct block_cache *cache) {
+  if (!cache->blocks)
+    return 0;
+  return flush_blocks(cache, false);
+}
+
+/**
+ * @brief Mark the blocks written since cache_begin_flush() dirty again after
+ * a failed commit.
+ *
+ * The blocks hold the newest contents, the next commit writes them again.
+ * Blocks which were clean already are left alone. File data written by the
+ * failed commit may not be durable, the next cache_flush_data() reports it.
+ *
+ * @param cache Cache to mark.
+ */
+void cache_mark_dirty(struct block_cache *cache) {
+  cache->data_written = true;
+  if (!cache->blocks)
+    return;
+  for (int i = 0; i < cache->capacity; i++) {
+    if (cache->blocks[i].cluster >= 0 &&
+        cache->blocks[i].flushed == cache->flush_count)
+      cache->blocks[i].dirty = true;
+  }
+  for (struct cache_block *block = cache->extra; block;
+       block = block->extra_next) {
+    if (block->cluster >= 0 && block->flushed == cache->flush_count)
+      block->dirty = true;
+  }
+}
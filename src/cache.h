@@ -0,0 +1,99 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "storage.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CACHE_DEFAULT_BLOCKS 1024 // 4 MiB with 4 KiB clusters
+
+// One cached cluster
+struct cache_block {
+  int cluster;                    // cluster ID held by the block, -1 if unused
+  uint8_t *data;                  // cluster contents
+  bool dirty;                     // changed since it was last written
+  bool file_data;                 // holds file contents, not metadata
+  long flushed;                   // write back which last wrote the block
+  int pins;                       // users currently holding the block
+  struct cache_block *prev, *next; // LRU list, most recently used first
+  struct cache_block *hash_next;  // next block in the same hash bucket
+  struct cache_block *extra_next; // next block allocated past capacity
+};
+
+// Fixed size write-back cache of data clusters with LRU eviction. Reading
+// may run on several threads, writing only while nothing else can run.
+struct block_cache {
+  struct cache_block *blocks;   // all blocks, capacity of them
+  uint8_t *memory;              // backing memory of all block data
+  int capacity;                 // number of blocks
+  struct cache_block **buckets; // hash table keyed by cluster ID
+  int bucket_count;
+  struct cache_block *lru_head; // most recently used block
+  struct cache_block *lru_tail; // least recently used block
+  struct storage *storage;      // image the clusters are read from
+  long data_start;              // byte offset of cluster 0 in the image
+  int cluster_size;             // size of one cluster in bytes
+  // dirty blocks wait for cache_flush: they are never evicted, the cache
+  // grows past capacity instead, and addressable images are cached as well
+  bool deferred;
+  // a batch which may be discarded is open: writes of uncached clusters are
+  // cached as well instead of going to the image
+  bool holding;
+  long flush_count;             // write backs started by cache_begin_flush
+  bool data_written;            // file data reached the image since the
+                                // last cache_flush_data
+  struct cache_block *extra;    // blocks allocated past capacity
+  int extra_count;
+  long hits, misses;            // lookup statistics
+  pthread_mutex_t lock;         // taken by lookups, see cache_get
+};
+
+#define CACHE_BATCH_REQUESTS 64 // image transfers submitted together at most
+
+// Image transfers of uncached stretches, collected by cache_queue_read and
+// cache_queue_write and submitted together, so the storage can keep them in
+// flight at the same time
+struct cache_batch {
+  struct io_request requests[CACHE_BATCH_REQUESTS];
+  int count;
+  int failed; // a transfer failed since cache_batch_init
+};
+
+int cache_init(struct block_cache *cache, int capacity, int cluster_size);
+void cache_destroy(struct block_cache *cache);
+void cache_reset(struct block_cache *cache, struct storage *storage,
+                 long data_start);
+
+struct cache_block *cache_get(struct block_cache *cache, int cluster,
+                              bool read);
+void cache_put(struct block_cache *cache, struct cache_block *block,
+               bool dirty);
+int cache_read(struct block_cache *cache, int cluster, int offset, void *buf,
+               int length);
+int cache_write(struct block_cache *cache, int cluster, int offset,
+                const void *buf, int length);
+int cache_write_data(struct block_cache *cache, int cluster, int offset,
+                     const void *buf, int length);
+void cache_batch_init(struct cache_batch *batch);
+void cache_queue_read(struct block_cache *cache, struct cache_batch *batch,
+                      int cluster, void *buf, long length);
+void cache_queue_write(struct block_cache *cache, struct cache_batch *batch,
+                       int cluster, const void *buf, long length);
+int cache_submit(struct block_cache *cache, struct cache_batch *batch);
+int cache_read_range(struct block_cache *cache, int cluster, void *buf,
+                     long length);
+int cache_write_range(struct block_cache *cache, int cluster, const void *buf,
+                      long length);
+int cache_read_clusters(struct block_cache *cache, const int *clusters,
+                        void *buf, long length);
+int cache_write_clusters(struct block_cache *cache, const int *clusters,
+                         const void *buf, long length);
+bool cache_run_dirty(struct block_cache *cache, int cluster, int count);
+void cache_invalidate(struct block_cache *cache, int cluster);
+void cache_begin_flush(struct block_cache *cache);
+int cache_flush_data(struct block_cache *cache);
+int cache_flush(struct block_cache *cache);
+void cache_mark_dirty(struct block_cache *cache);
+
+#endif
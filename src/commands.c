@@ -1,11 +1,24 @@
 #include "commands.h"
 #include "dulafs.h"
 #include "repl.h"
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define COPY_CHUNK_CLUSTERS 256 // clusters moved at once by cp, incp, read
+                                // and write, 1 MiB
+#define LOAD_GROUP_COMMANDS 1024 // script commands committed together by load
+#define TREE_MAX_WORKERS 16      // threads of incp -r and outcp -r
+#define INCP_WINDOW_FILES 64     // files incp -r reads ahead of the import
 
 // Command function implementations
 
@@ -14,15 +27,22 @@
  *
  * Parses the size argument (handling K/M suffixes), initializes the superblock,
  * writes it to the start of the file, and creates the root directory.
+ * Optional "--extents" argument selects the extent based inode layout.
  *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param argc Number of arguments.
  * @param argv Array of arguments.
  * @return int Error code.
  */
-int cmd_format(int argc, char **argv) {
+int cmd_format(struct SystemState *mount, struct session *session, int argc,
+               char **argv) {
   int multiplier = 1, length;
+  int features = 0;
 
-  if (argc != 2) {
+  if (argc == 3 && !strcmp(argv[2], "--extents")) {
+    features |= SB_FEATURE_EXTENTS;
+  } else if (argc != 2) {
     return ERR_INVALID_ARGC;
   }
 
@@ -48,111 +68,173 @@ int cmd_format(int argc, char **argv) {
     return ERR_INVALID_SIZE;
   }
   size *= multiplier;
-  format((int)size);
+  format(mount, session, (int)size, features);
   return ERR_SUCCESS;
 }
 
+/**
+ * @brief Copy data clusters into newly allocated clusters of a node.
+ *
+ * The data moves COPY_CHUNK_CLUSTERS clusters at a time, each chunk is read
+ * and written one run of consecutive clusters per call.
+ *
+ * @param mount Mount to work on.
+ * @param new_inode Empty node of the same size as the original.
+ * @param clusters Data clusters of the original in file order.
+ * @param cluster_count Number of data clusters.
+ * @return int Error code.
+ */
+static int copy_clusters(struct SystemState *mount, struct inode *new_inode,
+                         const int *clusters, int cluster_count) {
+  if (!cluster_count)
+    return ERR_SUCCESS;
+  uint8_t *buffer = malloc(COPY_CHUNK_CLUSTERS * CLUSTER_SIZE);
+  if (!buffer)
+    return ERR_MEMORY_ALLOCATION;
+  int *new_clusters = assign_node_clusters(mount, new_inode);
+  if (!new_clusters) {
+    free(buffer);
+    return ERR_CLUSTER_FULL;
+  }
+
+  int failed = 0;
+  for (int first = 0; first < cluster_count; first += COPY_CHUNK_CLUSTERS) {
+    long offset = (long)first * CLUSTER_SIZE;
+    long bytes = new_inode->file_size - offset;
+    if (bytes > (long)COPY_CHUNK_CLUSTERS * CLUSTER_SIZE)
+      bytes = (long)COPY_CHUNK_CLUSTERS * CLUSTER_SIZE;
+    failed |= cache_read_clusters(&mount->cache, clusters + first, buffer,
+                                  bytes);
+    failed |= cache_write_clusters(&mount->cache, new_clusters + first, buffer,
+                                   bytes);
+  }
+  free(buffer);
+  free(new_clusters);
+  return failed ? ERR_UNKNOWN : ERR_SUCCESS;
+}
+
+/**
+ * @brief Make a node share the data clusters of another one.
+ *
+ * Every cluster gains a reference in the reference count table, only the
+ * block map of the new node is written.
+ *
+ * @param mount Mount to work on.
+ * @param new_inode Empty node of the same size as the original.
+ * @param clusters Data clusters of the original in file order.
+ * @param cluster_count Number of data clusters.
+ * @return int Error code, nothing stays shared on failure.
+ */
+static int reflink_clusters(struct SystemState *mount, struct inode *new_inode,
+                            const int *clusters, int cluster_count) {
+  if (!cluster_count)
+    return ERR_SUCCESS;
+  int shared = 0;
+  while (shared < cluster_count &&
+         !refcount_share(&mount->refcounts, clusters[shared]))
+    shared++;
+  int result = shared < cluster_count
+                   ? ERR_UNKNOWN
+                   : map_node_clusters(mount, new_inode, clusters,
+                                       cluster_count);
+  if (result != ERR_SUCCESS) {
+    while (shared > 0)
+      refcount_unshare(&mount->refcounts, clusters[--shared]);
+  }
+  return result;
+}
+
 /**
  * @brief Copies a file within the virtual filesystem.
  *
- * Resolves source inode, allocates a new inode and clusters, copies data
- * cluster-by-cluster from source to destination, and adds the new entry to the
- * target directory.
+ * Resolves source inode, allocates a new inode and adds the new entry to the
+ * target directory. On images with a reference count table the copy shares
+ * the data clusters of the source, otherwise new clusters are allocated and
+ * the data is copied cluster-by-cluster.
  *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param argc Number of arguments.
  * @param argv Array of arguments.
  * @return int Error code.
  */
-int cmd_cp(int argc, char **argv) {
-  if (!unused_inodes_left())
+int cmd_cp(struct SystemState *mount, struct session *session, int argc,
+           char **argv) {
+  if (!unused_inodes_left(mount))
     return ERR_INODE_FULL;
   // get inode to copy
-  int original_inode_id = path_to_inode(argv[1]);
+  int original_inode_id = path_to_inode(mount, session, argv[1]);
   if (original_inode_id < 0)
     return ERR_NO_SOURCE;
-  struct inode original_node = get_inode(original_inode_id);
+  struct inode original_node = get_inode(mount, original_inode_id);
   if (!original_node.is_file)
     return ERR_NOT_A_FILE;
 
   // check if there is space for the file
+  bool reflink = mount->sb.features & SB_FEATURE_REFCOUNTS;
   if (original_node.file_size > MAX_FILE_SIZE) {
     return ERR_FILE_TOO_LARGE;
   }
-  if (!enough_empty_clusters(original_node.file_size)) {
+  if (reflink ? mount->sb.free_cluster_count <
+                    mapping_clusters_needed(mount, original_node.file_size)
+              : !enough_empty_clusters(mount, original_node.file_size)) {
     return ERR_CLUSTER_FULL;
   };
 
   // separate destination path and filename
   char *file_name = NULL;
-  int target_dir_id = get_dir_id(argv[2], &file_name);
+  int target_dir_id = get_dir_id(mount, session, argv[2], &file_name);
   if (target_dir_id < 0) {
     return -target_dir_id;
   }
 
-  struct inode target_dir = get_inode(target_dir_id);
+  struct inode target_dir = get_inode(mount, target_dir_id);
 
   // check if file already exists
-  if (contains_file(&target_dir, file_name)) {
+  if (contains_file(mount, &target_dir, file_name)) {
     return ERR_FILE_EXISTS;
   }
 
   // create new inode
-  int new_inode_id = assign_empty_inode();
+  int new_inode_id = create_file_node(mount, original_node.file_size);
   if (new_inode_id == -1) {
     return ERR_INODE_FULL;
   }
-  struct inode new_inode = {0};
-  new_inode.id = new_inode_id;
-  new_inode.file_size = original_node.file_size;
-  new_inode.is_file = 1;
-  write_inode(&new_inode);
-
-  int *new_clusters = assign_node_clusters(&new_inode);
-  int *original_clusters = get_node_clusters(&original_node);
-  if (original_clusters == NULL) {
-    clear_inode(&new_inode);
-    free(original_clusters);
-    return ERR_MEMORY_ALLOCATION;
-  }
-
-  // copy the data to new inode
+  struct inode new_inode = get_inode(mount, new_inode_id);
   int cluster_count =
       (original_node.file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
-  int offset;
-  uint8_t *current_cluster_data = malloc(CLUSTER_SIZE);
-  for (int cluster_index = 0; cluster_index < cluster_count; cluster_index++) {
-    // Zero out the buffer to avoid writing uninitialized data
-    memset(current_cluster_data, 0, CLUSTER_SIZE);
-
-    // Calculate bytes to read for this cluster
-    int bytes_to_read = CLUSTER_SIZE;
-    if (cluster_index == cluster_count - 1 &&
-        original_node.file_size % CLUSTER_SIZE != 0) {
-      bytes_to_read = original_node.file_size % CLUSTER_SIZE;
-    }
 
-    // read from original
-    offset = original_clusters[cluster_index] * CLUSTER_SIZE +
-             g_system_state.sb.data_start_address;
-    fseek(g_system_state.file_ptr, offset, SEEK_SET);
-    fread(current_cluster_data, bytes_to_read, 1, g_system_state.file_ptr);
+  int *original_clusters = get_node_clusters(mount, &original_node);
+  if (original_clusters == NULL && cluster_count) {
+    clear_inode(mount, &new_inode);
+    return ERR_MEMORY_ALLOCATION;
+  }
 
-    // write to new one
-    offset = new_clusters[cluster_index] * CLUSTER_SIZE +
-             g_system_state.sb.data_start_address;
-    fseek(g_system_state.file_ptr, offset, SEEK_SET);
-    fwrite(current_cluster_data, bytes_to_read, 1, g_system_state.file_ptr);
+  int result;
+  if (reflink) {
+    result = reflink_clusters(mount, &new_inode, original_clusters,
+                              cluster_count);
+  } else {
+    result = copy_clusters(mount, &new_inode, original_clusters, cluster_count);
   }
-  free(current_cluster_data);
   free(original_clusters);
-  free(new_clusters);
+  if (result != ERR_SUCCESS) {
+    // the node maps no clusters, so clearing it frees nothing else
+    new_inode.file_size = 0;
+    clear_inode(mount, &new_inode);
+    return result;
+  }
 
   struct directory_item item = {0};
   item.inode = new_inode_id;
   strlcpy(item.item_name, file_name, sizeof(item.item_name));
 
-  add_record_to_dir(item, &target_dir);
-  fflush(g_system_state.file_ptr);
+  result = add_record_to_dir(mount, item, &target_dir);
+  if (result != ERR_SUCCESS) {
+    new_inode = get_inode(mount, new_inode_id);
+    clear_inode(mount, &new_inode);
+    return result;
+  }
 
   return ERR_SUCCESS;
 }
@@ -163,55 +245,70 @@ int cmd_cp(int argc, char **argv) {
  * Creates a new directory entry in the destination pointing to the source
  * inode, then removes the original directory entry from the source directory.
  *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param argc Number of arguments.
  * @param argv Array of arguments.
  * @return int Error code.
  */
-int cmd_mv(int argc, char **argv) {
+int cmd_mv(struct SystemState *mount, struct session *session, int argc,
+           char **argv) {
   // get source node
   char *from_file_name = NULL;
-  int from_dir_id = get_dir_id(argv[1], &from_file_name);
+  int from_dir_id = get_dir_id(mount, session, argv[1], &from_file_name);
   if (from_dir_id < 0) {
     return ERR_NO_SOURCE;
   }
   if (!from_file_name || from_file_name[0] == '\0') {
     return ERR_NO_SOURCE;
   }
-  struct inode from_dir_inode = get_inode(from_dir_id);
+  if (!strcmp(from_file_name, ".") || !strcmp(from_file_name, "..")) {
+    return ERR_CANNOT_REMOVE_DOT;
+  }
+  struct inode from_dir_inode = get_inode(mount, from_dir_id);
 
   // Find the source file in its parent directory
-  int from_inode_id = path_to_inode(argv[1]);
+  int from_inode_id = path_to_inode(mount, session, argv[1]);
 
   if (from_inode_id < 0) {
     return -from_inode_id;
   }
 
-  struct inode from_inode = get_inode(from_inode_id);
+  struct inode from_inode = get_inode(mount, from_inode_id);
 
   // Get destination directory and filename
   char *to_file_name = NULL;
-  int to_dir_id = get_dir_id(argv[2], &to_file_name);
+  int to_dir_id = get_dir_id(mount, session, argv[2], &to_file_name);
   if (to_dir_id < 0) {
     return -to_dir_id;
   }
 
-  struct inode to_dir_inode = get_inode(to_dir_id);
-  if (contains_file(&to_dir_inode, to_file_name)) {
+  struct inode to_dir_inode = get_inode(mount, to_dir_id);
+  if (contains_file(mount, &to_dir_inode, to_file_name)) {
     return ERR_FILE_EXISTS;
   }
 
   struct directory_item new_record = {0};
   new_record.inode = from_inode_id;
   strlcpy(new_record.item_name, to_file_name, sizeof(char[DIR_NAME_SIZE]));
-  int ret = add_record_to_dir(new_record, &to_dir_inode);
+  int ret = add_record_to_dir(mount, new_record, &to_dir_inode);
   if (ret) {
     return ret;
   }
 
   // Reload the source dir inode because destination dir may be same as source
   // dir, changing it in file but not the struct in code
-  from_dir_inode = get_inode(from_dir_id);
-  delete_item(&from_dir_inode, from_file_name);
+  from_dir_inode = get_inode(mount, from_dir_id);
+  delete_item(mount, &from_dir_inode, from_file_name);
+
+  // a moved directory gets its new parent in ".."
+  if (!from_inode.is_file && from_dir_id != to_dir_id) {
+    struct directory_item parent_record = {0};
+    parent_record.inode = to_dir_id;
+    strlcpy(parent_record.item_name, "..", sizeof(parent_record.item_name));
+    dir_write_item(mount, &from_inode, 0, &parent_record);
+    dcache_invalidate(&mount->dcache, from_inode_id, "..");
+  }
 
   return ERR_SUCCESS;
 }
@@ -222,14 +319,17 @@ int cmd_mv(int argc, char **argv) {
  * Locates the parent directory and calls delete_item to remove the entry.
  * If the inode reference count drops to zero, the inode and its data are freed.
  *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param argc Number of arguments.
  * @param argv Array of arguments.
  * @return int Error code.
  */
-int cmd_rm(int argc, char **argv) {
+int cmd_rm(struct SystemState *mount, struct session *session, int argc,
+           char **argv) {
 
   char *file_name = NULL;
-  int parent_dir_id = get_dir_id(argv[1], &file_name);
+  int parent_dir_id = get_dir_id(mount, session, argv[1], &file_name);
   if (parent_dir_id < 0) {
     return -parent_dir_id;
   }
@@ -237,61 +337,88 @@ int cmd_rm(int argc, char **argv) {
     return ERR_FILE_NOT_FOUND;
   }
 
-  int source_inode_id = path_to_inode(argv[1]);
+  int source_inode_id = path_to_inode(mount, session, argv[1]);
   if (source_inode_id < 0) {
     return ERR_FILE_NOT_FOUND;
   }
-  struct inode source_inode = get_inode(source_inode_id);
+  struct inode source_inode = get_inode(mount, source_inode_id);
   if (!source_inode.is_file) {
     return ERR_NOT_A_FILE;
   }
 
-  struct inode parent_dir = get_inode(parent_dir_id);
-  int result = delete_item(&parent_dir, file_name);
+  struct inode parent_dir = get_inode(mount, parent_dir_id);
+  int result = delete_item(mount, &parent_dir, file_name);
 
   return result;
 }
 
 /**
- * @brief Creates a new directory.
- *
- * Allocates a new inode, initializes it as a directory (adding '.' and '..'
- * entries), and adds a reference to it in the parent directory.
+ * @brief Create a directory and add it into its parent.
  *
- * @param argc Number of arguments.
- * @param argv Array of arguments.
- * @return int Error code.
+ * @param mount Mount to work on.
+ * @param parent_dir_id Inode ID of the parent directory.
+ * @param dir_name Name of the new directory.
+ * @return int Inode ID of the new directory, or negative error code.
  */
-int cmd_mkdir(int argc, char **argv) {
-  if (!unused_inodes_left())
-    return ERR_INODE_FULL;
-  char *dir_name = NULL;
-  int parent_dir_id = get_dir_id(argv[1], &dir_name);
-  if (parent_dir_id < 0) {
-    return -parent_dir_id;
-  }
-
-  struct inode parent_inode = get_inode(parent_dir_id);
+static int make_dir(struct SystemState *mount, int parent_dir_id,
+                    char *dir_name) {
+  if (!unused_inodes_left(mount))
+    return -ERR_INODE_FULL;
+  if (!enough_empty_clusters(mount, CLUSTER_SIZE))
+    return -ERR_CLUSTER_FULL;
+
+  struct inode parent_inode = get_inode(mount, parent_dir_id);
   if (parent_inode.is_file) {
-    return ERR_PATH_NOT_EXIST;
+    return -ERR_PATH_NOT_EXIST;
   }
 
   // check if the file name already exists
-  if (contains_file(&parent_inode, dir_name)) {
-    return ERR_FILE_EXISTS;
+  if (contains_file(mount, &parent_inode, dir_name)) {
+    return -ERR_FILE_EXISTS;
   }
 
   // create new directory node
-  int new_node_id = create_dir_node(parent_dir_id);
+  int new_node_id = create_dir_node(mount, parent_dir_id);
+  if (new_node_id < 0)
+    return -ERR_INODE_FULL;
 
   // create new record to add
   struct directory_item dir_record = {0};
   dir_record.inode = new_node_id;
   strlcpy(dir_record.item_name, dir_name, sizeof(dir_record.item_name));
 
-  add_record_to_dir(dir_record, &parent_inode);
+  int result = add_record_to_dir(mount, dir_record, &parent_inode);
+  if (result != ERR_SUCCESS) {
+    struct inode new_inode = get_inode(mount, new_node_id);
+    clear_inode(mount, &new_inode);
+    return -result;
+  }
 
-  return ERR_SUCCESS;
+  return new_node_id;
+}
+
+/**
+ * @brief Creates a new directory.
+ *
+ * Allocates a new inode, initializes it as a directory (adding '.' and '..'
+ * entries), and adds a reference to it in the parent directory.
+ *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
+ * @param argc Number of arguments.
+ * @param argv Array of arguments.
+ * @return int Error code.
+ */
+int cmd_mkdir(struct SystemState *mount, struct session *session, int argc,
+              char **argv) {
+  char *dir_name = NULL;
+  int parent_dir_id = get_dir_id(mount, session, argv[1], &dir_name);
+  if (parent_dir_id < 0) {
+    return -parent_dir_id;
+  }
+
+  int new_node_id = make_dir(mount, parent_dir_id, dir_name);
+  return new_node_id < 0 ? -new_node_id : ERR_SUCCESS;
 }
 
 /**
@@ -300,14 +427,17 @@ int cmd_mkdir(int argc, char **argv) {
  * Verifies the target is a directory and not '.' or '..', then calls
  * delete_item
  *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param argc Number of arguments.
  * @param argv Array of arguments.
  * @return int Error code.
  */
-int cmd_rmdir(int argc, char **argv) {
+int cmd_rmdir(struct SystemState *mount, struct session *session, int argc,
+              char **argv) {
 
   char *dir_name = NULL;
-  int parent_dir_id = get_dir_id(argv[1], &dir_name);
+  int parent_dir_id = get_dir_id(mount, session, argv[1], &dir_name);
   if (!strcmp(dir_name, ".") || !strcmp(dir_name, "..")) {
     return ERR_CANNOT_REMOVE_DOT;
   }
@@ -315,8 +445,8 @@ int cmd_rmdir(int argc, char **argv) {
     return -parent_dir_id;
   }
 
-  struct inode parent_inode = get_inode(parent_dir_id);
-  int result = delete_item(&parent_inode, dir_name);
+  struct inode parent_inode = get_inode(mount, parent_dir_id);
+  int result = delete_item(mount, &parent_inode, dir_name);
 
   return result;
 }
@@ -327,66 +457,208 @@ int cmd_rmdir(int argc, char **argv) {
  * Reads directory entries from the target inode's data clusters and prints:
  * name, inode ID, size, and reference count for each item.
  *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param argc Number of arguments.
  * @param argv Array of arguments.
  * @return int Error code.
  */
-int cmd_ls(int argc, char **argv) {
+int cmd_ls(struct SystemState *mount, struct session *session, int argc,
+           char **argv) {
 
   struct inode curr_inode;
   if (argc == 2) {
-    int inode_id = path_to_inode(argv[1]);
+    int inode_id = path_to_inode(mount, session, argv[1]);
     if (inode_id < 0)
       return -inode_id;
-    curr_inode = get_inode(inode_id);
+    curr_inode = get_inode(mount, inode_id);
   } else {
-    curr_inode = get_inode(g_system_state.curr_node_id);
+    curr_inode = get_inode(mount, session->curr_node_id);
   }
 
-  struct directory_item *dir_content = get_directory_items(&curr_inode);
+  struct directory_item *dir_content = get_directory_items(mount, &curr_inode);
   if (!dir_content)
     return ERR_MEMORY_ALLOCATION;
   int record_count = curr_inode.file_size / sizeof(struct directory_item);
   for (int i = 0; i < record_count; i++) {
-    struct inode item_inode = get_inode(dir_content[i].inode);
+    struct inode item_inode = get_inode(mount, dir_content[i].inode);
     const char *color = item_inode.is_file ? "" : "\033[34m";
-    printf("%s%-12s\033[0m | inode: %3d | size: %6d bytes | refs: %d\n", color,
-           dir_content[i].item_name, dir_content[i].inode, item_inode.file_size,
-           item_inode.references);
+    fprintf(session->out,
+            "%s%-12s\033[0m | inode: %3d | size: %6d bytes | refs: %d\n", color,
+            dir_content[i].item_name, dir_content[i].inode,
+            item_inode.file_size, item_inode.references);
   }
   free(dir_content);
   return ERR_SUCCESS;
 }
 
+/**
+ * @brief Print file data, zero bytes are printed by white square.
+ *
+ * @param session Session the data is printed to.
+ * @param data Data to print.
+ * @param length Number of bytes.
+ */
+static void print_data(struct session *session, const uint8_t *data,
+                       long length) {
+  for (long i = 0; i < length; i++) {
+    if (data[i] == 0) {
+      // Unicode white square in UTF-8 to represent zero byte
+      fputs("\xE2\x96\xA1", session->out);
+    } else {
+      fputc(data[i], session->out);
+    }
+  }
+}
+
 /**
  * @brief Displays file contents.
  *
- * Reads all data bytes from the file's allocated clusters and prints them to
- * stdout. Zero bytes are printed by white square.
+ * Streams the file's clusters chunk by chunk and prints them to stdout, so
+ * output starts immediately and memory use does not grow with the file. Zero
+ * bytes are printed by white square.
  *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param argc Number of arguments.
  * @param argv Array of arguments.
  * @return int Error code.
  */
-int cmd_cat(int argc, char **argv) {
-  int node_id = path_to_inode(argv[1]);
+int cmd_cat(struct SystemState *mount, struct session *session, int argc,
+            char **argv) {
+  int node_id = path_to_inode(mount, session, argv[1]);
   if (node_id < 0)
     return -node_id;
-  struct inode inode = get_inode(node_id);
-  uint8_t *data = (uint8_t *)get_node_data(&inode);
-  // printf("inode size: %d\n", inode.file_size);
-  for (int i = 0; i < inode.file_size; i++) {
-    if (data[i] == 0) {
-      printf("\xE2\x96\xA1"); // Unicode white square in UTF-8 to represent zero
-                              // byte
-    } else {
-      putchar(data[i]);
-    }
+  struct inode inode = get_inode(mount, node_id);
+  struct node_reader reader;
+  if (node_reader_open(mount, &reader, &inode)) {
+    node_reader_close(&reader);
+    return ERR_MEMORY_ALLOCATION;
   }
-  putchar('\n');
 
-  free(data);
-  return ERR_SUCCESS;
+  const uint8_t *data;
+  long length;
+  while ((length = node_reader_next(&reader, &data)) > 0)
+    print_data(session, data, length);
+  fputc('\n', session->out);
+
+  node_reader_close(&reader);
+  return length < 0 ? ERR_UNKNOWN : ERR_SUCCESS;
+}
+
+/**
+ * @brief Parse a byte offset or count argument.
+ *
+ * @param text Argument.
+ * @param value Output value.
+ * @return int 0 on success, -1 if the argument is not a non-negative number.
+ */
+static int parse_bytes(const char *text, long *value) {
+  char *end;
+  errno = 0;
+  *value = strtol(text, &end, 10);
+  return *end != '\0' || end == text || errno || *value < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Displays a range of a file.
+ *
+ * Only the clusters of the range are looked up and read, so reading from a
+ * large file costs the same as from a small one. The output stops at the end
+ * of the file.
+ *
+ * Usage: read <path> <offset> <length>
+ *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
+ * @param argc Number of arguments.
+ * @param argv Array of arguments.
+ * @return int Error code.
+ */
+int cmd_read(struct SystemState *mount, struct session *session, int argc,
+             char **argv) {
+  long offset, length;
+  if (parse_bytes(argv[2], &offset) || parse_bytes(argv[3], &length))
+    return ERR_INVALID_SIZE;
+  struct file_handle fh;
+  int result = file_open(mount, session, &fh, argv[1]);
+  if (result != ERR_SUCCESS)
+    return result;
+  uint8_t *buffer = malloc(COPY_CHUNK_CLUSTERS * CLUSTER_SIZE);
+  if (!buffer) {
+    file_close(&fh);
+    return ERR_MEMORY_ALLOCATION;
+  }
+
+  long done = 0;
+  while (done < length) {
+    long chunk = length - done < COPY_CHUNK_CLUSTERS * CLUSTER_SIZE
+                     ? length - done
+                     : COPY_CHUNK_CLUSTERS * CLUSTER_SIZE;
+    long got = file_pread(&fh, buffer, chunk, offset + done);
+    if (got < 0)
+      result = -got;
+    if (got <= 0)
+      break;
+    print_data(session, buffer, got);
+    done += got;
+  }
+  fputc('\n', session->out);
+
+  free(buffer);
+  file_close(&fh);
+  return result;
+}
+
+/**
+ * @brief Writes a host file into a file at an offset.
+ *
+ * The file grows when the data reaches past its end, a gap before the offset
+ * is filled with zeros. Clusters shared with copies made by cp are copied
+ * first, the copies keep their contents.
+ *
+ * Usage: write <path> <offset> <host-file>
+ *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
+ * @param argc Number of arguments.
+ * @param argv Array of arguments.
+ * @return int Error code.
+ */
+int cmd_write(struct SystemState *mount, struct session *session, int argc,
+              char **argv) {
+  long offset;
+  if (parse_bytes(argv[2], &offset))
+    return ERR_INVALID_SIZE;
+  FILE *fptr = fopen(argv[3], "rb");
+  if (!fptr)
+    return ERR_EXTERNAL_FILE_NOT_FOUND;
+  struct file_handle fh;
+  int result = file_open(mount, session, &fh, argv[1]);
+  uint8_t *buffer = malloc(COPY_CHUNK_CLUSTERS * CLUSTER_SIZE);
+  if (result == ERR_SUCCESS && !buffer)
+    result = ERR_MEMORY_ALLOCATION;
+
+  long done = 0;
+  size_t length;
+  while (result == ERR_SUCCESS &&
+         (length = fread(buffer, 1, COPY_CHUNK_CLUSTERS * CLUSTER_SIZE,
+                         fptr)) > 0) {
+    long written = file_pwrite(&fh, buffer, length, offset + done);
+    if (written < 0)
+      result = -written;
+    else
+      done += written;
+  }
+  if (result == ERR_SUCCESS && ferror(fptr))
+    result = ERR_UNKNOWN;
+  if (result == ERR_SUCCESS)
+    fprintf(session->out, "%ld bytes written at offset %ld\n", done, offset);
+
+  free(buffer);
+  file_close(&fh);
+  fclose(fptr);
+  return result;
 }
 
 /**
@@ -395,45 +667,45 @@ int cmd_cat(int argc, char **argv) {
  * Resolves the target path to an inode, verifies it is a directory, and updates
  * the global system state's current node ID.
  *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param argc Number of arguments.
  * @param argv Array of arguments.
  * @return int Error code.
  */
-int cmd_cd(int argc, char **argv) {
-  int new_node_id = path_to_inode(argv[1]);
+int cmd_cd(struct SystemState *mount, struct session *session, int argc,
+           char **argv) {
+  int new_node_id = path_to_inode(mount, session, argv[1]);
   if (new_node_id < 0) {
     return -new_node_id;
   }
-  struct inode node = get_inode(new_node_id);
+  struct inode node = get_inode(mount, new_node_id);
   if (node.is_file) {
     return ERR_NOT_A_DIRECTORY;
   }
 
-  g_system_state.curr_node_id = new_node_id;
-  char *new_path = inode_to_path(g_system_state.curr_node_id);
-  strlcpy(g_system_state.working_dir, new_path,
-          sizeof(g_system_state.working_dir) - 1);
-  free(new_path);
-
+  session->curr_node_id = new_node_id;
   return ERR_SUCCESS;
 }
 
 /**
  * @brief Prints the current working directory.
  *
- * Reconstructs the full path string from the current inode ID by traversing
- * parent pointers up to the root.
+ * The path is rebuilt from the working directory inode through the reverse
+ * parent index, so it follows directories other sessions have moved.
  *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param argc Number of arguments.
  * @param argv Array of arguments.
  * @return int Error code.
  */
-int cmd_pwd(int argc, char **argv) {
-  char *path = inode_to_path(g_system_state.curr_node_id);
-  if (path == NULL) {
+int cmd_pwd(struct SystemState *mount, struct session *session, int argc,
+            char **argv) {
+  char *path = inode_to_path(mount, session->curr_node_id);
+  if (!path)
     return ERR_MEMORY_ALLOCATION;
-  }
-  printf("working directory: %s\n", path);
+  fprintf(session->out, "working directory: %s\n", path);
   free(path);
   return ERR_SUCCESS;
 }
@@ -444,47 +716,472 @@ int cmd_pwd(int argc, char **argv) {
  * Retrieves the inode and prints metadata including size, reference count,
  * and the list of allocated cluster IDs.
  *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param argc Number of arguments.
  * @param argv Array of arguments.
  * @return int Error code.
  */
-int cmd_info(int argc, char **argv) {
+int cmd_info(struct SystemState *mount, struct session *session, int argc,
+             char **argv) {
   char *name = get_final_token(argv[1]);
-  int inode_id = path_to_inode(argv[1]);
+  int inode_id = path_to_inode(mount, session, argv[1]);
   if (inode_id < 0) {
     return -inode_id;
   }
-  struct inode inode = get_inode(inode_id);
+  struct inode inode = get_inode(mount, inode_id);
   int cluster_count = (inode.file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
-  int *clusters = get_node_clusters(&inode);
+  int *clusters = get_node_clusters(mount, &inode);
 
   const char *color = inode.is_file ? "" : "\033[34m";
-  printf("%s%-12s\033[0m | inode: %4d | size: %6d bytes | refs: %2d", color,
-         name, inode.id, inode.file_size, inode.references);
-  printf(" | clusters: [");
+  fprintf(session->out,
+          "%s%-12s\033[0m | inode: %4d | size: %6d bytes | refs: %2d", color,
+          name, inode.id, inode.file_size, inode.references);
+  fprintf(session->out, " | clusters: [");
   for (int i = 0; i < cluster_count - 1; i++) {
-    printf("%d, ", clusters[i]);
+    fprintf(session->out, "%d, ", clusters[i]);
   }
-  printf("%d]\n", clusters[cluster_count - 1]);
-  fflush(stdout);
+  fprintf(session->out, "%d]\n", clusters[cluster_count - 1]);
+  fflush(session->out);
 
   free(clusters);
   return ERR_SUCCESS;
 }
 
+/**
+ * @brief Copy a host file into the clusters of a node.
+ *
+ * The host file is read COPY_CHUNK_CLUSTERS clusters at a time and every
+ * run of consecutive destination clusters in a chunk is written with a single
+ * call. The tail of the last cluster is zeroed.
+ *
+ * @param mount Mount to work on.
+ * @param fptr Host file positioned at its start.
+ * @param clusters Clusters of the node in logical order.
+ * @param file_size Number of bytes to copy.
+ * @return int 0 on success, -1 on a read, write or allocation failure.
+ */
+static int import_clusters(struct SystemState *mount, FILE *fptr,
+                           const int *clusters, long file_size) {
+  uint8_t *buffer = malloc(COPY_CHUNK_CLUSTERS * CLUSTER_SIZE);
+  if (!buffer)
+    return -1;
+  int cluster_count = (file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  int failed = 0;
+  for (int first = 0; first < cluster_count && !failed;
+       first += COPY_CHUNK_CLUSTERS) {
+    int chunk_clusters = cluster_count - first < COPY_CHUNK_CLUSTERS
+                             ? cluster_count - first
+                             : COPY_CHUNK_CLUSTERS;
+    long offset = (long)first * CLUSTER_SIZE;
+    long bytes = file_size - offset < (long)chunk_clusters * CLUSTER_SIZE
+                     ? file_size - offset
+                     : (long)chunk_clusters * CLUSTER_SIZE;
+    if (fread(buffer, 1, bytes, fptr) != (size_t)bytes) {
+      failed = -1;
+      break;
+    }
+    memset(buffer + bytes, 0, (long)chunk_clusters * CLUSTER_SIZE - bytes);
+
+    failed = cache_write_clusters(&mount->cache, clusters + first, buffer,
+                                  (long)chunk_clusters * CLUSTER_SIZE);
+  }
+  free(buffer);
+  return failed;
+}
+
+/**
+ * @brief Create a file in a directory and fill it with host data.
+ *
+ * The data comes either from a buffer holding the whole file padded with
+ * zeros to whole clusters, or is read from an open host file in chunks.
+ *
+ * @param mount Mount to work on.
+ * @param dir_id Inode ID of the target directory.
+ * @param file_name Name of the new file.
+ * @param fptr Host file positioned at its start, used when data is NULL.
+ * @param data Contents of the file, or NULL.
+ * @param file_size Size of the file in bytes.
+ * @return int Error code.
+ */
+static int import_file(struct SystemState *mount, int dir_id, char *file_name,
+                       FILE *fptr, const uint8_t *data, long file_size) {
+  if (!unused_inodes_left(mount))
+    return ERR_INODE_FULL;
+  struct inode target_dir = get_inode(mount, dir_id);
+  if (contains_file(mount, &target_dir, file_name)) {
+    return ERR_FILE_EXISTS;
+  };
+  if (file_size > MAX_FILE_SIZE) {
+    return ERR_FILE_TOO_LARGE;
+  }
+  if (!enough_empty_clusters(mount, file_size)) {
+    return ERR_CLUSTER_FULL;
+  }
+
+  // initialize the file inode
+
+  int new_node_id = create_file_node(mount, file_size);
+  if (new_node_id == -1) {
+    return ERR_INODE_FULL;
+  }
+  struct inode inode = get_inode(mount, new_node_id);
+
+  // add the file into directory
+  struct directory_item item = {0};
+  item.inode = inode.id;
+  strlcpy(item.item_name, file_name, sizeof(item.item_name));
+  int result = add_record_to_dir(mount, item, &target_dir);
+  if (result != ERR_SUCCESS) {
+    // no clusters are assigned yet, so clearing the node frees nothing else
+    inode.file_size = 0;
+    clear_inode(mount, &inode);
+    return result;
+  }
+
+  // Reload inode to get updated reference count and continue with file data
+  inode = get_inode(mount, new_node_id);
+
+  // assign clusters to this inode
+  int *clusters = assign_node_clusters(mount, &inode);
+  if (!clusters && inode.file_size) {
+    // nothing got mapped, the node must not claim any clusters when removed
+    inode.file_size = 0;
+    write_inode(mount, &inode);
+  }
+
+  // write the file data into clusters
+  long padded_size =
+      (inode.file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE * CLUSTER_SIZE;
+  int failed =
+      inode.file_size &&
+      (!clusters ||
+       (data ? cache_write_clusters(&mount->cache, clusters, data,
+                                    padded_size)
+             : import_clusters(mount, fptr, clusters, inode.file_size)));
+
+  free(clusters);
+  if (failed) {
+    // do not leave a truncated file behind, removing it frees its clusters
+    target_dir = get_inode(mount, dir_id);
+    delete_item(mount, &target_dir, file_name);
+    return ERR_UNKNOWN;
+  }
+  return ERR_SUCCESS;
+}
+
+// One host file of a recursive import
+struct import_job {
+  char *host_path;
+  int dir_id;                // inode ID of the target directory
+  char name[DIR_NAME_SIZE];
+  bool ready;                // read by a worker
+  int error;                 // error code of the read
+  FILE *fptr;                // open host file too large to be held in memory
+  uint8_t *data;             // contents of a small file padded to clusters
+  long file_size;
+};
+
+// Host tree being imported, workers read the files ahead of the importing
+// thread, which alone touches the filesystem
+struct import_tree {
+  struct import_job *jobs;
+  int count, capacity;
+  int next;                  // first job no worker took yet
+  int imported;              // jobs done by the importing thread
+  int files, directories, errors;
+  int first_error;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;      // a job was read
+  pthread_cond_t space;      // a job was imported
+};
+
+/**
+ * @brief Report a path which could not be imported.
+ *
+ * @param session Session the error is reported to.
+ * @param tree Import in progress.
+ * @param host_path Host path of the item.
+ * @param error Error code.
+ */
+static void import_error(struct session *session, struct import_tree *tree,
+                         const char *host_path, int error) {
+  fprintf(session->err, "%s: %s\n", host_path,
+          get_error_message((ErrorCode)error));
+  if (!tree->errors++)
+    tree->first_error = error;
+}
+
+/**
+ * @brief Number of threads for copying a tree, one per core.
+ *
+ * @param job_count Number of files to copy.
+ * @return int Between 0 for no files and TREE_MAX_WORKERS.
+ */
+static int tree_worker_count(int job_count) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int count = cores < 1                  ? 1
+              : cores > TREE_MAX_WORKERS ? TREE_MAX_WORKERS
+                                         : (int)cores;
+  return count < job_count ? count : job_count;
+}
+
+/**
+ * @brief Open a host file of a job and read it whole unless it is large.
+ *
+ * @param job Job to prepare.
+ */
+static void read_import_job(struct import_job *job) {
+  job->fptr = fopen(job->host_path, "r");
+  struct stat st;
+  if (!job->fptr || fstat(fileno(job->fptr), &st)) {
+    job->error = ERR_EXTERNAL_FILE_NOT_FOUND;
+    return;
+  }
+  job->file_size = st.st_size;
+  if (job->file_size > (long)COPY_CHUNK_CLUSTERS * CLUSTER_SIZE)
+    return;
+
+  long padded_size =
+      (job->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE * CLUSTER_SIZE;
+  job->data = calloc(1, padded_size ? padded_size : 1);
+  if (!job->data)
+    job->error = ERR_MEMORY_ALLOCATION;
+  else if (fread(job->data, 1, job->file_size, job->fptr) !=
+           (size_t)job->file_size)
+    job->error = ERR_UNKNOWN;
+  fclose(job->fptr);
+  job->fptr = NULL;
+}
+
+/**
+ * @brief Worker thread reading the host files of an import in order, at
+ * most INCP_WINDOW_FILES ahead of the importing thread.
+ *
+ * @param arg The import_tree.
+ * @return void* NULL.
+ */
+static void *import_worker(void *arg) {
+  struct import_tree *tree = arg;
+  pthread_mutex_lock(&tree->lock);
+  while (tree->next < tree->count) {
+    if (tree->next >= tree->imported + INCP_WINDOW_FILES) {
+      pthread_cond_wait(&tree->space, &tree->lock);
+      continue;
+    }
+    struct import_job *job = &tree->jobs[tree->next++];
+    pthread_mutex_unlock(&tree->lock);
+    read_import_job(job);
+    pthread_mutex_lock(&tree->lock);
+    job->ready = true;
+    pthread_cond_broadcast(&tree->ready);
+  }
+  pthread_mutex_unlock(&tree->lock);
+  return NULL;
+}
+
+/**
+ * @brief Create the directories of a host tree and queue its files.
+ *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
+ * @param tree Import in progress.
+ * @param host_dir Host directory to walk.
+ * @param dir_id Inode ID of the directory it is imported into.
+ */
+static void walk_import_tree(struct SystemState *mount, struct session *session,
+                             struct import_tree *tree, const char *host_dir,
+                             int dir_id) {
+  DIR *dir = opendir(host_dir);
+  if (!dir) {
+    import_error(session, tree, host_dir, ERR_EXTERNAL_FILE_NOT_FOUND);
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      continue;
+    size_t length = strlen(host_dir) + strlen(entry->d_name) + 2;
+    char *host_path = malloc(length);
+    if (!host_path) {
+      import_error(session, tree, host_dir, ERR_MEMORY_ALLOCATION);
+      break;
+    }
+    snprintf(host_path, length, "%s/%s", host_dir, entry->d_name);
+
+    struct stat st;
+    if (lstat(host_path, &st)) {
+      import_error(session, tree, host_path, ERR_EXTERNAL_FILE_NOT_FOUND);
+    } else if (S_ISDIR(st.st_mode)) {
+      int id = make_dir(mount, dir_id, entry->d_name);
+      if (id < 0) {
+        import_error(session, tree, host_path, -id);
+      } else {
+        tree->directories++;
+        walk_import_tree(mount, session, tree, host_path, id);
+      }
+    } else if (S_ISREG(st.st_mode)) {
+      if (tree->count == tree->capacity) {
+        int capacity = tree->capacity ? tree->capacity * 2 : 256;
+        struct import_job *grown =
+            realloc(tree->jobs, capacity * sizeof(struct import_job));
+        if (!grown) {
+          import_error(session, tree, host_path, ERR_MEMORY_ALLOCATION);
+          free(host_path);
+          break;
+        }
+        tree->jobs = grown;
+        tree->capacity = capacity;
+      }
+      struct import_job *job = &tree->jobs[tree->count++];
+      memset(job, 0, sizeof(*job));
+      job->host_path = host_path;
+      job->dir_id = dir_id;
+      strlcpy(job->name, entry->d_name, sizeof(job->name));
+      continue;
+    }
+    // links and special files are not imported
+    free(host_path);
+  }
+  closedir(dir);
+}
+
+/**
+ * @brief Import a host directory tree, used by incp -r.
+ *
+ * The directories are created while the host tree is walked. The files are
+ * then read by a pool of worker threads, one per core, while this thread
+ * allocates their inodes and clusters and adds the directory entries in walk
+ * order. Small files are read whole by the workers, larger ones are only
+ * opened and streamed in chunks here. Errors are reported per path, running
+ * out of inodes stops the import, a file too large for the free clusters
+ * does not keep the smaller ones out.
+ *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
+ * @param host_dir Host directory to import.
+ * @param path Path of the directory to create for it.
+ * @return int Error code, the first one if several paths failed.
+ */
+static int import_tree(struct SystemState *mount, struct session *session,
+                       const char *host_dir, char *path) {
+  struct stat st;
+  if (stat(host_dir, &st))
+    return ERR_EXTERNAL_FILE_NOT_FOUND;
+  if (!S_ISDIR(st.st_mode))
+    return ERR_NOT_A_DIRECTORY;
+
+  char *dir_name = NULL;
+  int parent_dir_id = get_dir_id(mount, session, path, &dir_name);
+  if (parent_dir_id < 0)
+    return -parent_dir_id;
+  int root_id = make_dir(mount, parent_dir_id, dir_name);
+  if (root_id < 0)
+    return -root_id;
+
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  struct import_tree tree = {0};
+  tree.directories = 1;
+  pthread_mutex_init(&tree.lock, NULL);
+  pthread_cond_init(&tree.ready, NULL);
+  pthread_cond_init(&tree.space, NULL);
+  walk_import_tree(mount, session, &tree, host_dir, root_id);
+
+  int worker_count = tree_worker_count(tree.count);
+  pthread_t workers[TREE_MAX_WORKERS];
+  int started = 0;
+  while (started < worker_count &&
+         !pthread_create(&workers[started], NULL, import_worker, &tree))
+    started++;
+
+  int total = tree.count, limit = tree.count;
+  bool stopped = false;
+  for (int i = 0; i < limit; i++) {
+    struct import_job *job = &tree.jobs[i];
+    pthread_mutex_lock(&tree.lock);
+    if (!started && !job->ready) {
+      // no worker could be started, read here
+      tree.next = i + 1;
+      read_import_job(job);
+      job->ready = true;
+    }
+    while (!job->ready)
+      pthread_cond_wait(&tree.ready, &tree.lock);
+    pthread_mutex_unlock(&tree.lock);
+
+    int error = job->error;
+    if (!stopped) {
+      if (error == ERR_SUCCESS) {
+        if (job->fptr)
+          rewind(job->fptr);
+        error = import_file(mount, job->dir_id, job->name, job->fptr, job->data,
+                            job->file_size);
+      }
+      if (error != ERR_SUCCESS)
+        import_error(session, &tree, job->host_path, error);
+      else
+        tree.files++;
+    }
+    if (job->fptr)
+      fclose(job->fptr);
+    free(job->data);
+
+    pthread_mutex_lock(&tree.lock);
+    if (!stopped && error == ERR_INODE_FULL) {
+      // no worker takes another job, the ones taken are still waited for
+      stopped = true;
+      tree.count = tree.next;
+      limit = tree.next;
+    }
+    tree.imported++;
+    pthread_cond_broadcast(&tree.space);
+    pthread_mutex_unlock(&tree.lock);
+  }
+  for (int i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+
+  for (int i = 0; i < total; i++)
+    free(tree.jobs[i].host_path);
+  free(tree.jobs);
+  pthread_cond_destroy(&tree.space);
+  pthread_cond_destroy(&tree.ready);
+  pthread_mutex_destroy(&tree.lock);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds =
+      (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+  fprintf(session->out,
+          "Imported %d files and %d directories in %.3f ms with %d threads, "
+          "%d errors\n",
+          tree.files, tree.directories, seconds * 1e3, started, tree.errors);
+  return tree.errors ? tree.first_error : ERR_SUCCESS;
+}
+
 /**
  * @brief Imports a file from the host filesystem.
  *
- * Opens the host file, allocates a new inode and sufficient clusters, reads
- * data from the host file into the virtual clusters, and adds a directory
- * entry.
+ * Opens the host file, allocates a new inode and sufficient clusters, copies
+ * the host file into the virtual clusters in large chunks, and adds a
+ * directory entry. With -r a whole host directory tree is imported.
  *
+ * Usage: incp [-r] <host-path> <path>
+ *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param argc Number of arguments.
  * @param argv Array of arguments.
  * @return int Error code.
  */
-int cmd_incp(int argc, char **argv) {
-  if (!unused_inodes_left())
+int cmd_incp(struct SystemState *mount, struct session *session, int argc,
+             char **argv) {
+  if (argc == 4 && !strcmp(argv[1], "-r"))
+    return import_tree(mount, session, argv[2], argv[3]);
+  if (argc != 3)
+    return ERR_INVALID_ARGC;
+
+  if (!unused_inodes_left(mount))
     return ERR_INODE_FULL;
   FILE *fptr = fopen(argv[1], "r");
   if (!fptr) {
@@ -493,128 +1190,466 @@ int cmd_incp(int argc, char **argv) {
 
   // separate destination path and filename
   char *file_name = NULL;
-  int target_dir_id = get_dir_id(argv[2], &file_name);
+  int target_dir_id = get_dir_id(mount, session, argv[2], &file_name);
   if (target_dir_id < 0) {
     fclose(fptr);
     return -target_dir_id;
   }
-  struct inode target_dir = get_inode(target_dir_id);
-  if (contains_file(&target_dir, file_name)) {
-    return ERR_FILE_EXISTS;
-  };
 
   fseek(fptr, 0, SEEK_END);
-  int file_size = ftell(fptr);
+  long file_size = ftell(fptr);
+  rewind(fptr);
 
-  if (file_size > MAX_FILE_SIZE) {
-    fclose(fptr);
-    return ERR_FILE_TOO_LARGE;
+  int result = import_file(mount, target_dir_id, file_name, fptr, NULL,
+                           file_size);
+  fclose(fptr);
+  return result;
+}
+
+// Run of consecutive clusters of a file being exported
+struct export_run {
+  int start;  // first physical cluster
+  int length; // number of clusters
+};
+
+/**
+ * @brief Map a file to its runs of consecutive clusters for exporting.
+ *
+ * Nothing is written back, an export must not change the image while a
+ * batch may still be discarded. copy_export_runs reads runs with dirty
+ * cached clusters through the cache instead.
+ *
+ * @param mount Mount to work on.
+ * @param inode File inode.
+ * @param runs Output array of runs (must be freed).
+ * @return int Number of runs, or -1 on failure.
+ */
+static int map_export_runs(struct SystemState *mount, struct inode *inode,
+                           struct export_run **runs) {
+  int cluster_count = (inode->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  int run_count = 0, capacity = 0, done = 0;
+  *runs = NULL;
+  while (done < cluster_count) {
+    int length;
+    int start = node_run_at(mount, inode, done, cluster_count - done, &length);
+    if (start < 0)
+      break;
+    if (run_count == capacity) {
+      capacity = capacity ? capacity * 2 : 8;
+      struct export_run *grown =
+          realloc(*runs, capacity * sizeof(struct export_run));
+      if (!grown)
+        break;
+      *runs = grown;
+    }
+    (*runs)[run_count].start = start;
+    (*runs)[run_count].length = length;
+    run_count++;
+    done += length;
   }
-  if (!enough_empty_clusters(file_size)) {
-    fclose(fptr);
-    return ERR_CLUSTER_FULL;
+  if (done == cluster_count)
+    return run_count;
+  free(*runs);
+  *runs = NULL;
+  return -1;
+}
+
+/**
+ * @brief Copy a run of a file through the cluster cache into a host file.
+ *
+ * Used for runs holding dirty cached clusters, which the image does not have
+ * yet.
+ *
+ * @param mount Mount to work on.
+ * @param fd Host file, written at its current position.
+ * @param run Run to copy.
+ * @param bytes Number of bytes of the run to copy.
+ * @return int 0 on success, -1 on failure.
+ */
+static int copy_cached_run(struct SystemState *mount, int fd,
+                           const struct export_run *run, long bytes) {
+  uint8_t *buffer = malloc(COPY_CHUNK_CLUSTERS * CLUSTER_SIZE);
+  if (!buffer)
+    return -1;
+  int failed = 0;
+  for (long done = 0; done < bytes && !failed;) {
+    long chunk = bytes - done < COPY_CHUNK_CLUSTERS * CLUSTER_SIZE
+                     ? bytes - done
+                     : COPY_CHUNK_CLUSTERS * CLUSTER_SIZE;
+    failed = cache_read_range(&mount->cache, run->start + done / CLUSTER_SIZE,
+                              buffer, chunk);
+    for (long written = 0; !failed && written < chunk;) {
+      ssize_t n = write(fd, buffer + written, chunk - written);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        failed = -1;
+      else
+        written += n;
+    }
+    done += chunk;
   }
+  free(buffer);
+  return failed;
+}
 
-  // initialize the file inode
+/**
+ * @brief Let the kernel copy the runs of a file from the image into a host
+ * file, the data never passes through a user buffer.
+ *
+ * Only positional reads of the image are used, so several threads can
+ * export at the same time. Runs with dirty cached clusters, which only a
+ * running batch leaves, are read through the cache.
+ *
+ * @param mount Mount to work on.
+ * @param fd Host file.
+ * @param runs Runs of the file.
+ * @param run_count Number of runs.
+ * @param file_size Size of the file in bytes.
+ * @return int 0 on success, -1 on failure.
+ */
+static int copy_export_runs(struct SystemState *mount, int fd,
+                            const struct export_run *runs, int run_count,
+                            long file_size) {
+  long remaining = file_size;
+  for (int i = 0; i < run_count; i++) {
+    long bytes = (long)runs[i].length * CLUSTER_SIZE;
+    if (bytes > remaining)
+      bytes = remaining;
+    if (cache_run_dirty(&mount->cache, runs[i].start, runs[i].length)
+            ? copy_cached_run(mount, fd, &runs[i], bytes)
+            : storage_copy_out(mount->storage,
+                               mount->sb.data_start_address +
+                                   (long)runs[i].start * CLUSTER_SIZE,
+                               bytes, fd))
+      return -1;
+    remaining -= bytes;
+  }
+  return 0;
+}
 
-  int new_node_id = assign_empty_inode();
-  struct inode inode = {0};
-  inode.id = new_node_id;
-  inode.is_file = 1;
-  inode.file_size = file_size;
-  write_inode(&inode);
+// One file of a recursive export
+struct export_job {
+  char *host_path;
+  struct export_run *runs;
+  int run_count;
+  long file_size;
+  int error; // error code of the copy
+};
 
-  // add the file into directory
-  struct directory_item item = {0};
-  item.inode = inode.id;
-  strlcpy(item.item_name, file_name, sizeof(item.item_name));
-  add_record_to_dir(item, &target_dir);
+// Subtree being exported, the files are copied by a pool of threads
+struct export_tree {
+  struct export_job *jobs;
+  int count, capacity;
+  int next; // first job no thread took yet
+  int directories, errors;
+  int first_error;
+  long bytes;
+  pthread_mutex_t lock;
+  struct SystemState *mount; // image the files are copied from
+};
 
-  // Reload inode to get updated reference count and continue with file data
-  inode = get_inode(new_node_id);
+/**
+ * @brief Report a path which could not be exported.
+ *
+ * @param session Session the error is reported to.
+ * @param tree Export in progress.
+ * @param host_path Host path of the item.
+ * @param error Error code.
+ */
+static void export_error(struct session *session, struct export_tree *tree,
+                         const char *host_path, int error) {
+  fprintf(session->err, "%s: %s\n", host_path,
+          get_error_message((ErrorCode)error));
+  if (!tree->errors++)
+    tree->first_error = error;
+}
 
-  // assign clusters to this inode
-  int *clusters = assign_node_clusters(&inode);
+/**
+ * @brief Worker thread copying the files of an export until none is left.
+ *
+ * @param arg The export_tree.
+ * @return void* NULL.
+ */
+static void *export_worker(void *arg) {
+  struct export_tree *tree = arg;
+  struct SystemState *mount = tree->mount;
+  pthread_mutex_lock(&tree->lock);
+  while (tree->next < tree->count) {
+    struct export_job *job = &tree->jobs[tree->next++];
+    pthread_mutex_unlock(&tree->lock);
+    int fd = open(job->host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      job->error = ERR_EXTERNAL_FILE_NOT_FOUND;
+    } else {
+      if (copy_export_runs(mount, fd, job->runs, job->run_count,
+                           job->file_size))
+        job->error = ERR_UNKNOWN;
+      if (close(fd))
+        job->error = ERR_UNKNOWN;
+    }
+    pthread_mutex_lock(&tree->lock);
+  }
+  pthread_mutex_unlock(&tree->lock);
+  return NULL;
+}
 
-  // write the file data into clusters
-  uint8_t current_cluster_data[CLUSTER_SIZE];
-  int cluster_count = (inode.file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+/**
+ * @brief Create a host directory, an existing one is reused.
+ *
+ * @param host_dir Host path.
+ * @return int 0 on success, -1 on failure.
+ */
+static int make_host_dir(const char *host_dir) {
+  struct stat st;
+  if (!mkdir(host_dir, 0755))
+    return 0;
+  return errno == EEXIST && !stat(host_dir, &st) && S_ISDIR(st.st_mode) ? 0
+                                                                         : -1;
+}
 
-  rewind(fptr);
-  for (int i = 0; i < cluster_count; i++) {
-    // Zero out the buffer to avoid writing uninitialized data
-    memset(current_cluster_data, 0, CLUSTER_SIZE);
-
-    // Calculate bytes to read for this cluster
-    int bytes_to_read = CLUSTER_SIZE;
-    if (i == cluster_count - 1 && file_size % CLUSTER_SIZE != 0) {
-      bytes_to_read = file_size % CLUSTER_SIZE;
+/**
+ * @brief Recreate the directories of a subtree on the host and queue its
+ * files with their cluster runs.
+ *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
+ * @param tree Export in progress.
+ * @param dir Directory inode to walk.
+ * @param host_dir Host directory it is exported into.
+ */
+static void walk_export_tree(struct SystemState *mount, struct session *session,
+                             struct export_tree *tree, struct inode *dir,
+                             const char *host_dir) {
+  struct directory_item *items = get_directory_items(mount, dir);
+  if (!items) {
+    export_error(session, tree, host_dir, ERR_MEMORY_ALLOCATION);
+    return;
+  }
+  int item_count = dir->file_size / sizeof(struct directory_item);
+  for (int i = 0; i < item_count; i++) {
+    if (!strcmp(items[i].item_name, ".") || !strcmp(items[i].item_name, ".."))
+      continue;
+    size_t length = strlen(host_dir) + strlen(items[i].item_name) + 2;
+    char *host_path = malloc(length);
+    if (!host_path) {
+      export_error(session, tree, host_dir, ERR_MEMORY_ALLOCATION);
+      break;
+    }
+    snprintf(host_path, length, "%s/%s", host_dir, items[i].item_name);
+
+    struct inode inode = get_inode(mount, items[i].inode);
+    if (!inode.is_file) {
+      if (make_host_dir(host_path)) {
+        export_error(session, tree, host_path, ERR_EXTERNAL_FILE_NOT_FOUND);
+      } else {
+        tree->directories++;
+        walk_export_tree(mount, session, tree, &inode, host_path);
+      }
+      free(host_path);
+      continue;
     }
 
-    fread(current_cluster_data, 1, bytes_to_read, fptr);
-
-    int offset =
-        clusters[i] * CLUSTER_SIZE + g_system_state.sb.data_start_address;
-    fseek(g_system_state.file_ptr, offset, SEEK_SET);
-    fwrite(current_cluster_data, 1, CLUSTER_SIZE, g_system_state.file_ptr);
+    struct export_run *runs;
+    int run_count = map_export_runs(mount, &inode, &runs);
+    if (run_count < 0) {
+      export_error(session, tree, host_path, ERR_UNKNOWN);
+      free(host_path);
+      continue;
+    }
+    if (tree->count == tree->capacity) {
+      int capacity = tree->capacity ? tree->capacity * 2 : 256;
+      struct export_job *grown =
+          realloc(tree->jobs, capacity * sizeof(struct export_job));
+      if (!grown) {
+        export_error(session, tree, host_path, ERR_MEMORY_ALLOCATION);
+        free(runs);
+        free(host_path);
+        break;
+      }
+      tree->jobs = grown;
+      tree->capacity = capacity;
+    }
+    struct export_job job = {host_path, runs, run_count, inode.file_size,
+                             ERR_SUCCESS};
+    tree->jobs[tree->count++] = job;
+    tree->bytes += inode.file_size;
   }
-  fflush(g_system_state.file_ptr);
+  free(items);
+}
 
-  fclose(fptr);
-  free(clusters);
-  return ERR_SUCCESS;
+/**
+ * @brief Export a directory subtree to the host, used by outcp -r.
+ *
+ * The tree is walked once: the host directories are created and every file
+ * is mapped to its cluster runs. The files are then copied by a pool of
+ * threads, one per core with this one included. Errors are reported per
+ * path and the export goes on.
+ *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
+ * @param path Directory to export.
+ * @param host_dir Host directory to create or reuse for it.
+ * @return int Error code, the first one if several paths failed.
+ */
+static int export_tree(struct SystemState *mount, struct session *session,
+                       char *path, const char *host_dir) {
+  int dir_id = path_to_inode(mount, session, path);
+  if (dir_id < 0)
+    return -dir_id;
+  struct inode dir = get_inode(mount, dir_id);
+  if (dir.is_file)
+    return ERR_NOT_A_DIRECTORY;
+  if (make_host_dir(host_dir))
+    return ERR_EXTERNAL_FILE_NOT_FOUND;
+
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  struct export_tree tree = {0};
+  tree.directories = 1;
+  tree.mount = mount;
+  pthread_mutex_init(&tree.lock, NULL);
+  walk_export_tree(mount, session, &tree, &dir, host_dir);
+
+  int worker_count = tree_worker_count(tree.count);
+  pthread_t workers[TREE_MAX_WORKERS];
+  int started = 0;
+  while (started + 1 < worker_count &&
+         !pthread_create(&workers[started], NULL, export_worker, &tree))
+    started++;
+  export_worker(&tree);
+  for (int i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+  pthread_mutex_destroy(&tree.lock);
+
+  int files = 0;
+  for (int i = 0; i < tree.count; i++) {
+    if (tree.jobs[i].error != ERR_SUCCESS)
+      export_error(session, &tree, tree.jobs[i].host_path, tree.jobs[i].error);
+    else
+      files++;
+    free(tree.jobs[i].host_path);
+    free(tree.jobs[i].runs);
+  }
+  free(tree.jobs);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds =
+      (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+  double rate = seconds > 0 ? tree.bytes / seconds : 0;
+  fprintf(session->out,
+          "Exported %d files and %d directories, %ld bytes in %.3f ms "
+          "(%.1f MiB/s) with %d threads, %d errors\n",
+          files, tree.directories, tree.bytes, seconds * 1e3,
+          rate / (1024 * 1024), started + 1, tree.errors);
+  return tree.errors ? tree.first_error : ERR_SUCCESS;
 }
 
 /**
  * @brief Exports a file to the host filesystem.
  *
- * Reads the entire content of a virtual file into a buffer and writes it
- * to a new file on the host system.
+ * Follows the block map one run of consecutive clusters at a time and lets
+ * the kernel copy each run from the image straight into the host file, the
+ * data never passes through a user buffer. Prints the throughput achieved.
+ * With -r a whole directory subtree is exported.
  *
+ * Usage: outcp [-r] <path> <host-path>
+ *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param argc Number of arguments.
  * @param argv Array of arguments.
  * @return int Error code.
  */
-int cmd_outcp(int argc, char **argv) {
+int cmd_outcp(struct SystemState *mount, struct session *session, int argc,
+              char **argv) {
+  if (argc == 4 && !strcmp(argv[1], "-r"))
+    return export_tree(mount, session, argv[2], argv[3]);
+  if (argc != 3)
+    return ERR_INVALID_ARGC;
 
-  int file_node_id = path_to_inode(argv[1]);
+  int file_node_id = path_to_inode(mount, session, argv[1]);
   if (file_node_id < 0) {
     return -file_node_id;
   }
-  struct inode file_inode = get_inode(file_node_id);
-
-  uint8_t *data = get_node_data(&file_inode);
+  struct inode file_inode = get_inode(mount, file_node_id);
 
-  FILE *fptr = fopen(argv[2], "w+");
-  if (!fptr) {
-    free(data);
+  int fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
     return ERR_EXTERNAL_FILE_NOT_FOUND;
-  };
 
-  if (!fwrite(data, file_inode.file_size, 1, fptr)) {
-    fclose(fptr);
-    free(data);
-    return ERR_UNKNOWN;
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  struct export_run *runs;
+  int run_count = map_export_runs(mount, &file_inode, &runs);
+  int result = run_count < 0 || copy_export_runs(mount, fd, runs, run_count,
+                                                 file_inode.file_size)
+                   ? ERR_UNKNOWN
+                   : ERR_SUCCESS;
+  free(runs);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (close(fd))
+    result = ERR_UNKNOWN;
+
+  if (result == ERR_SUCCESS) {
+    double seconds =
+        (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    double rate = seconds > 0 ? file_inode.file_size / seconds : 0;
+    fprintf(session->out, "%d bytes in %.3f ms (%.1f MiB/s)\n",
+            file_inode.file_size, seconds * 1e3, rate / (1024 * 1024));
   }
+  return result;
+}
 
-  fclose(fptr);
-  free(data);
-
-  return ERR_SUCCESS;
+/**
+ * @brief Commit the changes of a script so far and keep batching.
+ *
+ * @param mount Mount to work on.
+ * @return int ERR_SUCCESS, or error code of the commit.
+ */
+static int load_checkpoint(struct SystemState *mount) {
+  int result = end_batch(mount, true);
+  begin_batch(mount);
+  return result;
 }
 
 /**
  * @brief Executes commands from a script file.
  *
  * Reads the host file line by line, skips comments/empty lines, and passes
- * valid command strings to the command executor.
+ * valid command strings to the command executor. Without --batch failed
+ * commands are reported and the script goes on, the changes are committed
+ * every LOAD_GROUP_COMMANDS commands. With --batch the script stops at the
+ * first failed command and everything it changed since the last checkpoint
+ * is discarded, otherwise it is committed at the end and after every
+ * checkpoint-interval commands, if given.
+ *
+ * Usage: load [--batch [checkpoint-interval]] <file>
  *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param argc Number of arguments.
  * @param argv Array of arguments.
  * @return int Error code.
  */
-int cmd_load(int argc, char **argv) {
-  FILE *fptr = fopen(argv[1], "r");
+int cmd_load(struct SystemState *mount, struct session *session, int argc,
+             char **argv) {
+  bool batch = argc >= 3 && !strcmp(argv[1], "--batch");
+  int interval = batch ? 0 : LOAD_GROUP_COMMANDS;
+  if (argc != (batch ? 3 : 2)) {
+    if (!batch || argc != 4)
+      return ERR_INVALID_ARGC;
+    char *end;
+    long value = strtol(argv[2], &end, 10);
+    if (*end != '\0' || value <= 0 || value > INT_MAX)
+      return ERR_INVALID_SIZE;
+    interval = (int)value;
+  }
+
+  FILE *fptr = fopen(argv[argc - 1], "r");
   if (!fptr) {
     return ERR_EXTERNAL_FILE_NOT_FOUND;
   }
@@ -622,7 +1657,16 @@ int cmd_load(int argc, char **argv) {
   char line_buffer[1024];
   int line_count = 0;
   int error_count = 0;
+  int result = ERR_SUCCESS;
+
+  int curr_node_id = session->curr_node_id;
 
+  // a batch starts from committed state, so discarding it loses nothing else
+  if (batch && (result = commit_changes(mount)) != ERR_SUCCESS) {
+    fclose(fptr);
+    return result;
+  }
+  begin_batch(mount);
   while (fgets(line_buffer, sizeof(line_buffer), fptr) != NULL) {
     // Remove newline character
     line_buffer[strcspn(line_buffer, "\n")] = '\0';
@@ -632,56 +1676,86 @@ int cmd_load(int argc, char **argv) {
       continue;
     }
 
-    int error_code = execute_command_string(line_buffer);
+    int error_code = execute_command_string(mount, session, line_buffer);
     line_count++;
 
     if (error_code != ERR_SUCCESS) {
-      fprintf(stderr, "Line %d: Command failed with error code %d: %s\n",
-              line_count, error_code, get_error_message((ErrorCode)error_code));
+      fprintf(session->err,
+              "Line %d: Command failed with error code %d: %s\n", line_count,
+              error_code, get_error_message((ErrorCode)error_code));
       error_count++;
+      if (batch) {
+        result = error_code;
+        break;
+      }
+    }
+    if (interval && line_count % interval == 0 &&
+        (error_code = load_checkpoint(mount)) != ERR_SUCCESS && batch) {
+      result = error_code;
+      break;
     }
   }
-
   fclose(fptr);
 
-  printf("Loaded %d commands, %d errors\n", line_count, error_count);
+  if (result == ERR_SUCCESS) {
+    result = end_batch(mount, true);
+  } else if (end_batch(mount, false) == ERR_SUCCESS) {
+    session->curr_node_id = curr_node_id;
+    fprintf(session->out, "Rolled back to the last checkpoint\n");
+  }
 
-  return ERR_SUCCESS;
+  fprintf(session->out, "Loaded %d commands, %d errors\n", line_count,
+          error_count);
+
+  return result;
 }
 
 /**
  * @brief Displays filesystem usage statistics.
  *
- * Calculates used inodes and clusters by counting bits in bitmaps, and counts
- * directories by scanning used inodes. Prints summary to stdout.
+ * Reads used inodes, clusters, directories and files from the counters kept
+ * in the superblock. Prints summary to stdout.
  *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param argc Number of arguments.
  * @param argv Array of arguments.
  * @return int Error code.
  */
-int cmd_statfs(int argc, char **argv) {
-  if (g_system_state.sb.disk_size == 0) {
+int cmd_statfs(struct SystemState *mount, struct session *session, int argc,
+               char **argv) {
+  if (mount->sb.disk_size == 0) {
     return ERR_UNKNOWN;
   }
 
-  printf("=== Filesystem Info ===\n");
-  printf("Disk size: %d bytes\n", g_system_state.sb.disk_size);
-  printf("Cluster size: %d bytes\n", g_system_state.sb.cluster_size);
-
-  int used_inodes = count_ones(g_system_state.sb.bitmapi_start_address,
-                               g_system_state.sb.inode_count);
-  int used_clusters = count_ones(g_system_state.sb.bitmap_start_address,
-                                 g_system_state.sb.cluster_count);
-  int directories = count_dirs();
-  int files = used_inodes - directories;
-
-  printf("inodes: %d used out of %d\n", used_inodes,
-         g_system_state.sb.inode_count);
-  printf("clusters: %d used out of %d\n", used_clusters,
-         g_system_state.sb.cluster_count);
-  printf("number of directories: %d\n", directories);
-  printf("number of files: %d\n", files);
-  printf("===============================\n");
+  fprintf(session->out, "=== Filesystem Info ===\n");
+  fprintf(session->out, "Disk size: %d bytes\n", mount->sb.disk_size);
+  fprintf(session->out, "Cluster size: %d bytes\n",
+          mount->sb.cluster_size);
+
+  int used_inodes =
+      mount->sb.inode_count - mount->sb.free_inode_count;
+  int used_clusters =
+      mount->sb.cluster_count - mount->sb.free_cluster_count;
+  int directories = mount->sb.dir_count;
+  int files = mount->sb.file_count;
+
+  fprintf(session->out, "inodes: %d used out of %d\n", used_inodes,
+          mount->sb.inode_count);
+  fprintf(session->out, "clusters: %d used out of %d\n", used_clusters,
+          mount->sb.cluster_count);
+  fprintf(session->out, "number of directories: %d\n", directories);
+  fprintf(session->out, "number of files: %d\n", files);
+  if (mount->journal.storage)
+    fprintf(session->out, "journal: %ld commits, %ld flushes\n",
+            mount->journal.commits, mount->journal.flushes);
+  if (mount->storage->queue)
+    fprintf(session->out, "io: %s, depth %d, %ld requests in %ld batches\n",
+            io_queue_engine_name(mount->storage->queue),
+            mount->storage->queue->depth,
+            mount->storage->queue->submitted,
+            mount->storage->queue->batches);
+  fprintf(session->out, "===============================\n");
 
   return ERR_SUCCESS;
 }
@@ -692,30 +1766,33 @@ int cmd_statfs(int argc, char **argv) {
  * Resolves the source inode, increments its reference count,
  * and adds a new directory entry pointing to the same inode ID.
  *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param argc Number of arguments.
  * @param argv Array of arguments.
  * @return int Error code.
  */
-int ln(int argc, char **argv) {
+int ln(struct SystemState *mount, struct session *session, int argc,
+       char **argv) {
   // get inode to link
-  int original_inode_id = path_to_inode(argv[1]);
+  int original_inode_id = path_to_inode(mount, session, argv[1]);
   if (original_inode_id < 0)
     return -original_inode_id;
-  struct inode original_node = get_inode(original_inode_id);
+  struct inode original_node = get_inode(mount, original_inode_id);
   if (!original_node.is_file) {
     return ERR_CANNOT_HARDLINK_DIR;
   }
 
   // separate destination path and filename
   char *file_name = NULL;
-  int target_dir_id = get_dir_id(argv[2], &file_name);
+  int target_dir_id = get_dir_id(mount, session, argv[2], &file_name);
   if (target_dir_id < 0) {
     return -target_dir_id;
   }
-  struct inode target_dir = get_inode(target_dir_id);
+  struct inode target_dir = get_inode(mount, target_dir_id);
 
   // check if file already exists
-  if (contains_file(&target_dir, file_name)) {
+  if (contains_file(mount, &target_dir, file_name)) {
     return ERR_FILE_EXISTS;
   }
 
@@ -723,22 +1800,35 @@ int ln(int argc, char **argv) {
   struct directory_item record = {0};
   record.inode = original_inode_id;
   strlcpy(record.item_name, file_name, DIR_NAME_SIZE);
-  add_record_to_dir(record, &target_dir);
-
-  return ERR_SUCCESS;
+  return add_record_to_dir(mount, record, &target_dir);
 };
 
 // Array of command structs - combines name and function in one place
 struct CommandEntry commands[] = {
-    {"format", cmd_format, 1}, {"cp", cmd_cp, 2},
-    {"mv", cmd_mv, 2},         {"rm", cmd_rm, 1},
-    {"mkdir", cmd_mkdir, 1},   {"rmdir", cmd_rmdir, 1},
-    {"ls", cmd_ls, -1},        {"cat", cmd_cat, 1},
-    {"cd", cmd_cd, 1},         {"pwd", cmd_pwd, 0},
-    {"info", cmd_info, 1},     {"incp", cmd_incp, 2},
-    {"outcp", cmd_outcp, 2},   {"load", cmd_load, 1},
-    {"statfs", cmd_statfs, 0}, {"ln", ln, 2},
-    {"test", test, -1}};
+    {"format", cmd_format, -1, 0}, {"cp", cmd_cp, 2, 0},
+    {"mv", cmd_mv, 2, 0},          {"rm", cmd_rm, 1, 0},
+    {"mkdir", cmd_mkdir, 1, 0},    {"rmdir", cmd_rmdir, 1, 0},
+    {"ls", cmd_ls, -1, 1},         {"cat", cmd_cat, 1, 1},
+    {"cd", cmd_cd, 1, 1},          {"pwd", cmd_pwd, 0, 1},
+    {"info", cmd_info, 1, 1},      {"incp", cmd_incp, -1, 0},
+    {"outcp", cmd_outcp, -1, 1},   {"load", cmd_load, -1, 0},
+    {"statfs", cmd_statfs, 0, 0},  {"ln", ln, 2, 0},
+    {"read", cmd_read, 3, 1},      {"write", cmd_write, 3, 0},
+    {"test", test, -1, 0}};
 
 // Number of commands
-const int NUM_COMMANDS = sizeof(commands) / sizeof(commands[0]);
\ No newline at end of file
+const int NUM_COMMANDS = sizeof(commands) / sizeof(commands[0]);
+
+/**
+ * @brief Find a command by its name.
+ *
+ * @param name Command name.
+ * @return const struct CommandEntry* The command, or NULL if there is none.
+ */
+const struct CommandEntry *find_command(const char *name) {
+  for (int i = 0; i < NUM_COMMANDS; i++) {
+    if (!strcmp(name, commands[i].name))
+      return &commands[i];
+  }
+  return NULL;
+}
@@ -1,15 +1,22 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
+struct SystemState;
+struct session;
+
 // Command entry struct - combines name and function
 struct CommandEntry {
     char* name;
-    int (*function)(int argc,char** argv);
+    int (*function)(struct SystemState* mount, struct session* session,
+                    int argc, char** argv);
     int arg_count; // -1 if argument count can varry
+    int shared; // only reads the filesystem, may run next to other shared ones
 };
 
 // Commands array declaration
 extern struct CommandEntry commands[];
 extern const int NUM_COMMANDS;
 
+const struct CommandEntry *find_command(const char *name);
+
 #endif // COMMANDS_H
\ No newline at end of file
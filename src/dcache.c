@@ -0,0 +1,370 @@
+#include "dulafs.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Compute the hash bucket of a (parent, name) pair.
+ *
+ * @param dc Cache to look into.
+ * @param parent Inode ID of the directory.
+ * @param name Item name.
+ * @return int Index of the bucket.
+ */
+static int bucket_of(const struct dentry_cache *dc, int parent,
+                     const char *name) {
+  uint32_t hash = 2166136261u ^ (uint32_t)parent;
+  for (int i = 0; i < DIR_NAME_SIZE && name[i]; i++) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619u;
+  }
+  return hash % dc->bucket_count;
+}
+
+/**
+ * @brief Find the entry of a (parent, name) pair.
+ *
+ * @param dc Cache to look into.
+ * @param parent Inode ID of the directory.
+ * @param name Item name.
+ * @return struct dentry* The entry, or NULL if the pair is not cached.
+ */
+static struct dentry *lookup(const struct dentry_cache *dc, int parent,
+                             const char *name) {
+  if (!dc->entries)
+    return NULL;
+  struct dentry *entry = dc->buckets[bucket_of(dc, parent, name)];
+  while (entry && (entry->parent != parent ||
+                   strncmp(entry->name, name, DIR_NAME_SIZE)))
+    entry = entry->hash_next;
+  return entry;
+}
+
+/**
+ * @brief Remove an entry from its hash bucket.
+ *
+ * @param dc Cache holding the entry.
+ * @param entry Entry to unlink.
+ */
+static void hash_remove(struct dentry_cache *dc, struct dentry *entry) {
+  struct dentry **link =
+      &dc->buckets[bucket_of(dc, entry->parent, entry->name)];
+  while (*link && *link != entry)
+    link = &(*link)->hash_next;
+  if (*link)
+    *link = entry->hash_next;
+  entry->hash_next = NULL;
+}
+
+/**
+ * @brief Unlink an entry from the LRU list.
+ *
+ * @param dc Cache holding the entry.
+ * @param entry Entry to unlink.
+ */
+static void lru_unlink(struct dentry_cache *dc, struct dentry *entry) {
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    dc->lru_head = entry->next;
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    dc->lru_tail = entry->prev;
+  entry->prev = entry->next = NULL;
+}
+
+/**
+ * @brief Put an entry at the most recently used end of the LRU list.
+ *
+ * @param dc Cache holding the entry.
+ * @param entry Entry which is not on the list.
+ */
+static void push_front(struct dentry_cache *dc, struct dentry *entry) {
+  entry->prev = NULL;
+  entry->next = dc->lru_head;
+  if (dc->lru_head)
+    dc->lru_head->prev = entry;
+  dc->lru_head = entry;
+  if (!dc->lru_tail)
+    dc->lru_tail = entry;
+}
+
+/**
+ * @brief Whether a name can be used as a key.
+ *
+ * Stored item names are cut to DIR_NAME_SIZE - 1 characters, a longer name
+ * never matches and must not be cached under its cut form.
+ *
+ * @param name Item name.
+ * @return bool true if the name fits.
+ */
+static bool cacheable(const char *name) {
+  return strnlen(name, DIR_NAME_SIZE) < DIR_NAME_SIZE;
+}
+
+/**
+ * @brief Look up a name in the cache.
+ *
+ * @param dc Cache to use.
+ * @param parent Inode ID of the directory.
+ * @param name Item name.
+ * @param inode Output inode ID of the item, -1 if the name is known to be
+ * absent.
+ * @return bool true on a hit, false if the directory must be searched.
+ */
+bool dcache_lookup(struct dentry_cache *dc, int parent, const char *name,
+                   int *inode) {
+  pthread_mutex_lock(&dc->lock);
+  struct dentry *entry = cacheable(name) ? lookup(dc, parent, name) : NULL;
+  if (!entry) {
+    dc->misses++;
+  } else {
+    dc->hits++;
+    if (dc->lru_head != entry) {
+      lru_unlink(dc, entry);
+      push_front(dc, entry);
+    }
+    *inode = entry->inode;
+  }
+  pthread_mutex_unlock(&dc->lock);
+  return entry != NULL;
+}
+
+/**
+ * @brief Remember the result of a directory search.
+ *
+ * The least recently used entry is replaced once the cache is full.
+ *
+ * @param dc Cache to use.
+ * @param parent Inode ID of the directory.
+ * @param name Item name.
+ * @param inode Inode ID of the item, -1 if the name is absent.
+ */
+void dcache_insert(struct dentry_cache *dc, int parent, const char *name,
+                   int inode) {
+  if (!cacheable(name))
+    return;
+  pthread_mutex_lock(&dc->lock);
+  if (!dc->entries) {
+    dc->bucket_count = DCACHE_CAPACITY * 2 + 1;
+    dc->entries = calloc(DCACHE_CAPACITY, sizeof(struct dentry));
+    dc->buckets = calloc(dc->bucket_count, sizeof(struct dentry *));
+    if (!dc->entries || !dc->buckets) {
+      dcache_destroy(dc);
+      pthread_mutex_unlock(&dc->lock);
+      return;
+    }
+  }
+
+  struct dentry *entry = lookup(dc, parent, name);
+  if (!entry && dc->used < DCACHE_CAPACITY) {
+    entry = &dc->entries[dc->used++];
+  } else {
+    if (!entry)
+      entry = dc->lru_tail;
+    hash_remove(dc, entry);
+    lru_unlink(dc, entry);
+  }
+
+  entry->parent = parent;
+  strncpy(entry->name, name, DIR_NAME_SIZE);
+  entry->inode = inode;
+  int bucket = bucket_of(dc, parent, name);
+  entry->hash_next = dc->buckets[bucket];
+  dc->buckets[bucket] = entry;
+  push_front(dc, entry);
+  pthread_mutex_unlock(&dc->lock);
+}
+
+/**
+ * @brief Forget a (parent, name) pair after the directory changed.
+ *
+ * @param dc Cache to use.
+ * @param parent Inode ID of the directory.
+ * @param name Item name.
+ */
+void dcache_invalidate(struct dentry_cache *dc, int parent, const char *name) {
+  struct dentry *entry = cacheable(name) ? lookup(dc, parent, name) : NULL;
+  if (!entry)
+    return;
+  hash_remove(dc, entry);
+  lru_unlink(dc, entry);
+  // the freed entry is reused first
+  entry->prev = dc->lru_tail;
+  if (dc->lru_tail)
+    dc->lru_tail->next = entry;
+  dc->lru_tail = entry;
+  if (!dc->lru_head)
+    dc->lru_head = entry;
+  entry->parent = -1;
+  entry->name[0] = '\0';
+}
+
+/**
+ * @brief Find the reverse index link of a directory.
+ *
+ * @param dc Cache to look into.
+ * @param child Inode ID of the directory.
+ * @return struct parent_link** The link pointing at the entry, or at the
+ * end of its bucket if the directory is not indexed.
+ */
+static struct parent_link **find_link(struct dentry_cache *dc, int child) {
+  struct parent_link **link =
+      &dc->links[(unsigned int)child % dc->link_bucket_count];
+  while (*link && (*link)->child != child)
+    link = &(*link)->next;
+  return link;
+}
+
+/**
+ * @brief Grow the reverse index so chains stay short.
+ *
+ * @param dc Cache to grow.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int grow_links(struct dentry_cache *dc) {
+  int bucket_count = dc->link_bucket_count ? dc->link_bucket_count * 2 : 256;
+  struct parent_link **links = calloc(bucket_count, sizeof(struct parent_link *));
+  if (!links)
+    return -1;
+  for (int b = 0; b < dc->link_bucket_count; b++) {
+    struct parent_link *link = dc->links[b];
+    while (link) {
+      struct parent_link *next = link->next;
+      int index = (unsigned int)link->child % bucket_count;
+      link->next = links[index];
+      links[index] = link;
+      link = next;
+    }
+  }
+  free(dc->links);
+  dc->links = links;
+  dc->link_bucket_count = bucket_count;
+  return 0;
+}
+
+/**
+ * @brief Record where a directory is linked from.
+ *
+ * @param dc Cache to use.
+ * @param child Inode ID of the directory.
+ * @param parent Inode ID of its parent.
+ * @param name Name of the directory in its parent.
+ */
+void dcache_set_parent(struct dentry_cache *dc, int child, int parent,
+                       const char *name) {
+  pthread_mutex_lock(&dc->lock);
+  if (dc->link_count < dc->link_bucket_count * 2 || !grow_links(dc)) {
+    struct parent_link **slot = find_link(dc, child);
+    struct parent_link *link = *slot;
+    if (!link && (link = malloc(sizeof(struct parent_link)))) {
+      link->child = child;
+      link->next = NULL;
+      *slot = link;
+      dc->link_count++;
+    }
+    if (link) {
+      link->parent = parent;
+      strlcpy(link->name, name, DIR_NAME_SIZE);
+    }
+  }
+  pthread_mutex_unlock(&dc->lock);
+}
+
+/**
+ * @brief Look up where a directory is linked from.
+ *
+ * @param dc Cache to use.
+ * @param child Inode ID of the directory.
+ * @param parent Output inode ID of its parent.
+ * @param name Output name, DIR_NAME_SIZE bytes.
+ * @return bool true if the directory is in the reverse index.
+ */
+bool dcache_parent_of(struct dentry_cache *dc, int child, int *parent,
+                      char *name) {
+  pthread_mutex_lock(&dc->lock);
+  struct parent_link *link = dc->links ? *find_link(dc, child) : NULL;
+  if (link) {
+    *parent = link->parent;
+    memcpy(name, link->name, DIR_NAME_SIZE);
+  }
+  pthread_mutex_unlock(&dc->lock);
+  return link != NULL;
+}
+
+/**
+ * @brief Forget every entry of a directory and its reverse index link, used
+ * when it is freed so its inode ID can be reused.
+ *
+ * @param dc Cache to use.
+ * @param parent Inode ID of the directory.
+ */
+void dcache_forget_dir(struct dentry_cache *dc, int parent) {
+  for (int i = 0; i < dc->used; i++) {
+    if (dc->entries[i].parent == parent)
+      dcache_invalidate(dc, parent, dc->entries[i].name);
+  }
+  if (!dc->links)
+    return;
+  struct parent_link **slot = find_link(dc, parent);
+  struct parent_link *link = *slot;
+  if (link) {
+    *slot = link->next;
+    free(link);
+    dc->link_count--;
+  }
+}
+
+/**
+ * @brief Free all links of the reverse index.
+ *
+ * @param dc Cache to use.
+ */
+static void free_links(struct dentry_cache *dc) {
+  for (int b = 0; b < dc->link_bucket_count; b++) {
+    struct parent_link *link = dc->links[b];
+    while (link) {
+      struct parent_link *next = link->next;
+      free(link);
+      link = next;
+    }
+    dc->links[b] = NULL;
+  }
+  dc->link_count = 0;
+}
+
+/**
+ * @brief Forget all entries and links, used after open and format.
+ *
+ * @param dc Cache to clear.
+ */
+void dcache_clear(struct dentry_cache *dc) {
+  free_links(dc);
+  if (!dc->entries)
+    return;
+  memset(dc->buckets, 0, dc->bucket_count * sizeof(struct dentry *));
+  dc->used = 0;
+  dc->lru_head = dc->lru_tail = NULL;
+  dc->hits = dc->misses = 0;
+}
+
+/**
+ * @brief Free the memory of the cache.
+ *
+ * @param dc Cache to destroy.
+ */
+void dcache_destroy(struct dentry_cache *dc) {
+  free_links(dc);
+  free(dc->links);
+  free(dc->entries);
+  free(dc->buckets);
+  // the lock stays usable, it lives as long as the mount
+  dc->entries = NULL;
+  dc->buckets = NULL;
+  dc->bucket_count = dc->used = 0;
+  dc->lru_head = dc->lru_tail = NULL;
+  dc->hits = dc->misses = 0;
+  dc->links = NULL;
+  dc->link_bucket_count = dc->link_count = 0;
+}
@@ -0,0 +1,56 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+// Included from dulafs.h once DIR_NAME_SIZE is defined.
+#include <pthread.h>
+#include <stdbool.h>
+
+#define DCACHE_CAPACITY 4096
+
+// Cached result of looking up one name in one directory
+struct dentry {
+  int parent;                // inode ID of the directory
+  char name[DIR_NAME_SIZE];  // item name
+  int inode;                 // inode ID of the item, -1 if the name is absent
+  struct dentry *prev, *next; // LRU list, most recently used first
+  struct dentry *hash_next;  // next entry in the same hash bucket
+};
+
+// Where a directory is linked from, directories have exactly one parent
+struct parent_link {
+  int child;                // inode ID of the directory
+  int parent;               // inode ID of its parent
+  char name[DIR_NAME_SIZE]; // name of the directory in its parent
+  struct parent_link *next; // next link in the same hash bucket
+};
+
+// Fixed size (parent, name) -> inode cache with LRU replacement, plus the
+// reverse child -> (parent, name) index of directories. Lookups may run on
+// several threads, invalidation only while no lookup can run.
+struct dentry_cache {
+  struct dentry *entries; // all entries, allocated on first insert
+  struct dentry **buckets;
+  int bucket_count;
+  int used;               // number of entries handed out so far
+  struct dentry *lru_head, *lru_tail;
+  long hits, misses;
+  struct parent_link **links; // reverse index, grows with the directories
+  int link_bucket_count;
+  int link_count;
+  pthread_mutex_t lock; // taken by lookups, sessions may look up in parallel
+};
+
+bool dcache_lookup(struct dentry_cache *dc, int parent, const char *name,
+                   int *inode);
+void dcache_insert(struct dentry_cache *dc, int parent, const char *name,
+                   int inode);
+void dcache_invalidate(struct dentry_cache *dc, int parent, const char *name);
+void dcache_set_parent(struct dentry_cache *dc, int child, int parent,
+                       const char *name);
+bool dcache_parent_of(struct dentry_cache *dc, int child, int *parent,
+                      char *name);
+void dcache_forget_dir(struct dentry_cache *dc, int parent);
+void dcache_clear(struct dentry_cache *dc);
+void dcache_destroy(struct dentry_cache *dc);
+
+#endif
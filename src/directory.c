@@ -0,0 +1,466 @@
+#include "dulafs.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Average number of entries per bucket above which the index doubles, about
+// half of what a bucket holds so a bucket rarely overflows
+#define DIR_INDEX_LOAD (DIR_INDEX_BUCKET_ENTRIES / 2)
+// Buckets are built in memory first, this bounds that buffer to 64 MiB
+#define DIR_INDEX_MAX_BUCKETS (1 << 14)
+
+/**
+ * @brief Hash an item name (FNV-1a).
+ *
+ * @param name Item name, at most DIR_NAME_SIZE bytes are used.
+ * @return uint32_t The hash.
+ */
+static uint32_t name_hash(const char *name) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < DIR_NAME_SIZE && name[i]; i++) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * @brief Number of items in a directory.
+ *
+ * @param dir_inode Pointer to the directory inode.
+ * @return int Item count.
+ */
+static int item_count(const struct inode *dir_inode) {
+  return dir_inode->file_size / sizeof(struct directory_item);
+}
+
+/**
+ * @brief Read one item of a directory.
+ *
+ * @param mount Mount to work on.
+ * @param dir_inode Pointer to the directory inode.
+ * @param slot Position of the item.
+ * @param item Output item.
+ * @return int 0 on success, -1 on failure.
+ */
+int dir_read_item(struct SystemState *mount, struct inode *dir_inode, int slot,
+                  struct directory_item *item) {
+  int cluster = node_cluster_at(mount, dir_inode, slot / DIR_ITEMS_PER_CLUSTER);
+  if (cluster < 0)
+    return -1;
+  return cache_read(&mount->cache, cluster,
+                    slot % DIR_ITEMS_PER_CLUSTER *
+                        sizeof(struct directory_item),
+                    item, sizeof(struct directory_item));
+}
+
+/**
+ * @brief Overwrite one item of a directory.
+ *
+ * @param mount Mount to work on.
+ * @param dir_inode Pointer to the directory inode, the slot must be mapped.
+ * @param slot Position of the item.
+ * @param item New contents.
+ * @return int 0 on success, -1 on failure.
+ */
+int dir_write_item(struct SystemState *mount, struct inode *dir_inode, int slot,
+                   const struct directory_item *item) {
+  int cluster = node_cluster_at(mount, dir_inode, slot / DIR_ITEMS_PER_CLUSTER);
+  if (cluster < 0)
+    return -1;
+  return cache_write(&mount->cache, cluster,
+                     slot % DIR_ITEMS_PER_CLUSTER *
+                         sizeof(struct directory_item),
+                     item, sizeof(struct directory_item));
+}
+
+/**
+ * @brief Find the hash index node of a directory.
+ *
+ * @param mount Mount to work on.
+ * @param dir_inode Pointer to the directory inode.
+ * @return int Inode ID of the index, 0 if the directory has none.
+ */
+static int index_node_of(struct SystemState *mount, struct inode *dir_inode) {
+  if (!(mount->sb.features & SB_FEATURE_DIR_INDEX) ||
+      item_count(dir_inode) <= DIR_ITEMS_PER_CLUSTER)
+    return 0;
+  struct dir_self_item self;
+  if (dir_read_item(mount, dir_inode, 1, (struct directory_item *)&self))
+    return 0;
+  return self.index_node;
+}
+
+/**
+ * @brief Record the hash index node in the "." item of a directory.
+ *
+ * @param mount Mount to work on.
+ * @param dir_inode Pointer to the directory inode.
+ * @param index_id Inode ID of the index, 0 to remove it.
+ */
+static void set_index_node(struct SystemState *mount, struct inode *dir_inode,
+                           int index_id) {
+  int cluster = node_cluster_at(mount, dir_inode, 0);
+  if (cluster >= 0)
+    cache_write(&mount->cache, cluster,
+                sizeof(struct directory_item) +
+                    offsetof(struct dir_self_item, index_node),
+                &index_id, sizeof(int));
+}
+
+/**
+ * @brief Free a hash index node and its buckets.
+ *
+ * @param mount Mount to work on.
+ * @param index_id Inode ID of the index.
+ */
+static void release_index(struct SystemState *mount, int index_id) {
+  struct inode index = get_inode(mount, index_id);
+  release_node_clusters(mount, &index);
+  clear_bit(mount, index_id, mount->sb.bitmapi_start_address);
+}
+
+/**
+ * @brief Build a new hash index of all items of a directory and replace the
+ * old one.
+ *
+ * The bucket count is doubled until no bucket overflows. On failure (no free
+ * inode or clusters) the directory is left without an index and is scanned
+ * instead.
+ *
+ * @param mount Mount to work on.
+ * @param dir_inode Pointer to the directory inode.
+ * @param bucket_count Initial number of buckets, a power of two.
+ * @return int 0 on success, -1 on failure.
+ */
+static int build_index(struct SystemState *mount, struct inode *dir_inode,
+                       int bucket_count) {
+  int old_index = index_node_of(mount, dir_inode);
+  if (old_index) {
+    release_index(mount, old_index);
+    set_index_node(mount, dir_inode, 0);
+  }
+
+  int record_count = item_count(dir_inode);
+  struct directory_item items[DIR_ITEMS_PER_CLUSTER];
+  struct dir_index_bucket *buckets = NULL;
+  // every bucket takes a cluster, more than are free cannot be stored
+  for (; bucket_count <= DIR_INDEX_MAX_BUCKETS &&
+         bucket_count <= mount->sb.free_cluster_count;
+       bucket_count *= 2) {
+    buckets = calloc(bucket_count, sizeof(struct dir_index_bucket));
+    if (!buckets)
+      return -1;
+    bool overflow = false;
+    for (int first = 0; first < record_count && !overflow;
+         first += DIR_ITEMS_PER_CLUSTER) {
+      int count = record_count - first < DIR_ITEMS_PER_CLUSTER
+                      ? record_count - first
+                      : DIR_ITEMS_PER_CLUSTER;
+      cache_read(
+          &mount->cache,
+          node_cluster_at(mount, dir_inode, first / DIR_ITEMS_PER_CLUSTER), 0,
+          items, count * sizeof(struct directory_item));
+      for (int i = 0; i < count; i++) {
+        uint32_t hash = name_hash(items[i].item_name);
+        struct dir_index_bucket *bucket = &buckets[hash & (bucket_count - 1)];
+        if (bucket->count == DIR_INDEX_BUCKET_ENTRIES) {
+          overflow = true;
+          break;
+        }
+        bucket->entries[bucket->count].hash = hash;
+        bucket->entries[bucket->count].slot = first + i;
+        bucket->count++;
+      }
+    }
+    if (!overflow)
+      break;
+    free(buckets);
+    buckets = NULL;
+  }
+  if (!buckets)
+    return -1;
+
+  struct inode index = {0};
+  index.id = assign_empty_inode(mount);
+  if (index.id < 0) {
+    free(buckets);
+    return -1;
+  }
+  // its clusters are mapped like those of a file, but it is not counted
+  index.is_file = true;
+  index.is_index = true;
+  index.references = 1;
+  index.file_size = bucket_count * CLUSTER_SIZE;
+  int *clusters = assign_node_clusters(mount, &index);
+  if (!clusters) {
+    clear_bit(mount, index.id, mount->sb.bitmapi_start_address);
+    free(buckets);
+    return -1;
+  }
+  // a bucket is a little smaller than its cluster, the rest stays zero
+  uint8_t cluster_data[CLUSTER_SIZE] = {0};
+  for (int b = 0; b < bucket_count; b++) {
+    memcpy(cluster_data, &buckets[b], sizeof(struct dir_index_bucket));
+    cache_write(&mount->cache, clusters[b], 0, cluster_data, CLUSTER_SIZE);
+  }
+  free(clusters);
+  free(buckets);
+
+  set_index_node(mount, dir_inode, index.id);
+  return 0;
+}
+
+/**
+ * @brief Locate the bucket of a hash in an index.
+ *
+ * @param mount Mount to work on.
+ * @param index Pointer to the index inode.
+ * @param hash Hash of an item name.
+ * @return int Cluster holding the bucket, or -1.
+ */
+static int bucket_cluster(struct SystemState *mount, struct inode *index,
+                          uint32_t hash) {
+  int bucket_count = index->file_size / CLUSTER_SIZE;
+  return node_cluster_at(mount, index, hash & (bucket_count - 1));
+}
+
+/**
+ * @brief Add an entry to the bucket of its hash.
+ *
+ * @param mount Mount to work on.
+ * @param index_id Inode ID of the index.
+ * @param hash Hash of the item name.
+ * @param slot Position of the item.
+ * @return int 0 on success, -1 if the bucket is full.
+ */
+static int index_insert(struct SystemState *mount, int index_id, uint32_t hash,
+                        int slot) {
+  struct inode index = get_inode(mount, index_id);
+  int cluster = bucket_cluster(mount, &index, hash);
+  int count;
+  if (cluster < 0 ||
+      cache_read(&mount->cache, cluster, 0, &count, sizeof(int)) ||
+      count >= DIR_INDEX_BUCKET_ENTRIES)
+    return -1;
+
+  struct dir_index_entry entry = {hash, slot};
+  cache_write(&mount->cache, cluster,
+              offsetof(struct dir_index_bucket, entries) +
+                  count * sizeof(struct dir_index_entry),
+              &entry, sizeof(entry));
+  count++;
+  cache_write(&mount->cache, cluster, 0, &count, sizeof(int));
+  return 0;
+}
+
+/**
+ * @brief Point the entry of an item at a new slot, or remove it.
+ *
+ * @param mount Mount to work on.
+ * @param index_id Inode ID of the index.
+ * @param hash Hash of the item name.
+ * @param slot Current position of the item.
+ * @param new_slot New position, or -1 to remove the entry.
+ */
+static void index_update(struct SystemState *mount, int index_id, uint32_t hash,
+                         int slot, int new_slot) {
+  struct inode index = get_inode(mount, index_id);
+  int cluster = bucket_cluster(mount, &index, hash);
+  struct dir_index_bucket bucket;
+  if (cluster < 0 || cache_read(&mount->cache, cluster, 0, &bucket,
+                                sizeof(struct dir_index_bucket)))
+    return;
+
+  for (int i = 0; i < bucket.count; i++) {
+    if (bucket.entries[i].slot != slot)
+      continue;
+    if (new_slot >= 0)
+      bucket.entries[i].slot = new_slot;
+    else
+      bucket.entries[i] = bucket.entries[--bucket.count];
+    cache_write(&mount->cache, cluster, 0, &bucket,
+                sizeof(struct dir_index_bucket));
+    return;
+  }
+}
+
+/**
+ * @brief Scan the items of a directory one cluster at a time.
+ *
+ * @param mount Mount to work on.
+ * @param dir_inode Pointer to the directory inode.
+ * @param item_name Name to look for, or NULL to look for node_id.
+ * @param node_id Inode ID to look for when item_name is NULL, "." and ".."
+ * are skipped.
+ * @return int Position of the first matching item, or -1 if there is none.
+ */
+static int scan_dir(struct SystemState *mount, struct inode *dir_inode,
+                    const char *item_name, int node_id) {
+  int record_count = item_count(dir_inode);
+  struct directory_item items[DIR_ITEMS_PER_CLUSTER];
+  for (int first = 0; first < record_count; first += DIR_ITEMS_PER_CLUSTER) {
+    int count = record_count - first < DIR_ITEMS_PER_CLUSTER
+                    ? record_count - first
+                    : DIR_ITEMS_PER_CLUSTER;
+    int cluster = node_cluster_at(mount, dir_inode,
+                                  first / DIR_ITEMS_PER_CLUSTER);
+    if (cluster < 0 ||
+        cache_read(&mount->cache, cluster, 0, items,
+                   count * sizeof(struct directory_item)))
+      return -1;
+    for (int i = 0; i < count; i++) {
+      if (item_name ? !strcmp(items[i].item_name, item_name)
+                    : first + i > 1 && items[i].inode == node_id)
+        return first + i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Find an item of a directory by name.
+ *
+ * Directories with a hash index read one bucket and the items it points to,
+ * the others are scanned one cluster at a time.
+ *
+ * @param mount Mount to work on.
+ * @param dir_inode Pointer to the directory inode.
+ * @param item_name Name to look for.
+ * @return int Position of the item, or -1 if there is none.
+ */
+int find_item_in_dir(struct SystemState *mount, struct inode *dir_inode,
+                     char *item_name) {
+  if (dir_inode->is_file)
+    return -1;
+
+  int index_id = index_node_of(mount, dir_inode);
+  if (index_id) {
+    struct inode index = get_inode(mount, index_id);
+    uint32_t hash = name_hash(item_name);
+    int cluster = bucket_cluster(mount, &index, hash);
+    struct dir_index_bucket bucket;
+    if (cluster >= 0 && !cache_read(&mount->cache, cluster, 0, &bucket,
+                                    sizeof(struct dir_index_bucket))) {
+      for (int i = 0; i < bucket.count; i++) {
+        struct directory_item item;
+        if (bucket.entries[i].hash == hash &&
+            !dir_read_item(mount, dir_inode, bucket.entries[i].slot, &item) &&
+            !strcmp(item.item_name, item_name))
+          return bucket.entries[i].slot;
+      }
+      return -1;
+    }
+  }
+
+  return scan_dir(mount, dir_inode, item_name, -1);
+}
+
+/**
+ * @brief Find the item linking a given inode into a directory, skipping "."
+ * and "..".
+ *
+ * @param mount Mount to work on.
+ * @param dir_inode Pointer to the directory inode.
+ * @param node_id Inode ID the item points to.
+ * @return int Position of the item, or -1 if there is none.
+ */
+int find_inode_in_dir(struct SystemState *mount, struct inode *dir_inode,
+                      int node_id) {
+  if (dir_inode->is_file)
+    return -1;
+  return scan_dir(mount, dir_inode, NULL, node_id);
+}
+
+/**
+ * @brief Append an item to a directory.
+ *
+ * The directory gets another cluster when the last one is full. Once it
+ * spans more than one cluster on an image with SB_FEATURE_DIR_INDEX, the
+ * item is added to the hash index, which is created or doubled as needed.
+ * The directory inode is written.
+ *
+ * @param mount Mount to work on.
+ * @param dir_inode Pointer to the directory inode.
+ * @param item Item to add.
+ * @return int ERR_SUCCESS, or ERR_CLUSTER_FULL if the directory cannot grow.
+ */
+int dir_add_item(struct SystemState *mount, struct inode *dir_inode,
+                 const struct directory_item *item) {
+  int slot = item_count(dir_inode);
+  if (dir_inode->file_size % CLUSTER_SIZE == 0 &&
+      node_append_cluster(mount, dir_inode) < 0)
+    return ERR_CLUSTER_FULL;
+
+  int index_id = index_node_of(mount, dir_inode);
+  dir_inode->file_size += sizeof(struct directory_item);
+  dir_write_item(mount, dir_inode, slot, item);
+
+  int record_count = item_count(dir_inode);
+  if ((mount->sb.features & SB_FEATURE_DIR_INDEX) &&
+      record_count > DIR_ITEMS_PER_CLUSTER) {
+    struct inode index;
+    int bucket_count = 0;
+    if (index_id) {
+      index = get_inode(mount, index_id);
+      bucket_count = index.file_size / CLUSTER_SIZE;
+    }
+    if (!index_id) {
+      // start with room for twice the current items
+      bucket_count = 1;
+      while (bucket_count * DIR_INDEX_LOAD < 2 * record_count)
+        bucket_count *= 2;
+      build_index(mount, dir_inode, bucket_count);
+    } else if (record_count > bucket_count * DIR_INDEX_LOAD ||
+               index_insert(mount, index_id, name_hash(item->item_name),
+                            slot)) {
+      build_index(mount, dir_inode, bucket_count * 2);
+    }
+  }
+
+  write_inode(mount, dir_inode);
+  return ERR_SUCCESS;
+}
+
+/**
+ * @brief Remove an item from a directory by moving the last item into its
+ * place.
+ *
+ * The last cluster is freed once it holds no item and the hash index is
+ * dropped when the directory fits into one cluster again. The directory
+ * inode is written.
+ *
+ * @param mount Mount to work on.
+ * @param dir_inode Pointer to the directory inode.
+ * @param slot Position of the item to remove.
+ * @return int ERR_SUCCESS, or ERR_FILE_NOT_FOUND if there is no such item.
+ */
+int dir_remove_item(struct SystemState *mount, struct inode *dir_inode,
+                    int slot) {
+  int last = item_count(dir_inode) - 1;
+  struct directory_item removed, moved;
+  if (slot < 0 || slot > last ||
+      dir_read_item(mount, dir_inode, slot, &removed))
+    return ERR_FILE_NOT_FOUND;
+
+  int index_id = index_node_of(mount, dir_inode);
+  if (index_id)
+    index_update(mount, index_id, name_hash(removed.item_name), slot, -1);
+  if (slot != last && !dir_read_item(mount, dir_inode, last, &moved)) {
+    dir_write_item(mount, dir_inode, slot, &moved);
+    if (index_id)
+      index_update(mount, index_id, name_hash(moved.item_name), last, slot);
+  }
+
+  if (last % DIR_ITEMS_PER_CLUSTER == 0)
+    node_drop_last_cluster(mount, dir_inode);
+  dir_inode->file_size -= sizeof(struct directory_item);
+
+  if (index_id && item_count(dir_inode) <= DIR_ITEMS_PER_CLUSTER) {
+    release_index(mount, index_id);
+    set_index_node(mount, dir_inode, 0);
+  }
+
+  write_inode(mount, dir_inode);
+  return ERR_SUCCESS;
+}
@@ -1,18 +1,18 @@
 #include "dulafs.h"
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef DULAFS_TEST_HOOKS
+#include <unistd.h>
+#endif
 
 const long long int MAX_FILE_SIZE =
     (DIRECT_CLUSTER_COUNT +
      (CLUSTER_SIZE / sizeof(int) + 1) * (CLUSTER_SIZE / sizeof(int))) *
     CLUSTER_SIZE;
 
-// Global system state
-struct SystemState g_system_state = {
-    .working_dir = "/", .file_ptr = NULL, .curr_node_id = ROOT_NODE, .sb = {0}};
-
 /**
  * @brief Returns the string representation of an error code.
  *
@@ -57,59 +57,377 @@ const char *get_error_message(ErrorCode code) {
     return "Invalid number of arguments";
   case ERR_FILE_TOO_LARGE:
     return "File too large";
+  case ERR_DIR_IN_USE:
+    return "Directory is the working directory of a session";
   default:
     return "Unknown error";
   }
 }
 
+/**
+ * @brief Resolve a bitmap offset to its in-memory copy.
+ *
+ * @param mount Mount to work on.
+ * @param bitmap_offset Byte offset of the bitmap in the file.
+ * @return struct bitmap* The cached inode or cluster bitmap.
+ */
+static struct bitmap *get_bitmap(struct SystemState *mount, int bitmap_offset) {
+  if (bitmap_offset == mount->sb.bitmapi_start_address)
+    return &mount->inode_bitmap;
+  return &mount->cluster_bitmap;
+}
+
+/**
+ * @brief Keep a freed cluster allocated until the next commit.
+ *
+ * Data goes to newly allocated clusters directly, so a cluster freed by the
+ * running transaction must not be handed out before it commits, or a crash
+ * or a discarded batch would find a live file's data overwritten.
+ *
+ * @param mount Mount to work on.
+ * @param i Cluster ID.
+ * @return int 1 if the cluster was queued, 0 if it has to be freed now.
+ */
+static int defer_cluster_free(struct SystemState *mount, int i) {
+  if (mount->freed_count == mount->freed_capacity) {
+    int capacity =
+        mount->freed_capacity ? mount->freed_capacity * 2 : 64;
+    int *grown =
+        realloc(mount->freed_clusters, capacity * sizeof(int));
+    if (!grown)
+      return 0;
+    mount->freed_clusters = grown;
+    mount->freed_capacity = capacity;
+  }
+  mount->freed_clusters[mount->freed_count++] = i;
+  return 1;
+}
+
 /**
  * @brief Set i-th bit in a given bitmap
  *
+ * @param mount Mount to work on.
  * @param i index of bit, starting from 0
  * @param bitmap_offset bitmap to operate on
  */
-void set_bit(int i, int bitmap_offset) {
-  int byte_index = i / 8;
-  int bit_offset = i % 8;
-  int byte_position = byte_index + bitmap_offset;
-  fseek(g_system_state.file_ptr, byte_position, SEEK_SET);
-  uint8_t byte = fgetc(g_system_state.file_ptr);
-  byte |= 1 << bit_offset;
-  fseek(g_system_state.file_ptr, byte_position, SEEK_SET);
-  fputc(byte, g_system_state.file_ptr);
-  fflush(g_system_state.file_ptr);
+void set_bit(struct SystemState *mount, int i, int bitmap_offset) {
+  if (!bitmap_set(get_bitmap(mount, bitmap_offset), i))
+    return;
+  if (bitmap_offset == mount->sb.bitmapi_start_address)
+    mount->sb.free_inode_count--;
+  else
+    mount->sb.free_cluster_count--;
+  mount->sb_dirty = true;
 }
 
 /**
  * @brief Clear i-th bit in a given bitmap.
  *
+ * @param mount Mount to work on.
  * @param i Index of bit, starting from 0.
  * @param bitmap_offset Byte offset of the bitmap in the file.
  */
-void clear_bit(int i, int bitmap_offset) {
-  int byte_index = i / 8;
-  int bit_offset = i % 8;
-  fseek(g_system_state.file_ptr, byte_index + bitmap_offset, SEEK_SET);
-  uint8_t byte = fgetc(g_system_state.file_ptr);
-  byte &= ~(1 << bit_offset);
-  fseek(g_system_state.file_ptr, byte_index + bitmap_offset, SEEK_SET);
-  fputc(byte, g_system_state.file_ptr);
-  fflush(g_system_state.file_ptr);
+void clear_bit(struct SystemState *mount, int i, int bitmap_offset) {
+  if (bitmap_offset != mount->sb.bitmapi_start_address &&
+      bitmap_test(&mount->cluster_bitmap, i)) {
+    // a freed cluster does not need to be written back anymore
+    cache_invalidate(&mount->cache, i);
+    if (defer_cluster_free(mount, i))
+      return;
+  }
+  if (!bitmap_clear(get_bitmap(mount, bitmap_offset), i))
+    return;
+  if (bitmap_offset == mount->sb.bitmapi_start_address)
+    mount->sb.free_inode_count++;
+  else
+    mount->sb.free_cluster_count++;
+  mount->sb_dirty = true;
+}
+
+/**
+ * @brief Release the clusters freed since the last commit.
+ *
+ * @param mount Mount to work on.
+ */
+static void release_freed_clusters(struct SystemState *mount) {
+  for (int k = 0; k < mount->freed_count; k++) {
+    if (bitmap_clear(&mount->cluster_bitmap, mount->freed_clusters[k])) {
+      mount->sb.free_cluster_count++;
+      mount->sb_dirty = true;
+    }
+  }
+  mount->freed_count = 0;
 }
 
 /**
  * @brief Read the value of the i-th bit in a given bitmap.
  *
+ * @param mount Mount to work on.
  * @param i Index of bit, starting from 0.
  * @param bitmap_offset Byte offset of the bitmap in the file.
  * @return int The value of the bit (0 or 1).
  */
-int read_bit(int i, int bitmap_offset) {
-  int byte_index = i / 8;
-  int bit_offset = i % 8;
-  fseek(g_system_state.file_ptr, byte_index + bitmap_offset, SEEK_SET);
-  uint8_t byte = fgetc(g_system_state.file_ptr);
-  return (byte >> bit_offset) & 1;
+int read_bit(struct SystemState *mount, int i, int bitmap_offset) {
+  return bitmap_test(get_bitmap(mount, bitmap_offset), i);
+}
+
+/**
+ * @brief Load both bitmaps described by the current superblock into memory,
+ * together with the cluster reference count table if the image has one.
+ *
+ * Must be called whenever the superblock changes (open, format).
+ *
+ * @param mount Mount to work on.
+ * @return int ERR_SUCCESS, or ERR_MEMORY_ALLOCATION on failure.
+ */
+int load_bitmaps(struct SystemState *mount) {
+  struct superblock *sb = &mount->sb;
+  if (bitmap_load(&mount->inode_bitmap, mount->storage,
+                  sb->bitmapi_start_address, sb->inode_count) ||
+      bitmap_load(&mount->cluster_bitmap, mount->storage,
+                  sb->bitmap_start_address, sb->cluster_count)) {
+    return ERR_MEMORY_ALLOCATION;
+  }
+  if (!(sb->features & SB_FEATURE_REFCOUNTS)) {
+    refcount_release(&mount->refcounts);
+    return ERR_SUCCESS;
+  }
+  if (refcount_load(&mount->refcounts, mount->storage,
+                    sb->refcount_start_address, sb->cluster_count))
+    return ERR_MEMORY_ALLOCATION;
+  return ERR_SUCCESS;
+}
+
+/**
+ * @brief Size of the superblock as stored in the current image.
+ *
+ * The inode bitmap directly follows the superblock, so images created before
+ * new superblock fields were added store only a prefix of the structure.
+ *
+ * @param mount Mount to work on.
+ * @return size_t Number of superblock bytes present on disk.
+ */
+static size_t superblock_disk_size(struct SystemState *mount) {
+  size_t size = mount->sb.bitmapi_start_address;
+  if (size > sizeof(struct superblock))
+    return sizeof(struct superblock);
+  return size;
+}
+
+/**
+ * @brief Read the superblock from the start of the image.
+ *
+ * Fields which the image is too old to contain are zeroed.
+ *
+ * @param mount Mount to work on.
+ * @return int ERR_SUCCESS, or ERR_UNKNOWN if the read failed.
+ */
+int read_superblock(struct SystemState *mount) {
+  struct superblock *sb = &mount->sb;
+  size_t legacy_size = offsetof(struct superblock, features);
+  memset(sb, 0, sizeof(struct superblock));
+
+  if (storage_read(mount->storage, sb, legacy_size, 0))
+    return ERR_UNKNOWN;
+
+  size_t disk_size = superblock_disk_size(mount);
+  if (disk_size > legacy_size &&
+      storage_read(mount->storage, (uint8_t *)sb + legacy_size,
+                   disk_size - legacy_size, legacy_size))
+    return ERR_UNKNOWN;
+  mount->sb_dirty = false;
+  return ERR_SUCCESS;
+}
+
+/**
+ * @brief Recompute the superblock counters from the bitmaps and inode table.
+ *
+ * Used for images which do not store the counters yet, the bitmaps must be
+ * loaded.
+ *
+ * @param mount Mount to work on.
+ */
+void rebuild_counters(struct SystemState *mount) {
+  struct superblock *sb = &mount->sb;
+  sb->free_inode_count =
+      sb->inode_count -
+      count_ones(mount, sb->bitmapi_start_address, sb->inode_count);
+  sb->free_cluster_count =
+      sb->cluster_count -
+      count_ones(mount, sb->bitmap_start_address, sb->cluster_count);
+  count_nodes(mount, &sb->dir_count, &sb->file_count);
+}
+
+/**
+ * @brief Switch the caches between deferring writes until the next commit
+ * and, on an addressable image, writing in place.
+ *
+ * Leaving deferred mode writes and drops everything cached, later in-place
+ * writes would leave the copies stale. While a batch is open no data may
+ * reach the image before the commit, so the cluster cache holds all writes.
+ *
+ * @param mount Mount to work on.
+ * @param deferred Whether writes wait for the next commit.
+ */
+static void defer_writes(struct SystemState *mount, bool deferred) {
+  if (mount->cache.deferred && !deferred && mount->storage->map) {
+    cache_flush(&mount->cache);
+    cache_reset(&mount->cache, mount->storage, mount->sb.data_start_address);
+    icache_flush(&mount->icache);
+    icache_reset(&mount->icache, mount->storage, mount->sb.inode_start_address);
+  }
+  mount->cache.deferred = deferred;
+  mount->cache.holding = journal_batched(&mount->journal);
+  mount->icache.deferred = deferred;
+}
+
+/**
+ * @brief Prepare the in-memory state of a mount for its superblock.
+ *
+ * Loads the bitmaps, drops the cluster cache and rebuilds the counters of
+ * images which do not store them. Called after open and format.
+ *
+ * @param mount Mount to work on.
+ * @return int ERR_SUCCESS, or error code on failure.
+ */
+int mount_filesystem(struct SystemState *mount) {
+  int result = load_bitmaps(mount);
+  if (result != ERR_SUCCESS)
+    return result;
+  cache_reset(&mount->cache, mount->storage, mount->sb.data_start_address);
+  icache_reset(&mount->icache, mount->storage, mount->sb.inode_start_address);
+  dcache_clear(&mount->dcache);
+  mount->freed_count = 0;
+  if (journal_open(&mount->journal, mount->storage,
+                   mount->sb.journal_start_address,
+                   mount->sb.features & SB_FEATURE_JOURNAL
+                       ? mount->sb.journal_size
+                       : 0))
+    return ERR_UNKNOWN;
+  defer_writes(mount,
+               mount->journal.storage || journal_batched(&mount->journal));
+  if (!(mount->sb.features & SB_FEATURE_COUNTERS))
+    rebuild_counters(mount);
+  return ERR_SUCCESS;
+}
+
+/**
+ * @brief Redo the last committed transaction of the journal after opening an
+ * image, then read the superblock again as the transaction may have changed
+ * it. Must run before mount_filesystem() loads the bitmaps.
+ *
+ * @param mount Mount to work on.
+ * @return int Number of records replayed, or -1 on failure.
+ */
+int replay_journal(struct SystemState *mount) {
+  struct superblock *sb = &mount->sb;
+  if (!(sb->features & SB_FEATURE_JOURNAL))
+    return 0;
+  if (journal_open(&mount->journal, mount->storage,
+                   sb->journal_start_address, sb->journal_size))
+    return -1;
+  int replayed = journal_replay(&mount->journal);
+  if (replayed > 0 && read_superblock(mount) != ERR_SUCCESS)
+    return -1;
+  return replayed;
+}
+
+/**
+ * @brief Write all cached metadata changes back to the image.
+ *
+ * Called at command boundaries. File data is written in place first and,
+ * with a journal, flushed, so the metadata never points at data which did
+ * not reach the image (ordered mode). Then the dirty cached metadata
+ * clusters and inodes, the dirty byte ranges of the bitmaps and the
+ * reference count table and the superblock (if its counters changed) are
+ * written as one journal transaction. Inside a batch nothing is written
+ * until the batch ends. If the commit fails, everything it wrote stays dirty
+ * for the next one.
+ *
+ * @param mount Mount to work on.
+ * @return int ERR_SUCCESS, or ERR_UNKNOWN if a write failed.
+ */
+int commit_changes(struct SystemState *mount) {
+  if (!mount->storage || journal_batched(&mount->journal))
+    return ERR_SUCCESS;
+  int failed = 0;
+  release_freed_clusters(mount);
+  cache_begin_flush(&mount->cache);
+  int data = cache_flush_data(&mount->cache);
+  if (data < 0 ||
+      (data && mount->journal.storage && storage_flush(mount->storage))) {
+    cache_mark_dirty(&mount->cache);
+    return ERR_UNKNOWN;
+  }
+  journal_begin(&mount->journal);
+  if (mount->sb_dirty && (mount->sb.features & SB_FEATURE_COUNTERS)) {
+    failed |= storage_write(mount->storage, &mount->sb,
+                            superblock_disk_size(mount), 0);
+  }
+  mount->sb_dirty = false;
+  failed |= cache_flush(&mount->cache);
+  failed |= icache_flush(&mount->icache);
+  failed |=
+      bitmap_flush(&mount->inode_bitmap, mount->storage);
+  failed |=
+      bitmap_flush(&mount->cluster_bitmap, mount->storage);
+  failed |=
+      refcount_flush(&mount->refcounts, mount->storage);
+  failed |= journal_commit(&mount->journal);
+  if (failed) {
+    // what went into the lost transaction is only left in memory
+    mount->sb_dirty = true;
+    cache_mark_dirty(&mount->cache);
+    icache_mark_dirty(&mount->icache);
+    bitmap_mark_dirty(&mount->inode_bitmap);
+    bitmap_mark_dirty(&mount->cluster_bitmap);
+    refcount_mark_dirty(&mount->refcounts);
+    return ERR_UNKNOWN;
+  }
+  return ERR_SUCCESS;
+}
+
+/**
+ * @brief Start a batch: changes stay in memory until the outermost batch
+ * ends, so they can be committed as one transaction or discarded.
+ *
+ * @param mount Mount to work on.
+ */
+void begin_batch(struct SystemState *mount) {
+  journal_batch_begin(&mount->journal);
+  defer_writes(mount, true);
+}
+
+/**
+ * @brief End a batch started by begin_batch().
+ *
+ * @param mount Mount to work on.
+ * @param commit Commit the changes of the batch, or discard everything
+ * changed since the last commit.
+ * @return int ERR_SUCCESS, or error code of the commit or reload.
+ */
+int end_batch(struct SystemState *mount, bool commit) {
+  journal_batch_end(&mount->journal);
+  int result = commit ? commit_changes(mount) : discard_changes(mount);
+  // only once the dirty blocks are gone, an addressable image bypasses them
+  if (!journal_batched(&mount->journal))
+    defer_writes(mount, mount->journal.storage != NULL);
+  return result;
+}
+
+/**
+ * @brief Throw away all changes made since the last commit.
+ *
+ * Everything cached is dropped and read again from the image. Only the
+ * working directory is left to the caller. Does not undo a format.
+ *
+ * @param mount Mount to work on.
+ * @return int ERR_SUCCESS, or error code on failure.
+ */
+int discard_changes(struct SystemState *mount) {
+  if (read_superblock(mount) != ERR_SUCCESS)
+    return ERR_UNKNOWN;
+  return mount_filesystem(mount);
 }
 
 /**
@@ -119,8 +437,13 @@ int read_bit(int i, int bitmap_offset) {
  * @return struct superblock The initialized superblock structure.
  */
 struct superblock get_superblock(int disk_size) {
-  // Calculate available space (excluding superblock)
-  int available_space = disk_size - sizeof(struct superblock);
+  // The journal takes a 32nd of the disk, whole clusters, at most 8 MiB
+  int journal_size = disk_size / 32 / CLUSTER_SIZE * CLUSTER_SIZE;
+  if (journal_size > JOURNAL_MAX_SIZE)
+    journal_size = JOURNAL_MAX_SIZE;
+
+  // Calculate available space (excluding superblock and journal)
+  int available_space = disk_size - sizeof(struct superblock) - journal_size;
 
   // Calculate inode space and count
   int inode_space = available_space * I_NODE_RATIO;
@@ -129,10 +452,14 @@ struct superblock get_superblock(int disk_size) {
   // Calculate bitmap sizes (in bytes)
   int inode_bitmap_bytes = (inode_count + 7) / 8; // +7 for ceiling division
 
-  // Calculate data space and cluster count
+  // Calculate data space and cluster count, every cluster also takes a bit
+  // in the cluster bitmap and an entry in the reference count table
   int data_space = available_space - inode_space - inode_bitmap_bytes;
-  int cluster_count = ((data_space * 8) / (CLUSTER_SIZE + 1)) / 8;
+  int cluster_count =
+      (int)((long long)data_space * 8 /
+            (CLUSTER_SIZE * 8 + 1 + 8 * sizeof(uint16_t)));
   int cluster_bitmap_bytes = (cluster_count + 7) / 8;
+  int refcount_bytes = cluster_count * sizeof(uint16_t);
 
   // Recalculate data space
   // int actual_data_space = data_space - cluster_bitmap_bytes;
@@ -140,7 +467,9 @@ struct superblock get_superblock(int disk_size) {
   // Calculate addresses
   int bitmapi_start_address = sizeof(struct superblock);
   int bitmap_start_address = bitmapi_start_address + inode_bitmap_bytes;
-  int inode_start_address = bitmap_start_address + cluster_bitmap_bytes;
+  int refcount_start_address = bitmap_start_address + cluster_bitmap_bytes;
+  int journal_start_address = refcount_start_address + refcount_bytes;
+  int inode_start_address = journal_start_address + journal_size;
   int data_start_address = inode_start_address + inode_space;
 
   struct superblock sup = {
@@ -153,6 +482,16 @@ struct superblock get_superblock(int disk_size) {
       .bitmap_start_address = bitmap_start_address,
       .inode_start_address = inode_start_address,
       .data_start_address = data_start_address,
+      .features = SB_FEATURE_COUNTERS | SB_FEATURE_DIR_INDEX |
+                  SB_FEATURE_REFCOUNTS |
+                  (journal_size ? SB_FEATURE_JOURNAL : 0),
+      .free_cluster_count = cluster_count,
+      .free_inode_count = inode_count,
+      .dir_count = 0,
+      .file_count = 0,
+      .refcount_start_address = refcount_start_address,
+      .journal_start_address = journal_start_address,
+      .journal_size = journal_size,
   };
 
   return sup;
@@ -161,168 +500,190 @@ struct superblock get_superblock(int disk_size) {
 /**
  * @brief Write an inode structure to disk.
  *
+ * The inode goes to the inode cache and reaches the image at the next
+ * commit_changes().
+ *
+ * @param mount Mount to work on.
  * @param inode Pointer to the inode structure to write.
  */
-void write_inode(struct inode *inode) {
-  long offset =
-      g_system_state.sb.inode_start_address + inode->id * sizeof(struct inode);
-  fseek(g_system_state.file_ptr, offset, SEEK_SET);
-  fwrite(inode, sizeof(struct inode), 1, g_system_state.file_ptr);
-  fflush(g_system_state.file_ptr);
+void write_inode(struct SystemState *mount, struct inode *inode) {
+  icache_store(&mount->icache, inode);
 }
 
 /**
- * @brief Find the index of the first unset (0) bit in a bitmap.
+ * @brief Find the index of an unset (0) bit in a bitmap.
+ *
+ * Uses the next-fit cursor of the bitmap, so consecutive calls hand out
+ * consecutive free bits.
  *
+ * @param mount Mount to work on.
  * @param bitmap_offset Byte offset of the bitmap in the file.
- * @return int The index of the first empty bit.
+ * @return int The index of the empty bit, bitmap size if full.
  */
-int get_empty_index(int bitmap_offset) {
-  int byte_index = 0;
-  int bit_offset = 0;
-  // search for first unset bit
-
-  fseek(g_system_state.file_ptr, bitmap_offset, SEEK_SET);
-  uint8_t byte;
-  while ((byte = fgetc(g_system_state.file_ptr)) == 255)
-    byte_index++;
-  while (byte >> bit_offset & 1)
-    bit_offset++;
-  // printf("final offset in get_empty_index: %d\n", byte_index * 8 +
-  // bit_offset);
-  return byte_index * 8 + bit_offset;
+int get_empty_index(struct SystemState *mount, int bitmap_offset) {
+  struct bitmap *bm = get_bitmap(mount, bitmap_offset);
+  int index = bitmap_find_free(bm);
+  return index < 0 ? bm->bit_count : index;
 }
 
 /**
  * @brief Calculate the number of unused inodes remaining.
  *
+ * @param mount Mount to work on.
  * @return int Number of free inodes.
  */
-int unused_inodes_left() {
-  return g_system_state.sb.inode_count -
-         count_ones(g_system_state.sb.bitmapi_start_address,
-                    g_system_state.sb.inode_count);
+int unused_inodes_left(struct SystemState *mount) {
+  return mount->sb.free_inode_count;
 };
 
 /**
  * @brief Find a free inode, mark it as used, and return its ID.
  *
+ * @param mount Mount to work on.
  * @return int The ID of the assigned inode, or -1 if full.
  */
-int assign_empty_inode() {
-  int node_id = get_empty_index(g_system_state.sb.bitmapi_start_address);
-  if (node_id >= g_system_state.sb.inode_count)
+int assign_empty_inode(struct SystemState *mount) {
+  int node_id = get_empty_index(mount, mount->sb.bitmapi_start_address);
+  if (node_id >= mount->sb.inode_count)
     return -1;
-  set_bit(node_id, g_system_state.sb.bitmapi_start_address);
+  set_bit(mount, node_id, mount->sb.bitmapi_start_address);
   return node_id;
 }
 
 /**
  * @brief Find a free cluster, mark it as used, and return its ID.
  *
+ * @param mount Mount to work on.
  * @return int The ID of the assigned cluster, or -1 if full.
  */
-int assign_empty_cluster() {
-  int cluster_id = get_empty_index(g_system_state.sb.bitmap_start_address);
-  if (cluster_id >= g_system_state.sb.cluster_count)
+int assign_empty_cluster(struct SystemState *mount) {
+  int cluster_id = get_empty_index(mount, mount->sb.bitmap_start_address);
+  if (cluster_id >= mount->sb.cluster_count)
     return -1;
-  set_bit(cluster_id, g_system_state.sb.bitmap_start_address);
+  set_bit(mount, cluster_id, mount->sb.bitmap_start_address);
   return cluster_id;
 }
 
 /**
  * @brief Read an inode from disk by its ID.
  *
+ * @param mount Mount to work on.
  * @param node_id The ID of the inode to read.
  * @return struct inode The inode structure read from disk.
  */
-struct inode get_inode(int node_id) {
+struct inode get_inode(struct SystemState *mount, int node_id) {
   struct inode inode;
-  fseek(g_system_state.file_ptr,
-        g_system_state.sb.inode_start_address + node_id * sizeof(struct inode),
-        SEEK_SET);
-  fread(&inode, sizeof(struct inode), 1, g_system_state.file_ptr);
+  // a slot which cannot be read comes back zeroed
+  if (icache_get(&mount->icache, node_id, &inode))
+    memset(&inode, 0, sizeof(inode));
   return inode;
 }
 
 /**
  * @brief Check if a directory contains a file with the given name.
  *
+ * @param mount Mount to work on.
  * @param inode Pointer to the directory inode.
  * @param file_name Name of the file to search for.
  * @return int 1 if found, 0 otherwise.
  */
-int contains_file(struct inode *inode, char *file_name) {
+int contains_file(struct SystemState *mount, struct inode *inode,
+                  char *file_name) {
   if (inode->is_file) {
     return 0;
   }
+  return find_item_in_dir(mount, inode, file_name) >= 0;
+}
 
-  struct directory_item *dir_content = get_directory_items(inode);
-  if (!dir_content)
+/**
+ * @brief Find the parent of a directory and its name there.
+ *
+ * The reverse index of the dentry cache answers without any I/O, on a miss
+ * the ".." item is read and the parent searched for the directory, which is
+ * then added to the index.
+ *
+ * @param mount Mount to work on.
+ * @param node_id Inode ID of the directory, not the root.
+ * @param parent_id Output inode ID of the parent.
+ * @param name Output name of the directory, DIR_NAME_SIZE bytes.
+ * @return int 0 on success, -1 if the directory is not linked.
+ */
+static int parent_of(struct SystemState *mount, int node_id, int *parent_id,
+                     char *name) {
+  if (dcache_parent_of(&mount->dcache, node_id, parent_id, name))
     return 0;
 
-  int record_count = inode->file_size / sizeof(struct directory_item);
-  int found = 0;
-
-  for (int i = 0; i < record_count; i++) {
-    if (!strcmp(dir_content[i].item_name, file_name)) {
-      found = 1;
-      break;
-    }
-  }
-
-  free(dir_content);
-  return found;
+  struct inode inode = get_inode(mount, node_id);
+  struct directory_item item;
+  if (inode.is_file || dir_read_item(mount, &inode, 0, &item))
+    return -1;
+  struct inode parent = get_inode(mount, item.inode);
+  int slot = find_inode_in_dir(mount, &parent, node_id);
+  *parent_id = item.inode;
+  if (slot < 0 || dir_read_item(mount, &parent, slot, &item))
+    return -1;
+  strlcpy(name, item.item_name, DIR_NAME_SIZE);
+  dcache_set_parent(&mount->dcache, node_id, *parent_id, name);
+  return 0;
 }
 
 /**
- * @brief Reconstruct the full path string for a given inode ID.
+ * @brief Reconstruct the full path string for a given directory inode ID.
+ *
+ * The path is built backwards from the directory to the root, one reverse
+ * index lookup per level.
  *
- * @param inode_id The ID of the inode.
+ * @param mount Mount to work on.
+ * @param inode_id The ID of the directory inode.
  * @return char* The full path string (must be freed by caller), or NULL on
  * error.
  */
-char *inode_to_path(int inode_id) {
-  struct inode curr_inode = get_inode(inode_id);
-  int prev_inode_id = -1;
+char *inode_to_path(struct SystemState *mount, int inode_id) {
   char *path = malloc(MAX_DIR_PATH);
   if (!path)
     return NULL;
-  path[0] = '\0';
-  while (prev_inode_id != ROOT_NODE) {
-    struct directory_item *dir_content = get_directory_items(&curr_inode);
-    if (prev_inode_id != -1) {
-      int record_found = 0;
-      int record_count = curr_inode.file_size / sizeof(struct directory_item);
-      for (int i = 0; i < record_count; i++) {
-        if (dir_content[i].inode == prev_inode_id) {
-          // Prepend the name to the path
-          char temp[MAX_DIR_PATH];
-          snprintf(temp, sizeof(temp), "/%s%s", dir_content[i].item_name, path);
-          strlcpy(path, temp, MAX_DIR_PATH);
-          record_found = 1;
-          break;
-        }
-      }
-      if (!record_found) {
-        // Could not find name in parent
-        free(path);
-        free(dir_content);
-        return NULL;
-      }
+  int start = MAX_DIR_PATH - 1;
+  path[start] = '\0';
+
+  int curr_id = inode_id;
+  while (curr_id != ROOT_NODE) {
+    char name[DIR_NAME_SIZE];
+    int length;
+    // the path limit also stops at a cycle in a damaged image
+    if (parent_of(mount, curr_id, &curr_id, name) ||
+        (length = strlen(name)) + 1 > start) {
+      free(path);
+      return NULL;
     }
-    prev_inode_id = curr_inode.id;
-    curr_inode = get_inode(dir_content[0].inode);
-
-    free(dir_content);
+    start -= length;
+    memcpy(path + start, name, length);
+    path[--start] = '/';
   }
   // If path is empty, we are at root
-  if (path[0] == '\0') {
-    strlcpy(path, "/", MAX_DIR_PATH);
-  }
+  if (path[start] == '\0')
+    path[--start] = '/';
+  memmove(path, path + start, MAX_DIR_PATH - start);
   return path;
 }
 
+/**
+ * @brief Check whether a directory is the working directory of any live
+ * session of a mount.
+ *
+ * @param mount Mount to work on.
+ * @param node_id ID of the directory inode.
+ * @return true if some session works in the directory.
+ */
+bool dir_in_use(struct SystemState *mount, int node_id) {
+  bool in_use = false;
+  pthread_mutex_lock(&mount->sessions_lock);
+  for (struct session *session = mount->sessions; session && !in_use;
+       session = session->next)
+    in_use = session->curr_node_id == node_id;
+  pthread_mutex_unlock(&mount->sessions_lock);
+  return in_use;
+}
+
 /**
  * @brief Extract and return pointer to the final token/name from a path.
  *
@@ -341,12 +702,15 @@ char *get_final_token(char *path) {
  * @brief Get the dir id object returns id of directory which contains the path
  * target, also set the target_name to point into path to the target name
  *
+ * @param mount Mount to work on.
+ * @param session Session relative paths are resolved in.
  * @param path The full path to the target.
  * @param target_name Output pointer to the start of the target name within the
  * path string.
  * @return int The inode ID of the parent directory, or negative error code.
  */
-int get_dir_id(char *path, char **target_name) {
+int get_dir_id(struct SystemState *mount, struct session *session, char *path,
+               char **target_name) {
   size_t length = strlen(path);
   // invalid path if ends with '/'
   if (length > 1 && path[length] == '/') {
@@ -360,15 +724,20 @@ int get_dir_id(char *path, char **target_name) {
   strncpy(path_copy, path, length + 1);
 
   char *last_slash = strrchr(path_copy, '/');
-  if (last_slash) {
+  if (last_slash == path_copy) {
+    // "/name" lives in the root, not in the working directory
+    free(path_copy);
+    *target_name = path + 1;
+    return ROOT_NODE;
+  } else if (last_slash) {
     *last_slash = '\0';
     *target_name = last_slash - path_copy + path + 1;
   } else {
     free(path_copy);
     *target_name = path;
-    return g_system_state.curr_node_id;
+    return session->curr_node_id;
   }
-  int retval = path_to_inode(path_copy);
+  int retval = path_to_inode(mount, session, path_copy);
   free(path_copy);
   return retval;
 }
@@ -376,10 +745,16 @@ int get_dir_id(char *path, char **target_name) {
 /**
  * @brief Resolve a path string to an inode ID.
  *
+ * Each component is looked up in the dentry cache first, directories are
+ * searched only on a miss and the result, found or not, is cached.
+ *
+ * @param mount Mount to work on.
+ * @param session Session relative paths are resolved in.
  * @param path The path to resolve.
  * @return int The inode ID, or negative error code.
  */
-int path_to_inode(char *path) {
+int path_to_inode(struct SystemState *mount, struct session *session,
+                  char *path) {
   // invalid path if ends with '/'
   size_t length = strlen(path);
   if (length > 1 && path[length] == '/') {
@@ -390,105 +765,353 @@ int path_to_inode(char *path) {
   if (path[0] == '/')
     curr_node_id = ROOT_NODE;
   else
-    curr_node_id = g_system_state.curr_node_id;
+    curr_node_id = session->curr_node_id;
 
   char *path_copy = strdup(path);
 
   // process tokens by one of the path
-  for (char *token = strtok(path_copy, "/"); token != NULL;
-       token = strtok(NULL, "/")) {
+  char *save;
+  for (char *token = strtok_r(path_copy, "/", &save); token != NULL;
+       token = strtok_r(NULL, "/", &save)) {
     // if(!strcmp(token, ".")){ continue; }
-    struct inode inode = get_inode(curr_node_id);
+    struct inode inode = get_inode(mount, curr_node_id);
     if (inode.is_file) {
       free(path_copy);
       return -ERR_CANNOT_TRAVERSE;
     }
-    struct directory_item *node_data = get_directory_items(&inode);
-    int record_count = inode.file_size / sizeof(struct directory_item);
-    int node_found = 0;
-    for (int i = 0; i < record_count; i++) {
-      if (!strcmp(token, node_data[i].item_name)) {
-        curr_node_id = node_data[i].inode;
-        node_found = 1;
-        break;
-      }
+    int next_node_id;
+    if (!dcache_lookup(&mount->dcache, curr_node_id, token, &next_node_id)) {
+      int slot = find_item_in_dir(mount, &inode, token);
+      struct directory_item item;
+      next_node_id = -1;
+      if (slot >= 0 && !dir_read_item(mount, &inode, slot, &item))
+        next_node_id = item.inode;
+      dcache_insert(&mount->dcache, curr_node_id, token, next_node_id);
+      if (next_node_id >= 0 && strcmp(token, ".") && strcmp(token, "..") &&
+          !get_inode(mount, next_node_id).is_file)
+        dcache_set_parent(&mount->dcache, next_node_id, curr_node_id, token);
     }
-
-    free(node_data);
-
-    if (!node_found) {
+    if (next_node_id < 0) {
       free(path_copy);
       return -ERR_PATH_NOT_EXIST;
     }
+    curr_node_id = next_node_id;
   }
 
   free(path_copy);
   return curr_node_id;
 }
 
+/**
+ * @brief Check whether the image uses the extent (v2) inode layout.
+ *
+ * @param mount Mount to work on.
+ * @return bool True if inodes map their data with extents.
+ */
+static bool uses_extents(struct SystemState *mount) {
+  return mount->sb.features & SB_FEATURE_EXTENTS;
+}
+
+/**
+ * @brief Merge a list of cluster IDs into runs of consecutive clusters.
+ *
+ * @param clusters Array of cluster IDs in file order.
+ * @param cluster_count Number of clusters in the array.
+ * @param extent_count Output number of extents.
+ * @return struct extent* Array of extents (must be freed), or NULL if empty or
+ * on allocation failure.
+ */
+struct extent *clusters_to_extents(const int *clusters, int cluster_count,
+                                   int *extent_count) {
+  *extent_count = 0;
+  if (!clusters || cluster_count <= 0)
+    return NULL;
+  struct extent *extents = malloc(cluster_count * sizeof(struct extent));
+  if (!extents)
+    return NULL;
+
+  int count = 0;
+  for (int i = 0; i < cluster_count; i++) {
+    if (count && extents[count - 1].start + extents[count - 1].length ==
+                     clusters[i]) {
+      extents[count - 1].length++;
+      continue;
+    }
+    extents[count].start = clusters[i];
+    extents[count].length = 1;
+    count++;
+  }
+  *extent_count = count;
+  return extents;
+}
+
+/**
+ * @brief Store extents into an extent layout inode.
+ *
+ * The first INLINE_EXTENT_COUNT extents go into the inode, the rest into a
+ * chain of extent blocks which are allocated and written here. The inode
+ * itself is not written. The previous chain is not freed, the caller frees
+ * it once the new one is stored. On failure the inode is left unchanged.
+ *
+ * @param mount Mount to work on.
+ * @param inode Pointer to the inode.
+ * @param extents Extents in file order.
+ * @param extent_count Number of extents.
+ * @return int ERR_SUCCESS, or error code on failure.
+ */
+static int store_node_extents(struct SystemState *mount, struct inode *inode,
+                              const struct extent *extents, int extent_count) {
+  int block_count = 0;
+  int *block_ids = NULL;
+  if (extent_count > INLINE_EXTENT_COUNT) {
+    block_count = (extent_count - INLINE_EXTENT_COUNT + EXTENTS_PER_BLOCK - 1) /
+                  EXTENTS_PER_BLOCK;
+    block_ids = malloc(block_count * sizeof(int));
+    if (!block_ids)
+      return ERR_MEMORY_ALLOCATION;
+    // reserve the whole chain before the inode is touched
+    for (int b = 0; b < block_count; b++) {
+      block_ids[b] = assign_empty_cluster(mount);
+      if (block_ids[b] < 0) {
+        while (b-- > 0)
+          clear_bit(mount, block_ids[b], mount->sb.bitmap_start_address);
+        free(block_ids);
+        return ERR_CLUSTER_FULL;
+      }
+    }
+  }
+
+  memset(inode->extents, 0, sizeof(inode->extents));
+  inode->extent_block = block_count ? block_ids[0] : 0;
+
+  int i;
+  for (i = 0; i < extent_count && i < INLINE_EXTENT_COUNT; i++) {
+    inode->extents[i] = extents[i];
+  }
+
+  struct extent_block block;
+  for (int b = 0; b < block_count; b++) {
+    memset(&block, 0, sizeof(struct extent_block));
+    block.next = b + 1 < block_count ? block_ids[b + 1] : 0;
+    while (i < extent_count && block.count < EXTENTS_PER_BLOCK) {
+      block.extents[block.count++] = extents[i++];
+    }
+    cache_write(&mount->cache, block_ids[b], 0, &block,
+                sizeof(struct extent_block));
+  }
+
+  free(block_ids);
+  return ERR_SUCCESS;
+}
+
+/**
+ * @brief Read the extents of an extent layout inode, following the chain of
+ * extent blocks.
+ *
+ * @param mount Mount to work on.
+ * @param inode Pointer to the inode.
+ * @param extent_count Output number of extents.
+ * @return struct extent* Array of extents (must be freed), or NULL if empty.
+ */
+static struct extent *read_node_extents(struct SystemState *mount,
+                                        struct inode *inode,
+                                        int *extent_count) {
+  *extent_count = 0;
+  int cluster_count = (inode->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  if (!cluster_count)
+    return NULL;
+  // every extent covers at least one cluster
+  struct extent *extents = malloc(cluster_count * sizeof(struct extent));
+  if (!extents)
+    return NULL;
+
+  int count = 0, covered = 0;
+  for (int i = 0; i < INLINE_EXTENT_COUNT && covered < cluster_count; i++) {
+    extents[count++] = inode->extents[i];
+    covered += inode->extents[i].length;
+  }
+
+  struct extent_block block;
+  int block_id = inode->extent_block;
+  while (covered < cluster_count && block_id) {
+    cache_read(&mount->cache, block_id, 0, &block, sizeof(struct extent_block));
+    for (int i = 0; i < block.count && covered < cluster_count; i++) {
+      extents[count++] = block.extents[i];
+      covered += block.extents[i].length;
+    }
+    block_id = block.next;
+  }
+
+  *extent_count = count;
+  return extents;
+}
+
+/**
+ * @brief Reserve clusters as a few long runs of consecutive clusters.
+ *
+ * Each run is found with one bitmap search and marked with one range update.
+ * A single run is used whenever the free space allows it, the request is
+ * split into several runs only when fragmentation forces it.
+ *
+ * @param mount Mount to work on.
+ * @param cluster_count Number of clusters to reserve.
+ * @param run_count Output number of runs.
+ * @return struct extent* Array of reserved runs (must be freed), or NULL if
+ * there is not enough space (nothing stays reserved then).
+ */
+struct extent *allocate_clusters(struct SystemState *mount, int cluster_count,
+                                 int *run_count) {
+  struct bitmap *bm = &mount->cluster_bitmap;
+  *run_count = 0;
+  if (cluster_count <= 0 || cluster_count > mount->sb.free_cluster_count)
+    return NULL;
+
+  int capacity = 4;
+  struct extent *runs = malloc(capacity * sizeof(struct extent));
+  if (!runs)
+    return NULL;
+
+  int count = 0, remaining = cluster_count;
+  while (remaining > 0) {
+    int start;
+    int length = bitmap_find_run(bm, remaining, &start);
+    if (!length)
+      break;
+    if (count == capacity) {
+      capacity *= 2;
+      struct extent *grown = realloc(runs, capacity * sizeof(struct extent));
+      if (!grown)
+        break;
+      runs = grown;
+    }
+    bitmap_set_range(bm, start, length);
+    mount->sb.free_cluster_count -= length;
+    runs[count].start = start;
+    runs[count].length = length;
+    count++;
+    remaining -= length;
+  }
+
+  if (remaining > 0) {
+    for (int r = 0; r < count; r++) {
+      for (int c = 0; c < runs[r].length; c++)
+        clear_bit(mount, runs[r].start + c, mount->sb.bitmap_start_address);
+    }
+    free(runs);
+    return NULL;
+  }
+
+  mount->sb_dirty = true;
+  *run_count = count;
+  return runs;
+}
+
 /**
  * @brief "Allocate" clusters for an inode based on its size, handling direct
  * and indirect blocks. Sets the bits of relevant clusters to full in the
- * bitmap.
+ * bitmap. Data clusters are reserved as contiguous runs where possible.
+ * @param mount Mount to work on.
  * @param inode Pointer to the inode to assign clusters to.
  * @return int* Array of assigned cluster IDs (must be freed), or NULL on
  * failure.
  */
-int *assign_node_clusters(struct inode *inode) {
+int *assign_node_clusters(struct SystemState *mount, struct inode *inode) {
   int cluster_count = (inode->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
   if (!cluster_count) {
     return NULL;
   }
 
+  // Reserve the data clusters up front as contiguous runs
+  int run_count;
+  struct extent *runs = allocate_clusters(mount, cluster_count, &run_count);
+  if (!runs)
+    return NULL;
+
   int *carr = malloc(cluster_count * sizeof(int));
-  if (!carr)
+  if (!carr) {
+    free(runs);
     return NULL;
+  }
+  int n = 0;
+  for (int r = 0; r < run_count; r++) {
+    for (int c = 0; c < runs[r].length; c++) {
+      carr[n++] = runs[r].start + c;
+    }
+  }
+
+  free(runs);
+
+  if (map_node_clusters(mount, inode, carr, cluster_count) != ERR_SUCCESS) {
+    for (int i = 0; i < cluster_count; i++)
+      clear_bit(mount, carr[i], mount->sb.bitmap_start_address);
+    free(carr);
+    return NULL;
+  }
+  return carr;
+}
+
+/**
+ * @brief Point an inode at the given data clusters, allocating the extent
+ * blocks or indirect pages the mapping needs. The data clusters must already
+ * be reserved, they may be shared with other nodes.
+ * @param mount Mount to work on.
+ * @param inode Pointer to the inode, written here.
+ * @param clusters Data cluster IDs in file order.
+ * @param cluster_count Number of data clusters.
+ * @return int ERR_SUCCESS, or error code on failure.
+ */
+int map_node_clusters(struct SystemState *mount, struct inode *inode,
+                      const int *clusters, int cluster_count) {
+  if (uses_extents(mount)) {
+    int extent_count;
+    struct extent *extents =
+        clusters_to_extents(clusters, cluster_count, &extent_count);
+    if (!extents)
+      return ERR_MEMORY_ALLOCATION;
+    int result = store_node_extents(mount, inode, extents, extent_count);
+    free(extents);
+    if (result == ERR_SUCCESS)
+      write_inode(mount, inode);
+    return result;
+  }
 
   int i;
   // Assign direct clusters
   for (i = 0; i < cluster_count && i < DIRECT_CLUSTER_COUNT; i++) {
-    carr[i] = assign_empty_cluster();
-    inode->direct[i] = carr[i];
+    inode->direct[i] = clusters[i];
   }
 
   if (i >= cluster_count) {
-    write_inode(inode);
-    return carr;
+    write_inode(mount, inode);
+    return ERR_SUCCESS;
   }
 
   int max_1st_indirect = CLUSTER_SIZE / sizeof(int);
 
   // Need 1st level indirect
   int *indirect_arr = calloc(max_1st_indirect, sizeof(int));
-  if (!indirect_arr) {
-    free(carr);
-    return NULL;
-  }
+  if (!indirect_arr)
+    return ERR_MEMORY_ALLOCATION;
 
   // Assign indirect1 cluster if not already assigned
   if (!inode->indirect1) {
-    inode->indirect1 = assign_empty_cluster();
+    inode->indirect1 = assign_empty_cluster(mount);
   }
 
   // Assign clusters through 1st level indirect
   for (int direct_index = 0;
        i < cluster_count && direct_index < max_1st_indirect;
        direct_index++, i++) {
-    carr[i] = assign_empty_cluster();
-    indirect_arr[direct_index] = carr[i];
+    indirect_arr[direct_index] = clusters[i];
   }
 
   // Write 1st level indirect to disk
-  int offset =
-      g_system_state.sb.data_start_address + inode->indirect1 * CLUSTER_SIZE;
-  fseek(g_system_state.file_ptr, offset, SEEK_SET);
-  fwrite(indirect_arr, CLUSTER_SIZE, 1, g_system_state.file_ptr);
-  fflush(g_system_state.file_ptr);
+  cache_write(&mount->cache, inode->indirect1, 0, indirect_arr, CLUSTER_SIZE);
 
   if (i >= cluster_count) {
     free(indirect_arr);
-    write_inode(inode);
-    return carr;
+    write_inode(mount, inode);
+    return ERR_SUCCESS;
   }
 
   int max_2nd_indirect = max_1st_indirect * max_1st_indirect;
@@ -496,14 +1119,13 @@ int *assign_node_clusters(struct inode *inode) {
   // Need 2nd level indirect
   int *indirect_clusters = calloc(max_1st_indirect, sizeof(int));
   if (!indirect_clusters) {
-    free(carr);
     free(indirect_arr);
-    return NULL;
+    return ERR_MEMORY_ALLOCATION;
   }
 
   // Assign indirect2 cluster if not already assigned
   if (!inode->indirect2) {
-    inode->indirect2 = assign_empty_cluster();
+    inode->indirect2 = assign_empty_cluster(mount);
   }
 
   int max_total = DIRECT_CLUSTER_COUNT + max_1st_indirect + max_2nd_indirect;
@@ -513,7 +1135,7 @@ int *assign_node_clusters(struct inode *inode) {
        indirect_index++) {
     // Assign a cluster for this indirect page if needed
     if (!indirect_clusters[indirect_index]) {
-      indirect_clusters[indirect_index] = assign_empty_cluster();
+      indirect_clusters[indirect_index] = assign_empty_cluster(mount);
     }
 
     // Clear the indirect array for this page
@@ -523,39 +1145,33 @@ int *assign_node_clusters(struct inode *inode) {
     for (int direct_index = 0;
          direct_index < max_1st_indirect && i < cluster_count;
          direct_index++, i++) {
-      carr[i] = assign_empty_cluster();
-      indirect_arr[direct_index] = carr[i];
+      indirect_arr[direct_index] = clusters[i];
     }
 
     // Write this indirect page to disk
-    offset = g_system_state.sb.data_start_address +
-             indirect_clusters[indirect_index] * CLUSTER_SIZE;
-    fseek(g_system_state.file_ptr, offset, SEEK_SET);
-    fwrite(indirect_arr, CLUSTER_SIZE, 1, g_system_state.file_ptr);
-    fflush(g_system_state.file_ptr);
+    cache_write(&mount->cache, indirect_clusters[indirect_index], 0,
+                indirect_arr, CLUSTER_SIZE);
   }
 
   // Write 2nd level indirect clusters array to disk
-  offset =
-      g_system_state.sb.data_start_address + inode->indirect2 * CLUSTER_SIZE;
-  fseek(g_system_state.file_ptr, offset, SEEK_SET);
-  fwrite(indirect_clusters, CLUSTER_SIZE, 1, g_system_state.file_ptr);
-  fflush(g_system_state.file_ptr);
+  cache_write(&mount->cache, inode->indirect2, 0, indirect_clusters,
+              CLUSTER_SIZE);
 
   free(indirect_arr);
   free(indirect_clusters);
-  write_inode(inode);
+  write_inode(mount, inode);
 
-  return carr;
+  return ERR_SUCCESS;
 }
 
 /**
  * @brief Retrieve the array of cluster IDs used by an inode.
  *
+ * @param mount Mount to work on.
  * @param inode Pointer to the inode.
  * @return int* Array of cluster IDs (must be freed), or NULL if empty/error.
  */
-int *get_node_clusters(struct inode *inode) {
+int *get_node_clusters(struct SystemState *mount, struct inode *inode) {
   int cluster_count = (inode->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
   if (!cluster_count) {
     return NULL;
@@ -563,6 +1179,24 @@ int *get_node_clusters(struct inode *inode) {
   int *carr = malloc(cluster_count * sizeof(int));
   if (!carr)
     return NULL;
+
+  if (uses_extents(mount)) {
+    int extent_count;
+    struct extent *extents = read_node_extents(mount, inode, &extent_count);
+    if (!extents) {
+      free(carr);
+      return NULL;
+    }
+    int n = 0;
+    for (int e = 0; e < extent_count; e++) {
+      for (int c = 0; c < extents[e].length && n < cluster_count; c++) {
+        carr[n++] = extents[e].start + c;
+      }
+    }
+    free(extents);
+    return carr;
+  }
+
   int i;
   for (i = 0; i < cluster_count && i < DIRECT_CLUSTER_COUNT; i++) {
     carr[i] = inode->direct[i];
@@ -581,10 +1215,7 @@ int *get_node_clusters(struct inode *inode) {
     return NULL;
   }
 
-  int offset =
-      g_system_state.sb.data_start_address + inode->indirect1 * CLUSTER_SIZE;
-  fseek(g_system_state.file_ptr, offset, SEEK_SET);
-  fread(indirect_arr, CLUSTER_SIZE, 1, g_system_state.file_ptr);
+  cache_read(&mount->cache, inode->indirect1, 0, indirect_arr, CLUSTER_SIZE);
 
   // iterate through the clusters
   for (int direct_index = 0;
@@ -607,10 +1238,8 @@ int *get_node_clusters(struct inode *inode) {
     return NULL;
   }
 
-  offset =
-      g_system_state.sb.data_start_address + inode->indirect2 * CLUSTER_SIZE;
-  fseek(g_system_state.file_ptr, offset, SEEK_SET);
-  fread(indirect_clusters, CLUSTER_SIZE, 1, g_system_state.file_ptr);
+  cache_read(&mount->cache, inode->indirect2, 0, indirect_clusters,
+             CLUSTER_SIZE);
 
   int max_total = DIRECT_CLUSTER_COUNT + max_1st_indirect + max_2nd_indirect;
 
@@ -618,10 +1247,8 @@ int *get_node_clusters(struct inode *inode) {
   for (int indirect_index = 0;
        i < cluster_count && i < cluster_count && i < max_total;
        indirect_index++) {
-    offset = g_system_state.sb.data_start_address +
-             indirect_clusters[indirect_index] * CLUSTER_SIZE;
-    fseek(g_system_state.file_ptr, offset, SEEK_SET);
-    fread(indirect_arr, CLUSTER_SIZE, 1, g_system_state.file_ptr);
+    cache_read(&mount->cache, indirect_clusters[indirect_index], 0,
+               indirect_arr, CLUSTER_SIZE);
 
     // iterate through the clusters
     for (int direct_index = 0;
@@ -636,147 +1263,596 @@ int *get_node_clusters(struct inode *inode) {
   return carr;
 }
 
+/**
+ * @brief Retrieve the data of an inode as runs of consecutive clusters.
+ *
+ * Works for both inode layouts, for direct/indirect inodes the cluster list is
+ * merged into runs.
+ *
+ * @param mount Mount to work on.
+ * @param inode Pointer to the inode.
+ * @param extent_count Output number of extents.
+ * @return struct extent* Array of extents (must be freed), or NULL if
+ * empty/error.
+ */
+struct extent *get_node_extents(struct SystemState *mount, struct inode *inode,
+                                int *extent_count) {
+  if (uses_extents(mount))
+    return read_node_extents(mount, inode, extent_count);
+
+  int cluster_count = (inode->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  int *clusters = get_node_clusters(mount, inode);
+  struct extent *extents =
+      clusters_to_extents(clusters, cluster_count, extent_count);
+  free(clusters);
+  return extents;
+}
+
+/**
+ * @brief Free the chain of overflow extent blocks of an extent layout inode.
+ *
+ * @param mount Mount to work on.
+ * @param inode Pointer to the inode, its extent_block is reset.
+ */
+static void free_extent_blocks(struct SystemState *mount, struct inode *inode) {
+  struct extent_block block;
+  int block_id = inode->extent_block;
+  while (block_id) {
+    cache_read(&mount->cache, block_id, 0, &block, sizeof(struct extent_block));
+    clear_bit(mount, block_id, mount->sb.bitmap_start_address);
+    block_id = block.next;
+  }
+  inode->extent_block = 0;
+}
+
+/**
+ * @brief Find the cluster holding one cluster of the data of an inode.
+ *
+ * Unlike get_node_clusters only the mapping blocks on the way to that
+ * cluster are read.
+ *
+ * @param mount Mount to work on.
+ * @param inode Pointer to the inode.
+ * @param index Index of the cluster within the data of the inode.
+ * @return int Cluster ID, or -1 if the inode has no such cluster.
+ */
+int node_cluster_at(struct SystemState *mount, struct inode *inode, int index) {
+  int cluster_count = (inode->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  if (index < 0 || index >= cluster_count)
+    return -1;
+
+  if (uses_extents(mount)) {
+    for (int i = 0; i < INLINE_EXTENT_COUNT; i++) {
+      if (index < inode->extents[i].length)
+        return inode->extents[i].start + index;
+      index -= inode->extents[i].length;
+    }
+    struct extent_block block;
+    int block_id = inode->extent_block;
+    while (block_id) {
+      cache_read(&mount->cache, block_id, 0, &block,
+                 sizeof(struct extent_block));
+      for (int i = 0; i < block.count; i++) {
+        if (index < block.extents[i].length)
+          return block.extents[i].start + index;
+        index -= block.extents[i].length;
+      }
+      block_id = block.next;
+    }
+    return -1;
+  }
+
+  if (index < DIRECT_CLUSTER_COUNT)
+    return inode->direct[index];
+  index -= DIRECT_CLUSTER_COUNT;
+
+  int per_page = CLUSTER_SIZE / sizeof(int);
+  int cluster;
+  if (index < per_page) {
+    cache_read(&mount->cache, inode->indirect1, index * sizeof(int), &cluster,
+               sizeof(int));
+    return cluster;
+  }
+  index -= per_page;
+
+  int page;
+  cache_read(&mount->cache, inode->indirect2, index / per_page * sizeof(int),
+             &page, sizeof(int));
+  cache_read(&mount->cache, page, index % per_page * sizeof(int), &cluster,
+             sizeof(int));
+  return cluster;
+}
+
+/**
+ * @brief Find the run of consecutive clusters holding a logical cluster.
+ *
+ * With extents the run is the rest of the extent, the direct/indirect layout
+ * is checked pointer by pointer.
+ *
+ * @param mount Mount to work on.
+ * @param inode Pointer to the inode.
+ * @param index Logical cluster number within the node.
+ * @param max_length Longest run the caller wants.
+ * @param length Output number of clusters in the run, at most max_length.
+ * @return int Physical cluster of index, or -1 if the node is shorter.
+ */
+int node_run_at(struct SystemState *mount, struct inode *inode, int index,
+                int max_length, int *length) {
+  int cluster_count = (inode->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  if (index < 0 || index >= cluster_count)
+    return -1;
+  if (max_length > cluster_count - index)
+    max_length = cluster_count - index;
+
+  if (uses_extents(mount)) {
+    int start = -1, run = 0, skip = index;
+    for (int i = 0; i < INLINE_EXTENT_COUNT && start < 0; i++) {
+      if (skip < inode->extents[i].length) {
+        start = inode->extents[i].start + skip;
+        run = inode->extents[i].length - skip;
+      }
+      skip -= inode->extents[i].length;
+    }
+    struct extent_block block;
+    int block_id = start < 0 ? inode->extent_block : 0;
+    while (block_id && start < 0) {
+      cache_read(&mount->cache, block_id, 0, &block,
+                 sizeof(struct extent_block));
+      for (int i = 0; i < block.count && start < 0; i++) {
+        if (skip < block.extents[i].length) {
+          start = block.extents[i].start + skip;
+          run = block.extents[i].length - skip;
+        }
+        skip -= block.extents[i].length;
+      }
+      block_id = block.next;
+    }
+    *length = run < max_length ? run : max_length;
+    return start;
+  }
+
+  int start = node_cluster_at(mount, inode, index);
+  *length = 1;
+  while (*length < max_length &&
+         node_cluster_at(mount, inode, index + *length) == start + *length)
+    (*length)++;
+  return start;
+}
+
+/**
+ * @brief Point one logical cluster of an inode at another physical cluster.
+ *
+ * Used to give a node its own copy of a shared cluster. In the extent layout
+ * the extent holding the cluster is split around it. The caller frees or
+ * unshares the old cluster and writes the inode.
+ *
+ * @param mount Mount to work on.
+ * @param inode Pointer to the inode.
+ * @param index Logical cluster number within the node.
+ * @param cluster New physical cluster.
+ * @return int ERR_SUCCESS, or error code on failure.
+ */
+int node_set_cluster(struct SystemState *mount, struct inode *inode, int index,
+                     int cluster) {
+  int cluster_count = (inode->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  if (index < 0 || index >= cluster_count)
+    return ERR_UNKNOWN;
+
+  if (uses_extents(mount)) {
+    int extent_count;
+    struct extent *extents = read_node_extents(mount, inode, &extent_count);
+    struct extent *grown =
+        extents ? realloc(extents, (extent_count + 2) * sizeof(struct extent))
+                : NULL;
+    if (!grown) {
+      free(extents);
+      return ERR_MEMORY_ALLOCATION;
+    }
+    extents = grown;
+
+    int i = 0;
+    while (index >= extents[i].length)
+      index -= extents[i++].length;
+    struct extent old = extents[i];
+    struct extent parts[3];
+    int part_count = 0;
+    if (index > 0)
+      parts[part_count++] = (struct extent){old.start, index};
+    parts[part_count++] = (struct extent){cluster, 1};
+    if (index + 1 < old.length)
+      parts[part_count++] =
+          (struct extent){old.start + index + 1, old.length - index - 1};
+    memmove(&extents[i + part_count], &extents[i + 1],
+            (extent_count - i - 1) * sizeof(struct extent));
+    memcpy(&extents[i], parts, part_count * sizeof(struct extent));
+    extent_count += part_count - 1;
+
+    // the old chain of extent blocks is freed only once the new one is stored
+    struct inode previous = *inode;
+    int result = store_node_extents(mount, inode, extents, extent_count);
+    free(extents);
+    if (result == ERR_SUCCESS)
+      free_extent_blocks(mount, &previous);
+    return result;
+  }
+
+  if (index < DIRECT_CLUSTER_COUNT) {
+    inode->direct[index] = cluster;
+    return ERR_SUCCESS;
+  }
+  index -= DIRECT_CLUSTER_COUNT;
+
+  int per_page = CLUSTER_SIZE / sizeof(int);
+  int page = inode->indirect1;
+  if (index >= per_page) {
+    index -= per_page;
+    if (cache_read(&mount->cache, inode->indirect2,
+                   index / per_page * sizeof(int), &page, sizeof(int)))
+      return ERR_UNKNOWN;
+  }
+  return cache_write(&mount->cache, page, index % per_page * sizeof(int),
+                     &cluster, sizeof(int))
+             ? ERR_UNKNOWN
+             : ERR_SUCCESS;
+}
+
+/**
+ * @brief Allocate a zeroed cluster for a page of cluster pointers.
+ *
+ * @param mount Mount to work on.
+ * @return int Cluster ID, or -1 if the disk is full.
+ */
+static int assign_pointer_page(struct SystemState *mount) {
+  int page = assign_empty_cluster(mount);
+  if (page < 0)
+    return -1;
+  int zeros[CLUSTER_SIZE / sizeof(int)] = {0};
+  cache_write(&mount->cache, page, 0, zeros, CLUSTER_SIZE);
+  return page;
+}
+
+/**
+ * @brief Add one cluster to the end of the data of an inode.
+ *
+ * Used to grow directories. The caller increases file_size afterwards and
+ * writes the inode. In the extent layout the cluster following the last run
+ * is taken when it is free, so the run just gets longer.
+ *
+ * @param mount Mount to work on.
+ * @param inode Pointer to the inode.
+ * @return int The new cluster, or -1 if the disk is full.
+ */
+int node_append_cluster(struct SystemState *mount, struct inode *inode) {
+  int index = (inode->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+
+  if (uses_extents(mount)) {
+    int extent_count;
+    struct extent *extents = read_node_extents(mount, inode, &extent_count);
+    struct extent *grown =
+        realloc(extents, (extent_count + 1) * sizeof(struct extent));
+    if (!grown) {
+      free(extents);
+      return -1;
+    }
+    extents = grown;
+
+    struct extent *last = extent_count ? &extents[extent_count - 1] : NULL;
+    int cluster;
+    if (last && last->start + last->length < mount->sb.cluster_count &&
+        !read_bit(mount, last->start + last->length,
+                  mount->sb.bitmap_start_address)) {
+      cluster = last->start + last->length;
+      set_bit(mount, cluster, mount->sb.bitmap_start_address);
+      last->length++;
+    } else {
+      cluster = assign_empty_cluster(mount);
+      if (cluster < 0) {
+        free(extents);
+        return -1;
+      }
+      extents[extent_count].start = cluster;
+      extents[extent_count].length = 1;
+      extent_count++;
+    }
+
+    // the overflow blocks are rewritten from scratch, the old ones are freed
+    // only once the new ones are stored
+    struct inode previous = *inode;
+    int result = store_node_extents(mount, inode, extents, extent_count);
+    free(extents);
+    if (result != ERR_SUCCESS) {
+      clear_bit(mount, cluster, mount->sb.bitmap_start_address);
+      return -1;
+    }
+    free_extent_blocks(mount, &previous);
+    return cluster;
+  }
+
+  int cluster = assign_empty_cluster(mount);
+  if (cluster < 0)
+    return -1;
+  if (index < DIRECT_CLUSTER_COUNT) {
+    inode->direct[index] = cluster;
+    return cluster;
+  }
+  index -= DIRECT_CLUSTER_COUNT;
+
+  int per_page = CLUSTER_SIZE / sizeof(int);
+  if (index < per_page) {
+    if (!index && (inode->indirect1 = assign_pointer_page(mount)) < 0) {
+      inode->indirect1 = 0;
+      clear_bit(mount, cluster, mount->sb.bitmap_start_address);
+      return -1;
+    }
+    cache_write(&mount->cache, inode->indirect1, index * sizeof(int), &cluster,
+                sizeof(int));
+    return cluster;
+  }
+  index -= per_page;
+
+  if (!index && (inode->indirect2 = assign_pointer_page(mount)) < 0) {
+    inode->indirect2 = 0;
+    clear_bit(mount, cluster, mount->sb.bitmap_start_address);
+    return -1;
+  }
+  int page;
+  if (index % per_page == 0) {
+    page = assign_pointer_page(mount);
+    if (page < 0) {
+      clear_bit(mount, cluster, mount->sb.bitmap_start_address);
+      return -1;
+    }
+    cache_write(&mount->cache, inode->indirect2, index / per_page * sizeof(int),
+                &page, sizeof(int));
+  } else {
+    cache_read(&mount->cache, inode->indirect2, index / per_page * sizeof(int),
+               &page, sizeof(int));
+  }
+  cache_write(&mount->cache, page, index % per_page * sizeof(int), &cluster,
+              sizeof(int));
+  return cluster;
+}
+
+/**
+ * @brief Free the last cluster of the data of an inode.
+ *
+ * Used to shrink directories, mapping pages which become empty are freed as
+ * well. The caller decreases file_size afterwards and writes the inode.
+ *
+ * @param mount Mount to work on.
+ * @param inode Pointer to the inode.
+ */
+void node_drop_last_cluster(struct SystemState *mount, struct inode *inode) {
+  int index = (inode->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE - 1;
+  int cluster = node_cluster_at(mount, inode, index);
+  if (cluster < 0)
+    return;
+  clear_bit(mount, cluster, mount->sb.bitmap_start_address);
+
+  if (uses_extents(mount)) {
+    int extent_count;
+    struct extent *extents = read_node_extents(mount, inode, &extent_count);
+    if (!extents)
+      return;
+    if (!--extents[extent_count - 1].length)
+      extent_count--;
+    struct inode previous = *inode;
+    if (store_node_extents(mount, inode, extents, extent_count) ==
+        ERR_SUCCESS)
+      free_extent_blocks(mount, &previous);
+    free(extents);
+    return;
+  }
+
+  if (index < DIRECT_CLUSTER_COUNT) {
+    inode->direct[index] = 0;
+    return;
+  }
+  index -= DIRECT_CLUSTER_COUNT;
+
+  int per_page = CLUSTER_SIZE / sizeof(int);
+  int zero = 0;
+  if (index < per_page) {
+    if (!index) {
+      clear_bit(mount, inode->indirect1, mount->sb.bitmap_start_address);
+      inode->indirect1 = 0;
+    } else {
+      cache_write(&mount->cache, inode->indirect1, index * sizeof(int), &zero,
+                  sizeof(int));
+    }
+    return;
+  }
+  index -= per_page;
+
+  int page;
+  cache_read(&mount->cache, inode->indirect2, index / per_page * sizeof(int),
+             &page, sizeof(int));
+  if (index % per_page == 0) {
+    clear_bit(mount, page, mount->sb.bitmap_start_address);
+    cache_write(&mount->cache, inode->indirect2, index / per_page * sizeof(int),
+                &zero, sizeof(int));
+  } else {
+    cache_write(&mount->cache, page, index % per_page * sizeof(int), &zero,
+                sizeof(int));
+  }
+  if (!index) {
+    clear_bit(mount, inode->indirect2, mount->sb.bitmap_start_address);
+    inode->indirect2 = 0;
+  }
+}
+
 /**
  * @brief Read all data associated with an inode into a buffer.
  *
+ * @param mount Mount to work on.
  * @param inode Pointer to the inode.
  * @return uint8_t* Buffer containing the data (must be freed), or NULL if
- * empty.
+ * empty or the data cannot be read.
  */
-uint8_t *get_node_data(struct inode *inode) {
+uint8_t *get_node_data(struct SystemState *mount, struct inode *inode) {
   if (!inode->file_size)
     return NULL;
-  int *cluster_arr = get_node_clusters(inode);
-  int cluster_count = (inode->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  int extent_count;
+  struct extent *extents = get_node_extents(mount, inode, &extent_count);
   uint8_t *data = malloc(inode->file_size);
+  if (!extents || !data) {
+    free(extents);
+    free(data);
+    return NULL;
+  }
 
-  for (int i = 0; i < cluster_count; i++) {
-    int bytes_to_read = CLUSTER_SIZE;
-    if ((i + 1) * CLUSTER_SIZE > inode->file_size) {
-      bytes_to_read = inode->file_size - i * CLUSTER_SIZE;
+  // read whole runs of clusters, all submitted at once
+  struct cache_batch batch;
+  cache_batch_init(&batch);
+  int position = 0;
+  for (int e = 0; e < extent_count && position < inode->file_size; e++) {
+    int bytes_to_read = extents[e].length * CLUSTER_SIZE;
+    if (position + bytes_to_read > inode->file_size) {
+      bytes_to_read = inode->file_size - position;
     }
-    fseek(g_system_state.file_ptr,
-          cluster_arr[i] * CLUSTER_SIZE + g_system_state.sb.data_start_address,
-          SEEK_SET);
-    fread(data + CLUSTER_SIZE * i, bytes_to_read, 1, g_system_state.file_ptr);
+    if (inode->is_file) {
+      cache_queue_read(&mount->cache, &batch, extents[e].start, data + position,
+                       bytes_to_read);
+    } else {
+      // directories are hot metadata, keep their clusters in the cache
+      for (int c = 0; c * CLUSTER_SIZE < bytes_to_read; c++) {
+        int length = bytes_to_read - c * CLUSTER_SIZE;
+        cache_read(&mount->cache, extents[e].start + c, 0,
+                   data + position + c * CLUSTER_SIZE,
+                   length < CLUSTER_SIZE ? length : CLUSTER_SIZE);
+      }
+    }
+    position += bytes_to_read;
+  }
+  free(extents);
+  if (cache_submit(&mount->cache, &batch)) {
+    free(data);
+    return NULL;
   }
-  free(cluster_arr);
   return data;
 };
 
 /**
  * @brief Helper to get directory items from a directory inode.
  *
+ * @param mount Mount to work on.
  * @param dir_inode Pointer to the directory inode.
  * @return struct directory_item* Array of directory items (must be freed).
  */
-struct directory_item *get_directory_items(struct inode *dir_inode) {
-  return (struct directory_item *)get_node_data(dir_inode);
+struct directory_item *get_directory_items(struct SystemState *mount,
+                                           struct inode *dir_inode) {
+  return (struct directory_item *)get_node_data(mount, dir_inode);
 }
 
 /**
- * @brief Free an inode and all its associated clusters/blocks.
- * Clears all bits of inode clusters and the inode itself
- * @param inode Pointer to the inode to clear.
+ * @brief Free all clusters of an inode, data and mapping blocks alike.
+ *
+ * The inode itself stays allocated. Data clusters shared with other nodes
+ * only lose a reference.
+ *
+ * @param mount Mount to work on.
+ * @param inode Pointer to the inode.
  */
-void clear_inode(struct inode *inode) {
-  // set the inode as free in bitmap
-  clear_bit(inode->id, g_system_state.sb.bitmapi_start_address);
-
-  // free the inode clusters
-  int *clusters = get_node_clusters(inode);
+void release_node_clusters(struct SystemState *mount, struct inode *inode) {
+  int *clusters = get_node_clusters(mount, inode);
   if (clusters != NULL) {
     int cluster_count = (inode->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
     for (int j = 0; j < cluster_count; j++) {
-      clear_bit(clusters[j], g_system_state.sb.bitmap_start_address);
+      if (!refcount_unshare(&mount->refcounts, clusters[j]))
+        clear_bit(mount, clusters[j], mount->sb.bitmap_start_address);
     }
   }
   free(clusters);
 
+  if (uses_extents(mount)) {
+    // free the chain of overflow extent blocks
+    free_extent_blocks(mount, inode);
+    return;
+  }
+
   if (inode->indirect1) {
-    clear_bit(inode->indirect1, g_system_state.sb.bitmap_start_address);
+    clear_bit(mount, inode->indirect1, mount->sb.bitmap_start_address);
   }
 
   if (inode->indirect2) {
     int *cluster_ids = malloc(CLUSTER_SIZE);
-    int offset =
-        g_system_state.sb.data_start_address + inode->indirect2 * CLUSTER_SIZE;
-    fseek(g_system_state.file_ptr, offset, SEEK_SET);
-    fread(cluster_ids, CLUSTER_SIZE, 1, g_system_state.file_ptr);
+    cache_read(&mount->cache, inode->indirect2, 0, cluster_ids, CLUSTER_SIZE);
     for (int i = 0; i < CLUSTER_SIZE / sizeof(int); i++) {
-      if (cluster_ids[i] && cluster_ids[i] < g_system_state.sb.cluster_count) {
-        clear_bit(cluster_ids[i], g_system_state.sb.bitmap_start_address);
+      if (cluster_ids[i] && cluster_ids[i] < mount->sb.cluster_count) {
+        clear_bit(mount, cluster_ids[i], mount->sb.bitmap_start_address);
       }
     }
-    clear_bit(inode->indirect2, g_system_state.sb.bitmap_start_address);
+    clear_bit(mount, inode->indirect2, mount->sb.bitmap_start_address);
     free(cluster_ids);
   }
 }
 
+/**
+ * @brief Free an inode and all its associated clusters/blocks.
+ * Clears all bits of inode clusters and the inode itself
+ * @param mount Mount to work on.
+ * @param inode Pointer to the inode to clear.
+ */
+void clear_inode(struct SystemState *mount, struct inode *inode) {
+  // set the inode as free in bitmap
+  clear_bit(mount, inode->id, mount->sb.bitmapi_start_address);
+  if (inode->is_file)
+    mount->sb.file_count--;
+  else
+    mount->sb.dir_count--;
+
+  // free the inode clusters
+  release_node_clusters(mount, inode);
+
+  // the inode ID may be reused by another directory
+  if (!inode->is_file)
+    dcache_forget_dir(&mount->dcache, inode->id);
+}
+
 /**
  * @brief Remove a file or directory entry from a parent directory inode.
  * If there are no more references to the item, it is cleared
  *
+ * @param mount Mount to work on.
  * @param inode Pointer to the parent directory inode.
  * @param item_name Name of the item to remove.
  * @return int Error code (ERR_SUCCESS on success).
  */
-int delete_item(struct inode *inode, char *item_name) {
+int delete_item(struct SystemState *mount, struct inode *inode,
+                char *item_name) {
   if (inode->is_file) {
     return ERR_NOT_A_DIRECTORY;
   }
-  struct directory_item *dir_content = get_directory_items(inode);
-  int record_count = inode->file_size / sizeof(struct directory_item);
-  int item_found = 0;
-  // loop through directory items to find the one to delete
-  for (int i = 0; i < record_count; i++) {
-    if (!strcmp(dir_content[i].item_name, item_name)) {
-      item_found = 1;
-      struct inode inode_to_delete = get_inode(dir_content[i].inode);
-
-      // do not delete dir if not empty
-      if (inode_to_delete.file_size != 32 && !inode_to_delete.is_file &&
-          inode_to_delete.references == 1) {
-        free(dir_content);
-        return ERR_DIR_NOT_EMPTY;
-      }
-
-      // remove item from directory by moving last item to this position
-      struct directory_item last_item;
-      int last_offset = g_system_state.sb.data_start_address +
-                        inode->direct[0] * CLUSTER_SIZE +
-                        (record_count - 1) * sizeof(struct directory_item);
-      fseek(g_system_state.file_ptr, last_offset, SEEK_SET);
-      fread(&last_item, sizeof(struct directory_item), 1,
-            g_system_state.file_ptr);
-
-      // Write last item to deleted position
-      int deleted_offset = g_system_state.sb.data_start_address +
-                           inode->direct[0] * CLUSTER_SIZE +
-                           i * sizeof(struct directory_item);
-      fseek(g_system_state.file_ptr, deleted_offset, SEEK_SET);
-      fwrite(&last_item, sizeof(struct directory_item), 1,
-             g_system_state.file_ptr);
-
-      inode_to_delete.references -= 1;
-      if (inode_to_delete.references <= 0) {
-        clear_inode(&inode_to_delete);
-      } else {
-        write_inode(&inode_to_delete);
-      }
-
-      break;
-    }
+  int slot = find_item_in_dir(mount, inode, item_name);
+  struct directory_item item;
+  if (slot < 0 || dir_read_item(mount, inode, slot, &item)) {
+    return ERR_FILE_NOT_FOUND;
   }
-  free(dir_content);
+  struct inode inode_to_delete = get_inode(mount, item.inode);
 
-  if (!item_found) {
-    return ERR_FILE_NOT_FOUND;
+  // do not delete dir if not empty
+  if (inode_to_delete.file_size != 32 && !inode_to_delete.is_file &&
+      inode_to_delete.references == 1) {
+    return ERR_DIR_NOT_EMPTY;
+  }
+  // nor one a session still works in
+  if (!inode_to_delete.is_file && inode_to_delete.references == 1 &&
+      dir_in_use(mount, inode_to_delete.id)) {
+    return ERR_DIR_IN_USE;
   }
 
-  // Decrease directory size
-  inode->file_size -= sizeof(struct directory_item);
-  write_inode(inode);
+  // remove item from directory by moving last item to this position
+  int result = dir_remove_item(mount, inode, slot);
+  if (result != ERR_SUCCESS)
+    return result;
+  dcache_invalidate(&mount->dcache, inode->id, item_name);
+
+  inode_to_delete.references -= 1;
+  if (inode_to_delete.references <= 0) {
+    clear_inode(mount, &inode_to_delete);
+  } else {
+    write_inode(mount, &inode_to_delete);
+  }
 
   return ERR_SUCCESS;
 }
@@ -784,24 +1860,26 @@ int delete_item(struct inode *inode, char *item_name) {
 /**
  * @brief Add a new entry to a directory inode.
  *
+ * @param mount Mount to work on.
  * @param record The directory item structure to add.
  * @param dir_inode Pointer to the target directory inode.
- * @return int EXIT_SUCCESS on success.
+ * @return int EXIT_SUCCESS on success, ERR_CLUSTER_FULL if the directory
+ * cannot grow.
  */
-int add_record_to_dir(struct directory_item record, struct inode *dir_inode) {
-  struct inode added_inode = get_inode(record.inode);
-  added_inode.references += 1;
-  write_inode(&added_inode);
-
+int add_record_to_dir(struct SystemState *mount, struct directory_item record,
+                      struct inode *dir_inode) {
   // Always append to the end since its compacted on deletion
-  int final_offset = g_system_state.sb.data_start_address +
-                     dir_inode->direct[0] * CLUSTER_SIZE + dir_inode->file_size;
-
-  fseek(g_system_state.file_ptr, final_offset, SEEK_SET);
-  fwrite(&record, sizeof(struct directory_item), 1, g_system_state.file_ptr);
+  int result = dir_add_item(mount, dir_inode, &record);
+  if (result != ERR_SUCCESS)
+    return result;
+  dcache_invalidate(&mount->dcache, dir_inode->id, record.item_name);
 
-  dir_inode->file_size += sizeof(struct directory_item);
-  write_inode(dir_inode);
+  struct inode added_inode = get_inode(mount, record.inode);
+  added_inode.references += 1;
+  write_inode(mount, &added_inode);
+  if (!added_inode.is_file)
+    dcache_set_parent(&mount->dcache, record.inode, dir_inode->id,
+                      record.item_name);
 
   return EXIT_SUCCESS;
 }
@@ -809,11 +1887,14 @@ int add_record_to_dir(struct directory_item record, struct inode *dir_inode) {
 /**
  * @brief Initialize a directory with '.' and '..' entries.
  *
+ * @param mount Mount to work on.
  * @param dir_inode Pointer to the directory inode to initialize.
  * @param parent_inode_id Inode ID of the parent directory.
  */
-void init_directory(struct inode *dir_inode, int parent_inode_id) {
-  struct directory_item entries[2] = {0};
+void init_directory(struct SystemState *mount, struct inode *dir_inode,
+                    int parent_inode_id) {
+  struct directory_item entries[CLUSTER_SIZE / sizeof(struct directory_item)] =
+      {0};
 
   // Parent reference (..)
   entries[0].inode = parent_inode_id;
@@ -823,69 +1904,121 @@ void init_directory(struct inode *dir_inode, int parent_inode_id) {
   entries[1].inode = dir_inode->id;
   strlcpy(entries[1].item_name, ".", sizeof(entries[1].item_name));
 
-  // Write both entries directly to the first cluster
-  int offset = g_system_state.sb.data_start_address +
-               dir_inode->direct[0] * CLUSTER_SIZE;
-  fseek(g_system_state.file_ptr, offset, SEEK_SET);
-  fwrite(entries, sizeof(struct directory_item), 2, g_system_state.file_ptr);
-  fflush(g_system_state.file_ptr);
+  // Write both entries as the whole first cluster, so it is not read first
+  cache_write(&mount->cache, dir_inode->direct[0], 0, entries, CLUSTER_SIZE);
 
   // Update directory size
   dir_inode->file_size = 2 * sizeof(struct directory_item);
-  write_inode(dir_inode);
+  write_inode(mount, dir_inode);
 }
 
 /**
  * @brief Creates a new directory inode.
  *
+ * @param mount Mount to work on.
  * @param up_ref_id Inode ID of the parent directory.
  * @return int The ID of the newly created directory inode.
  */
-int create_dir_node(int up_ref_id) {
+int create_dir_node(struct SystemState *mount, int up_ref_id) {
   struct inode inode;
   memset(&inode, 0, sizeof(struct inode));
   inode.is_file = false;
-  inode.id = assign_empty_inode();
-  inode.direct[0] = assign_empty_cluster();
-  write_inode(&inode);
+  inode.id = assign_empty_inode(mount);
+  if (uses_extents(mount)) {
+    inode.extents[0].start = assign_empty_cluster(mount);
+    inode.extents[0].length = 1;
+  } else {
+    inode.direct[0] = assign_empty_cluster(mount);
+  }
+  write_inode(mount, &inode);
+  mount->sb.dir_count++;
 
   // Initialize directory with . and .. entries
-  init_directory(&inode, up_ref_id);
+  init_directory(mount, &inode, up_ref_id);
 
   return inode.id;
 }
 
+/**
+ * @brief Creates a new file inode without any clusters assigned.
+ *
+ * @param mount Mount to work on.
+ * @param file_size Size of the file in bytes.
+ * @return int The ID of the new inode, or -1 if there is no free inode.
+ */
+int create_file_node(struct SystemState *mount, int file_size) {
+  int node_id = assign_empty_inode(mount);
+  if (node_id == -1)
+    return -1;
+
+  struct inode inode = {0};
+  inode.id = node_id;
+  inode.is_file = 1;
+  inode.file_size = file_size;
+  write_inode(mount, &inode);
+  mount->sb.file_count++;
+
+  return node_id;
+}
+
 /**
  * @brief Format the virtual disk with the filesystem structure.
  *
+ * @param mount Mount to work on.
+ * @param session Session the output goes to, moved to the root directory.
  * @param size Size of the disk in bytes.
+ * @param features Optional SB_FEATURE_* flags to enable, such as extents.
  * @return int Error code (ERR_SUCCESS on success).
  */
-int format(int size) {
+int format(struct SystemState *mount, struct session *session, int size,
+           int features) {
 
   struct superblock sb = get_superblock(size);
+  sb.features |= features;
   uint8_t *memptr = calloc(1, sizeof(char) * size);
   memcpy(memptr, &sb, sizeof(struct superblock));
-  g_system_state.sb = sb;
+  mount->sb = sb;
+  mount->sb_dirty = false;
 
-  fseek(g_system_state.file_ptr, 0, SEEK_SET);
   int bytes_written =
-      fwrite(memptr, sizeof(uint8_t), size, g_system_state.file_ptr);
-  printf("bytes written = %d\n", bytes_written);
+      storage_write(mount->storage, memptr, size, 0) ? 0 : size;
+  fprintf(session->out, "bytes written = %d\n", bytes_written);
   free(memptr);
 
-  create_dir_node(ROOT_NODE);
-
-  printf("\nSuperblock info:\n");
-  printf("Signature: '%.8s'\n", sb.signature);
-  printf("Disk size: %d bytes\n", sb.disk_size);
-  printf("Cluster size: %d bytes\n", sb.cluster_size);
-  printf("Cluster count: %d\n", sb.cluster_count);
-  printf("Inode count: %d\n", sb.inode_count);
-  printf("Inode bitmap start address: %d\n", sb.bitmapi_start_address);
-  printf("Cluster bitmap start address: %d\n", sb.bitmap_start_address);
-  printf("Inode start address: %d\n", sb.inode_start_address);
-  printf("Data start address: %d\n", sb.data_start_address);
+  if (mount_filesystem(mount) != ERR_SUCCESS)
+    return ERR_MEMORY_ALLOCATION;
+
+  create_dir_node(mount, ROOT_NODE);
+  commit_changes(mount);
+  // every directory is gone, so every session starts over in the root
+  session->curr_node_id = ROOT_NODE;
+  pthread_mutex_lock(&mount->sessions_lock);
+  for (struct session *live = mount->sessions; live; live = live->next)
+    live->curr_node_id = ROOT_NODE;
+  pthread_mutex_unlock(&mount->sessions_lock);
+
+  fprintf(session->out, "\nSuperblock info:\n");
+  fprintf(session->out, "Signature: '%.8s'\n", sb.signature);
+  fprintf(session->out, "Disk size: %d bytes\n", sb.disk_size);
+  fprintf(session->out, "Cluster size: %d bytes\n", sb.cluster_size);
+  fprintf(session->out, "Cluster count: %d\n", sb.cluster_count);
+  fprintf(session->out, "Inode count: %d\n", sb.inode_count);
+  fprintf(session->out, "Inode bitmap start address: %d\n",
+          sb.bitmapi_start_address);
+  fprintf(session->out, "Cluster bitmap start address: %d\n",
+          sb.bitmap_start_address);
+  fprintf(session->out, "Refcount table start address: %d\n",
+          sb.refcount_start_address);
+  fprintf(session->out, "Journal start address: %d (%d bytes)\n",
+          sb.journal_start_address, sb.journal_size);
+  fprintf(session->out, "Inode start address: %d\n", sb.inode_start_address);
+  fprintf(session->out, "Data start address: %d\n", sb.data_start_address);
+  fprintf(session->out, "Inode layout: %s\n",
+          sb.features & SB_FEATURE_EXTENTS ? "extents" : "direct/indirect");
+  fprintf(session->out, "Directory index: %s\n",
+          sb.features & SB_FEATURE_DIR_INDEX ? "hashed" : "none");
+  fprintf(session->out, "Cluster sharing: %s\n",
+          sb.features & SB_FEATURE_REFCOUNTS ? "reflink" : "none");
 
   return ERR_SUCCESS;
 }
@@ -893,22 +2026,19 @@ int format(int size) {
 /**
  * @brief Count the number of set ones in a bitmap region.
  *
+ * @param mount Mount to work on.
  * @param bitmap_offset Byte offset of the bitmap start.
- * @param size Size of the bitmap in bits.
+ * @param size Size of the bitmap in bits, bits past it are not counted.
  * @return int Number of set bits.
  */
-int count_ones(int bitmap_offset, int size) {
-  uint8_t *data = malloc((size + 7) / 8);
-  fseek(g_system_state.file_ptr, bitmap_offset, SEEK_SET);
-  fread(data, (size + 7) / 8, 1, g_system_state.file_ptr);
-  int byte, bit, count = 0;
-  for (int i = 0; i < size; i++) {
-    byte = i / 8;
-    bit = i % 8;
-    if ((data[byte] >> bit) & 1)
-      count++;
-  }
-  free(data);
+int count_ones(struct SystemState *mount, int bitmap_offset, int size) {
+  struct bitmap *bm = get_bitmap(mount, bitmap_offset);
+  if (size >= bm->bit_count)
+    return bitmap_count(bm);
+
+  int count = 0;
+  for (int i = 0; i < size; i++)
+    count += bitmap_test(bm, i);
   return count;
 }
 
@@ -916,49 +2046,93 @@ int count_ones(int bitmap_offset, int size) {
  * @brief Checks if there are enough empty clusters available for a file of
  * given size.
  *
+ * @param mount Mount to work on.
  * @param file_size Size of the file in bytes.
  * @return int 1 if enough space, 0 otherwise.
  */
-int enough_empty_clusters(int file_size) {
-  int empty_cluster_count = g_system_state.sb.cluster_count -
-                            count_ones(g_system_state.sb.bitmap_start_address,
-                                       g_system_state.sb.cluster_count);
+int enough_empty_clusters(struct SystemState *mount, int file_size) {
+  int data_cluster_count = (file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  return mount->sb.free_cluster_count >=
+         data_cluster_count + mapping_clusters_needed(mount, file_size);
+}
+
+/**
+ * @brief Number of clusters the block map of a file of given size takes in
+ * the worst case, extent blocks or indirect pages, excluding its data.
+ *
+ * @param mount Mount to work on.
+ * @param file_size Size of the file in bytes.
+ * @return int Number of mapping clusters.
+ */
+int mapping_clusters_needed(struct SystemState *mount, int file_size) {
   int data_cluster_count = (file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  if (uses_extents(mount)) {
+    // worst case every cluster is its own extent
+    int overflow = data_cluster_count - INLINE_EXTENT_COUNT;
+    return overflow > 0
+               ? (overflow + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK
+               : 0;
+  }
   int pointers_per_cluster = CLUSTER_SIZE / sizeof(int);
   int indirect_2nd_used =
       (data_cluster_count > DIRECT_CLUSTER_COUNT + pointers_per_cluster) ? 1
                                                                          : 0;
-  int indirect_cluster_count =
-      (data_cluster_count - DIRECT_CLUSTER_COUNT) / pointers_per_cluster +
-      indirect_2nd_used;
-  int total_clusters_needed = indirect_cluster_count + data_cluster_count;
-  return empty_cluster_count >= total_clusters_needed;
+  return (data_cluster_count - DIRECT_CLUSTER_COUNT) / pointers_per_cluster +
+         indirect_2nd_used;
 }
 
 /**
- * @brief Counts the total number of directories in the system.
+ * @brief Counts the directories and files by scanning used inodes, hash
+ * index nodes are neither.
  *
- * @return int Number of directories.
+ * Only needed to rebuild the superblock counters, use sb.dir_count and
+ * sb.file_count otherwise.
+ *
+ * @param mount Mount to work on.
+ * @param dir_count Output number of directories.
+ * @param file_count Output number of files.
  */
-int count_dirs() {
-  int used_inodes = count_ones(g_system_state.sb.bitmapi_start_address,
-                               g_system_state.sb.inode_count);
-  int dir_count = 0;
-  for (int i = 0; i < used_inodes; i++) {
-    struct inode inode = get_inode(i);
-    if (!inode.is_file)
-      dir_count++;
+void count_nodes(struct SystemState *mount, int *dir_count, int *file_count) {
+  *dir_count = 0;
+  *file_count = 0;
+  for (int i = 0; i < mount->sb.inode_count; i++) {
+    if (!read_bit(mount, i, mount->sb.bitmapi_start_address))
+      continue;
+    struct inode inode = get_inode(mount, i);
+    if (inode.is_index)
+      continue;
+    if (inode.is_file)
+      (*file_count)++;
+    else
+      (*dir_count)++;
   }
-  return dir_count;
 }
 
 /**
  * @brief Placeholder for test command.
  *
+ * Built with DULAFS_TEST_HOOKS, "test crash" ends the process at once,
+ * without committing the running command or closing the mount, as a power
+ * cut would. The next mount replays the journal.
+ *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
+ * @param argc Number of arguments.
+ * @param argv Array of arguments.
  * @return int Error code.
  */
-int test() {
+int test(struct SystemState *mount, struct session *session, int argc,
+         char **argv) {
+  (void)mount;
+  (void)argc;
+  (void)argv;
+#ifdef DULAFS_TEST_HOOKS
+  if (argc == 2 && !strcmp(argv[1], "crash")) {
+    fflush(session->out);
+    _exit(EXIT_SUCCESS);
+  }
+#endif
 
-  printf("=== Test Complete ===\n");
+  fprintf(session->out, "=== Test Complete ===\n");
   return ERR_SUCCESS;
 }
\ No newline at end of file
@@ -1,6 +1,11 @@
 #ifndef DULAFS_H
 #define DULAFS_H
 
+#include "bitmap.h"
+#include "cache.h"
+#include "journal.h"
+#include "refcount.h"
+#include "storage.h"
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -25,6 +30,7 @@ typedef enum {
     ERR_CANNOT_HARDLINK_DIR,
     ERR_INVALID_ARGC,
     ERR_FILE_TOO_LARGE,
+    ERR_DIR_IN_USE,
     ERR_UNKNOWN
 } ErrorCode;
 
@@ -34,6 +40,16 @@ typedef enum {
 #define DIR_NAME_SIZE 12
 #define I_NODE_RATIO 0.02 
 #define CLUSTER_SIZE 4096
+#define JOURNAL_MAX_SIZE (8 * 1024 * 1024)
+
+// Optional on-disk structures, stored in superblock.features
+#define SB_FEATURE_COUNTERS 0x1 // free space and object counters are valid
+#define SB_FEATURE_EXTENTS 0x2  // inodes map data with extents (v2 inodes)
+#define SB_FEATURE_DIR_INDEX 0x4 // large directories keep a hash index
+#define SB_FEATURE_REFCOUNTS 0x8 // files may share clusters, counted in a table
+#define SB_FEATURE_JOURNAL 0x10  // metadata writes go through a journal
+
+#define INLINE_EXTENT_COUNT 3
 
 extern const long long int MAX_FILE_SIZE;
 
@@ -49,70 +65,243 @@ struct superblock {
   int bitmap_start_address;  // adresa pocatku bitmapy datových bloků
   int inode_start_address;   // adresa pocatku  i-uzlů
   int data_start_address;    // adresa pocatku datovych bloku
+  // Fields below are missing in images created before they were added, the
+  // on-disk size of the superblock is bitmapi_start_address.
+  int features;              // priznaky volitelnych struktur (SB_FEATURE_*)
+  int free_cluster_count;    // pocet volnych clusteru
+  int free_inode_count;      // pocet volnych i-uzlu
+  int dir_count;             // pocet adresaru
+  int file_count;            // pocet souboru
+  int refcount_start_address; // adresa tabulky sdileni clusteru
+  int journal_start_address; // adresa pocatku zurnalu
+  int journal_size;          // velikost zurnalu v bytech
 };
 
-// System state structure
-struct SystemState {
-  char working_dir[1024];
-  FILE* file_ptr;
-  int curr_node_id;
-  struct superblock sb;
+// Run of consecutive clusters
+struct extent {
+  int start;  // first cluster of the run
+  int length; // number of clusters in the run
 };
 
 struct inode {
   int id;      // ID i-uzlu, pokud ID = ID_ITEM_FREE, je polozka volna
   bool is_file;    // soubor, nebo adresar
   int8_t references;    // počet odkazů na i-uzel, používá se pro hardlinky
+  bool is_index;   // hash index of a directory, neither file nor directory
   int file_size;    // velikost souboru v bytech
-  int direct[DIRECT_CLUSTER_COUNT];      // 1. přímý odkaz na datové bloky
-  int indirect1;    // 1. nepřímý odkaz (odkaz - datové bloky)
-  int indirect2;    // 2. nepřímý odkaz (odkaz - odkaz - datové bloky)
+  union {
+    struct {
+      int direct[DIRECT_CLUSTER_COUNT];      // 1. přímý odkaz na datové bloky
+      int indirect1;    // 1. nepřímý odkaz (odkaz - datové bloky)
+      int indirect2;    // 2. nepřímý odkaz (odkaz - odkaz - datové bloky)
+    };
+    // v2 layout used with SB_FEATURE_EXTENTS, extents[0].start shares storage
+    // with direct[0] so the first cluster of a directory is found the same way
+    struct {
+      struct extent extents[INLINE_EXTENT_COUNT]; // first extents of the file
+      int extent_block; // first overflow extent block, 0 if none
+    };
+  };
+};
+
+// Overflow cluster holding extents which do not fit into the inode
+struct extent_block {
+  int next;  // next extent block, 0 if this is the last one
+  int count; // number of used extents in this block
+  struct extent extents[(CLUSTER_SIZE - 2 * sizeof(int)) /
+                        sizeof(struct extent)];
 };
 
+#define EXTENTS_PER_BLOCK                                                      \
+  ((int)(sizeof(((struct extent_block *)0)->extents) / sizeof(struct extent)))
+
 struct directory_item {
   int inode;      // inode odpovídající souboru
   char item_name[DIR_NAME_SIZE]; // 8+3 + /0 C/C++ ukoncovaci string znak
 };
 
-extern struct SystemState g_system_state;
+#define DIR_ITEMS_PER_CLUSTER                                                  \
+  ((int)(CLUSTER_SIZE / sizeof(struct directory_item)))
+
+// The "." item (always the second item) of a directory viewed with the space
+// behind its short name used, like ext3 keeps its htree root behind "." and
+// "..". Zero in directories without an index and in older images.
+struct dir_self_item {
+  int inode;         // the directory itself
+  char item_name[4]; // "."
+  int index_node;    // inode holding the hash index, 0 if none
+  int reserved;
+};
+
+// Entry of a directory index bucket
+struct dir_index_entry {
+  uint32_t hash; // hash of the item name
+  int slot;      // position of the item in the directory
+};
+
+// One cluster of a directory hash index, the index node stores the buckets
+// as its data, bucket i being its i-th cluster. The bucket count is a power
+// of two.
+struct dir_index_bucket {
+  int count; // number of used entries
+  struct dir_index_entry entries[(CLUSTER_SIZE - sizeof(int)) /
+                                 sizeof(struct dir_index_entry)];
+};
+
+#define DIR_INDEX_BUCKET_ENTRIES                                               \
+  ((int)(sizeof(((struct dir_index_bucket *)0)->entries) /                     \
+         sizeof(struct dir_index_entry)))
+
+#include "dcache.h"
+#include "icache.h"
+
+#define NODE_READER_CLUSTERS 256 // clusters returned per chunk, 1 MiB
+
+// Sequential reader returning a node's data in fixed size chunks, so memory
+// use does not depend on the file size
+struct node_reader {
+  struct SystemState *mount; // mount the node is read from
+  struct inode inode;        // node being read
+  long position;             // bytes of the node already returned
+  uint8_t *buffer;           // NODE_READER_CLUSTERS clusters
+};
+
+// Open file of the file-handle API. Reads and writes at any offset resolve
+// only the clusters they touch through the block map, so their cost does not
+// depend on the file size.
+struct file_handle {
+  struct SystemState *mount; // mount the file was opened on
+  int node_id;               // inode of the file, -1 once closed
+};
+
+// State of one user of the filesystem, the console or a client of the
+// server. Relative paths are resolved against its working directory, whose
+// path is rebuilt from the inode whenever it is shown.
+struct session {
+  int curr_node_id;
+  FILE *out;            // command output
+  FILE *err;            // error messages
+  struct session *next; // next live session of the same mount
+};
+
+// State of one mounted image, created by mount_open
+struct SystemState {
+  struct storage *storage;      // backend all image I/O goes through
+  struct superblock sb;
+  bool sb_dirty;                // superblock changed since last commit
+  struct bitmap inode_bitmap;   // in-memory copy of the inode bitmap
+  struct bitmap cluster_bitmap; // in-memory copy of the cluster bitmap
+  struct refcount_table refcounts; // extra references of shared clusters
+  struct block_cache cache;     // cache of clusters read from the image
+  struct inode_cache icache;    // cache of inodes read from the inode table
+  struct dentry_cache dcache;   // cache of (directory, name) lookups
+  struct journal journal;       // redo log the commits go through
+  struct io_queue io_queue;     // keeps bulk data transfers in flight
+  int *freed_clusters;          // clusters freed since the last commit
+  int freed_count;
+  int freed_capacity;
+  int replayed;                 // journaled writes replayed when mounted
+  struct session *sessions;     // live sessions, guarded by sessions_lock
+  pthread_mutex_t sessions_lock;
+  // shared commands run under the read lock, the others under the write lock
+  pthread_rwlock_t lock;
+};
 
 // Function declarations
-void setBit(int i, int bitmap_offset);
-void clearBit(int i, int bitmap_offset);
-int readBit(int i, int bitmap_offset);
+void set_bit(struct SystemState* mount, int i, int bitmap_offset);
+void clear_bit(struct SystemState* mount, int i, int bitmap_offset);
+int read_bit(struct SystemState* mount, int i, int bitmap_offset);
+int load_bitmaps(struct SystemState* mount);
+int mount_filesystem(struct SystemState* mount);
+int commit_changes(struct SystemState* mount);
+int replay_journal(struct SystemState* mount);
+void begin_batch(struct SystemState* mount);
+int end_batch(struct SystemState* mount, bool commit);
+int discard_changes(struct SystemState* mount);
+int read_superblock(struct SystemState* mount);
+void rebuild_counters(struct SystemState* mount);
 
 struct superblock get_superblock(int disk_size);
 struct inode get_inode_struct(bool is_file);
-int get_empty_index(int bitmap_offset);
-uint8_t* get_node_data(struct inode* inode);
-int* get_node_clusters(struct inode* inode);
-struct inode get_inode(int node_id);
-int contains_file(struct inode* inode, char* file_name);
-struct directory_item* get_directory_items(struct inode* dir_node);
-int count_ones(int bitmap_offset, int size);
-int unused_inodes_left();
-
-// Moved from commands.c: utility functions operating on global fs state
-int enough_empty_clusters(int file_size);
-int count_dirs();
-
-
-void clear_inode(struct inode *inode);
-int create_dir_node(int up_ref);
-void init_directory(struct inode* dir_inode, int parent_inode_id);
-void write_inode(struct inode *inode);
-int add_record_to_dir(struct directory_item record, struct inode* inode);
-int assign_empty_inode();
-int assign_empty_cluster();
-int* assign_node_clusters(struct inode* inode);
-int format(int size);
-char* inode_to_path(int inode_id);
-int path_to_inode(char* path);
+int get_empty_index(struct SystemState* mount, int bitmap_offset);
+uint8_t* get_node_data(struct SystemState* mount, struct inode* inode);
+int* get_node_clusters(struct SystemState* mount, struct inode* inode);
+struct extent* get_node_extents(struct SystemState* mount, struct inode* inode,
+                                int* extent_count);
+int node_cluster_at(struct SystemState* mount, struct inode* inode, int index);
+int node_run_at(struct SystemState* mount, struct inode* inode, int index,
+                int max_length, int* length);
+int node_set_cluster(struct SystemState* mount, struct inode* inode, int index,
+                     int cluster);
+int node_append_cluster(struct SystemState* mount, struct inode* inode);
+void node_drop_last_cluster(struct SystemState* mount, struct inode* inode);
+void release_node_clusters(struct SystemState* mount, struct inode* inode);
+struct extent* clusters_to_extents(const int* clusters, int cluster_count,
+                                   int* extent_count);
+struct inode get_inode(struct SystemState* mount, int node_id);
+int contains_file(struct SystemState* mount, struct inode* inode,
+                  char* file_name);
+struct directory_item* get_directory_items(struct SystemState* mount,
+                                           struct inode* dir_node);
+int count_ones(struct SystemState* mount, int bitmap_offset, int size);
+int unused_inodes_left(struct SystemState* mount);
+
+// Moved from commands.c: utility functions operating on the state of a mount
+int enough_empty_clusters(struct SystemState* mount, int file_size);
+int mapping_clusters_needed(struct SystemState* mount, int file_size);
+void count_nodes(struct SystemState* mount, int* dir_count, int* file_count);
+
+
+void clear_inode(struct SystemState* mount, struct inode *inode);
+int create_dir_node(struct SystemState* mount, int up_ref);
+int create_file_node(struct SystemState* mount, int file_size);
+void init_directory(struct SystemState* mount, struct inode* dir_inode,
+                    int parent_inode_id);
+void write_inode(struct SystemState* mount, struct inode *inode);
+int add_record_to_dir(struct SystemState* mount, struct directory_item record,
+                      struct inode* inode);
+int assign_empty_inode(struct SystemState* mount);
+int assign_empty_cluster(struct SystemState* mount);
+struct extent* allocate_clusters(struct SystemState* mount, int cluster_count,
+                                 int* run_count);
+int* assign_node_clusters(struct SystemState* mount, struct inode* inode);
+int map_node_clusters(struct SystemState* mount, struct inode* inode,
+                      const int* clusters, int cluster_count);
+int format(struct SystemState* mount, struct session* session, int size,
+           int features);
+char* inode_to_path(struct SystemState* mount, int inode_id);
+bool dir_in_use(struct SystemState* mount, int node_id);
+int path_to_inode(struct SystemState* mount, struct session* session,
+                  char* path);
 char* get_final_token(char* path);
-int get_dir_id(char* path, char** target_name);
-int delete_item(struct inode* inode, char* item_name);
-int find_item_in_dir(struct inode* dir_inode, char* item_name);
-int test();
+int get_dir_id(struct SystemState* mount, struct session* session, char* path,
+               char** target_name);
+int delete_item(struct SystemState* mount, struct inode* inode,
+                char* item_name);
+int find_item_in_dir(struct SystemState* mount, struct inode* dir_inode,
+                     char* item_name);
+int find_inode_in_dir(struct SystemState* mount, struct inode* dir_inode,
+                      int node_id);
+int dir_read_item(struct SystemState* mount, struct inode* dir_inode, int slot,
+                  struct directory_item* item);
+int dir_write_item(struct SystemState* mount, struct inode* dir_inode, int slot,
+                   const struct directory_item* item);
+int dir_add_item(struct SystemState* mount, struct inode* dir_inode,
+                 const struct directory_item* item);
+int dir_remove_item(struct SystemState* mount, struct inode* dir_inode,
+                    int slot);
+int node_reader_open(struct SystemState* mount, struct node_reader* reader,
+                     const struct inode* inode);
+long node_reader_next(struct node_reader* reader, const uint8_t** data);
+void node_reader_close(struct node_reader* reader);
+int file_open(struct SystemState* mount, struct session* session,
+              struct file_handle* fh, char* path);
+long file_pread(struct file_handle* fh, void* buf, long length, long offset);
+long file_pwrite(struct file_handle* fh, const void* buf, long length,
+                 long offset);
+void file_close(struct file_handle* fh);
+int test(struct SystemState* mount, struct session* session, int argc,
+         char** argv);
 
 // Error message retrieval
 const char* get_error_message(ErrorCode code);
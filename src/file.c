@@ -0,0 +1,266 @@
+#include "dulafs.h"
+#include <limits.h>
+#include <string.h>
+
+/**
+ * @brief Open a file by path.
+ *
+ * @param mount Mount to work on.
+ * @param session Session relative paths are resolved in.
+ * @param fh Handle to initialize.
+ * @param path Path of the file.
+ * @return int Error code.
+ */
+int file_open(struct SystemState *mount, struct session *session,
+              struct file_handle *fh, char *path) {
+  fh->mount = mount;
+  fh->node_id = -1;
+  int node_id = path_to_inode(mount, session, path);
+  if (node_id < 0)
+    return -node_id;
+  if (!get_inode(mount, node_id).is_file)
+    return ERR_NOT_A_FILE;
+  fh->node_id = node_id;
+  return ERR_SUCCESS;
+}
+
+/**
+ * @brief Copy bytes between a buffer and the data of a node.
+ *
+ * The range is resolved one run of consecutive clusters at a time. A run
+ * starting inside a cluster is split off at the cluster end, the rest of it
+ * moves with one cache range call.
+ *
+ * @param mount Mount to work on.
+ * @param inode Node whose data covers the range.
+ * @param buf Buffer of length bytes.
+ * @param length Number of bytes.
+ * @param offset Byte offset in the node.
+ * @param write Write buf into the node, read into buf otherwise.
+ * @return int 0 on success, -1 on failure.
+ */
+static int transfer(struct SystemState *mount, struct inode *inode,
+                    uint8_t *buf, long length, long offset, bool write) {
+  long done = 0;
+  while (done < length) {
+    long position = offset + done;
+    int within = position % CLUSTER_SIZE;
+    int wanted = (within + length - done + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    int run;
+    int start = node_run_at(mount, inode, position / CLUSTER_SIZE, wanted,
+                            &run);
+    if (start < 0)
+      return -1;
+
+    long bytes = within ? CLUSTER_SIZE - within : (long)run * CLUSTER_SIZE;
+    if (bytes > length - done)
+      bytes = length - done;
+    int failed;
+    if (within && write)
+      failed = cache_write_data(&mount->cache, start, within, buf + done,
+                                bytes);
+    else if (within)
+      failed = cache_read(&mount->cache, start, within, buf + done, bytes);
+    else if (write)
+      failed = cache_write_range(&mount->cache, start, buf + done, bytes);
+    else
+      failed = cache_read_range(&mount->cache, start, buf + done, bytes);
+    if (failed)
+      return -1;
+    done += bytes;
+  }
+  return 0;
+}
+
+/**
+ * @brief Read bytes of an open file at an offset.
+ *
+ * @param fh Open file.
+ * @param buf Destination buffer.
+ * @param length Number of bytes wanted.
+ * @param offset Byte offset in the file.
+ * @return long Number of bytes read, less than length at the end of the
+ * file, or negative error code.
+ */
+long file_pread(struct file_handle *fh, void *buf, long length, long offset) {
+  struct SystemState *mount = fh->mount;
+  if (fh->node_id < 0)
+    return -ERR_NOT_A_FILE;
+  if (offset < 0 || length < 0)
+    return -ERR_INVALID_SIZE;
+  struct inode inode = get_inode(mount, fh->node_id);
+  if (offset >= inode.file_size)
+    return 0;
+  if (length > inode.file_size - offset)
+    length = inode.file_size - offset;
+  return transfer(mount, &inode, buf, length, offset, false) ? -ERR_UNKNOWN
+                                                             : length;
+}
+
+/**
+ * @brief Give a node its own copy of a cluster it shares with other nodes.
+ *
+ * @param mount Mount to work on.
+ * @param inode Node to modify, the caller writes it.
+ * @param index Logical cluster number within the node.
+ * @param keep Whether the current contents are needed, pass false when the
+ * caller overwrites the whole cluster.
+ * @return int ERR_SUCCESS, or error code on failure.
+ */
+static int unshare_cluster(struct SystemState *mount, struct inode *inode,
+                           int index, bool keep) {
+  int cluster = node_cluster_at(mount, inode, index);
+  if (cluster < 0)
+    return ERR_UNKNOWN;
+  if (!refcount_shared(&mount->refcounts, cluster))
+    return ERR_SUCCESS;
+  int copy = assign_empty_cluster(mount);
+  if (copy < 0)
+    return ERR_CLUSTER_FULL;
+  uint8_t data[CLUSTER_SIZE];
+  int result = ERR_SUCCESS;
+  if (keep && (cache_read(&mount->cache, cluster, 0, data, CLUSTER_SIZE) ||
+               cache_write_data(&mount->cache, copy, 0, data, CLUSTER_SIZE)))
+    result = ERR_UNKNOWN;
+  if (result == ERR_SUCCESS)
+    result = node_set_cluster(mount, inode, index, copy);
+  if (result != ERR_SUCCESS) {
+    clear_bit(mount, copy, mount->sb.bitmap_start_address);
+    return result;
+  }
+  refcount_unshare(&mount->refcounts, cluster);
+  return ERR_SUCCESS;
+}
+
+/**
+ * @brief Make the clusters a write touches private to the node.
+ *
+ * Only clusters which exist before the write are checked, a cluster the
+ * write covers whole is not copied.
+ *
+ * @param mount Mount to work on.
+ * @param inode Node to modify, the caller writes it.
+ * @param offset First byte of the write.
+ * @param end Byte after the write.
+ * @return int ERR_SUCCESS, or error code on failure.
+ */
+static int unshare_range(struct SystemState *mount, struct inode *inode,
+                         long offset, long end) {
+  if (!(mount->sb.features & SB_FEATURE_REFCOUNTS))
+    return ERR_SUCCESS;
+  int cluster_count = (inode->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  int last = (end - 1) / CLUSTER_SIZE;
+  for (int index = offset / CLUSTER_SIZE;
+       index <= last && index < cluster_count; index++) {
+    bool whole = (long)index * CLUSTER_SIZE >= offset &&
+                 (long)(index + 1) * CLUSTER_SIZE <= end;
+    int result = unshare_cluster(mount, inode, index, !whole);
+    if (result != ERR_SUCCESS)
+      return result;
+  }
+  return ERR_SUCCESS;
+}
+
+/**
+ * @brief Grow a node up to the end of a write, the bytes between the old
+ * end and the write read as zeros.
+ *
+ * New clusters are appended one by one, a cluster the write covers whole is
+ * not zeroed. On failure the node keeps its old size and the appended
+ * clusters are freed.
+ *
+ * @param mount Mount to work on.
+ * @param inode Node to grow, the caller writes it.
+ * @param offset First byte of the write.
+ * @param end Byte after the write, the new size.
+ * @return int ERR_SUCCESS, or error code on failure.
+ */
+static int grow_file(struct SystemState *mount, struct inode *inode,
+                     long offset, long end) {
+  static const uint8_t zeros[CLUSTER_SIZE];
+  int old_size = inode->file_size;
+  int within = old_size % CLUSTER_SIZE;
+  if (within &&
+      cache_write_data(&mount->cache,
+                       node_cluster_at(mount, inode, old_size / CLUSTER_SIZE),
+                       within, zeros, CLUSTER_SIZE - within))
+    return ERR_UNKNOWN;
+
+  int old_count = (old_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  int new_count = (end + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  if (mount->sb.free_cluster_count < new_count - old_count)
+    return ERR_CLUSTER_FULL;
+  int count = old_count;
+  while (count < new_count) {
+    // node_append_cluster finds the slot of the new cluster from the size
+    inode->file_size = count * CLUSTER_SIZE;
+    int cluster = node_append_cluster(mount, inode);
+    if (cluster < 0)
+      break;
+    count++;
+    bool whole = (long)(count - 1) * CLUSTER_SIZE >= offset &&
+                 (long)count * CLUSTER_SIZE <= end;
+    if (!whole &&
+        cache_write_data(&mount->cache, cluster, 0, zeros, CLUSTER_SIZE))
+      break;
+  }
+  if (count == new_count) {
+    inode->file_size = end;
+    return ERR_SUCCESS;
+  }
+
+  while (count > old_count) {
+    inode->file_size = count * CLUSTER_SIZE;
+    node_drop_last_cluster(mount, inode);
+    count--;
+  }
+  inode->file_size = old_size;
+  return ERR_CLUSTER_FULL;
+}
+
+/**
+ * @brief Write bytes of an open file at an offset.
+ *
+ * Writing past the end grows the file, a gap before the offset reads as
+ * zeros. Clusters the file shares with copies made by cp are copied before
+ * they change, the copies keep the old contents.
+ *
+ * @param fh Open file.
+ * @param buf Source buffer.
+ * @param length Number of bytes.
+ * @param offset Byte offset in the file.
+ * @return long Number of bytes written, or negative error code.
+ */
+long file_pwrite(struct file_handle *fh, const void *buf, long length,
+                 long offset) {
+  struct SystemState *mount = fh->mount;
+  if (fh->node_id < 0)
+    return -ERR_NOT_A_FILE;
+  if (offset < 0 || length < 0)
+    return -ERR_INVALID_SIZE;
+  if (offset + length > MAX_FILE_SIZE || offset + length > INT_MAX)
+    return -ERR_FILE_TOO_LARGE;
+  if (!length)
+    return 0;
+
+  struct inode inode = get_inode(mount, fh->node_id);
+  long end = offset + length;
+  int result = unshare_range(mount, &inode, offset, end);
+  // growing zeroes the tail of the old last cluster, also before the write
+  if (result == ERR_SUCCESS && inode.file_size < offset)
+    result = unshare_range(mount, &inode, inode.file_size, offset);
+  if (result == ERR_SUCCESS && end > inode.file_size)
+    result = grow_file(mount, &inode, offset, end);
+  if (result == ERR_SUCCESS &&
+      transfer(mount, &inode, (uint8_t *)buf, length, offset, true))
+    result = ERR_UNKNOWN;
+  write_inode(mount, &inode);
+  return result == ERR_SUCCESS ? length : -result;
+}
+
+/**
+ * @brief Close an open file.
+ *
+ * @param fh File to close.
+ */
+void file_close(struct file_handle *fh) { fh->node_id = -1; }
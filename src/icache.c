@@ -0,0 +1,371 @@
+#include "dulafs.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ICACHE_INITIAL_BUCKETS 256
+
+/**
+ * @brief Byte offset of an inode slot in the image.
+ *
+ * @param cache Cache attached to an image.
+ * @param node_id Inode ID.
+ * @return long Byte offset of the slot.
+ */
+static long slot_offset(const struct inode_cache *cache, int node_id) {
+  return cache->table_start + (long)node_id * sizeof(struct inode);
+}
+
+/**
+ * @brief Whether inodes are used directly in the mapped image.
+ *
+ * With deferred writes they are cached like on any other storage, so they
+ * can be journaled and discarded.
+ *
+ * @param cache Cache to check.
+ * @return bool True when the image is addressable and writes go in place.
+ */
+static bool in_place(const struct inode_cache *cache) {
+  return cache->storage->map && !cache->deferred;
+}
+
+/**
+ * @brief Find the cached entry of an inode.
+ *
+ * @param cache Cache to look into.
+ * @param node_id Inode ID.
+ * @return struct icache_entry* The entry, or NULL if the inode is not cached.
+ */
+static struct icache_entry *lookup(const struct inode_cache *cache,
+                                   int node_id) {
+  if (!cache->buckets)
+    return NULL;
+  struct icache_entry *entry =
+      cache->buckets[(unsigned int)node_id % cache->bucket_count];
+  while (entry && entry->node_id != node_id)
+    entry = entry->hash_next;
+  return entry;
+}
+
+/**
+ * @brief Remove an entry from its hash chain.
+ *
+ * @param cache Cache holding the entry.
+ * @param entry Entry to remove.
+ */
+static void hash_remove(struct inode_cache *cache, struct icache_entry *entry) {
+  struct icache_entry **link =
+      &cache->buckets[(unsigned int)entry->node_id % cache->bucket_count];
+  while (*link && *link != entry)
+    link = &(*link)->hash_next;
+  if (*link)
+    *link = entry->hash_next;
+}
+
+/**
+ * @brief Unlink an entry from the LRU list.
+ *
+ * @param cache Cache holding the entry.
+ * @param entry Entry to unlink.
+ */
+static void lru_unlink(struct inode_cache *cache, struct icache_entry *entry) {
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    cache->lru_head = entry->next;
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    cache->lru_tail = entry->prev;
+  entry->prev = entry->next = NULL;
+}
+
+/**
+ * @brief Move an entry to the front of the LRU list.
+ *
+ * @param cache Cache holding the entry.
+ * @param entry Entry that was just used, linked or not.
+ */
+static void lru_touch(struct inode_cache *cache, struct icache_entry *entry) {
+  if (cache->lru_head == entry)
+    return;
+  if (entry->prev || entry->next || cache->lru_tail == entry)
+    lru_unlink(cache, entry);
+  entry->next = cache->lru_head;
+  if (cache->lru_head)
+    cache->lru_head->prev = entry;
+  cache->lru_head = entry;
+  if (!cache->lru_tail)
+    cache->lru_tail = entry;
+}
+
+/**
+ * @brief Grow the hash table so chains stay short.
+ *
+ * @param cache Cache to grow.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int grow(struct inode_cache *cache) {
+  int bucket_count =
+      cache->bucket_count ? cache->bucket_count * 2 : ICACHE_INITIAL_BUCKETS;
+  struct icache_entry **buckets =
+      calloc(bucket_count, sizeof(struct icache_entry *));
+  if (!buckets)
+    return -1;
+
+  for (int b = 0; b < cache->bucket_count; b++) {
+    struct icache_entry *entry = cache->buckets[b];
+    while (entry) {
+      struct icache_entry *next = entry->hash_next;
+      int index = (unsigned int)entry->node_id % bucket_count;
+      entry->hash_next = buckets[index];
+      buckets[index] = entry;
+      entry = next;
+    }
+  }
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->bucket_count = bucket_count;
+  return 0;
+}
+
+/**
+ * @brief Free least recently used entries until one more fits into the
+ * capacity.
+ *
+ * Clean entries are preferred. With deferred writes dirty entries are never
+ * evicted, the cache grows past capacity instead, otherwise a dirty victim
+ * is written back first.
+ *
+ * @param cache Cache to evict from.
+ */
+static void evict(struct inode_cache *cache) {
+  while (cache->count >= cache->capacity) {
+    struct icache_entry *entry = cache->lru_tail;
+    while (entry && entry->dirty)
+      entry = entry->prev;
+    if (!entry && !cache->deferred)
+      entry = cache->lru_tail;
+    if (!entry)
+      return;
+    if (entry->dirty) {
+      if (storage_write(cache->storage, &entry->inode, sizeof(struct inode),
+                        slot_offset(cache, entry->node_id)))
+        return;
+      entry->dirty = false;
+    }
+    hash_remove(cache, entry);
+    lru_unlink(cache, entry);
+    free(entry);
+    cache->count--;
+  }
+}
+
+/**
+ * @brief Add an inode to the cache, evicting the least recently used clean
+ * inode when the cache is full.
+ *
+ * @param cache Cache to insert into.
+ * @param node_id Inode slot the contents belong to.
+ * @param inode Inode contents.
+ * @return struct icache_entry* The new entry, or NULL on allocation failure.
+ */
+static struct icache_entry *insert(struct inode_cache *cache, int node_id,
+                                   const struct inode *inode) {
+  evict(cache);
+  if (cache->count >= cache->bucket_count * 2 && grow(cache))
+    return NULL;
+  struct icache_entry *entry = malloc(sizeof(struct icache_entry));
+  if (!entry)
+    return NULL;
+  entry->node_id = node_id;
+  entry->inode = *inode;
+  entry->dirty = false;
+  entry->flushed = 0;
+  entry->prev = entry->next = NULL;
+  int index = (unsigned int)node_id % cache->bucket_count;
+  entry->hash_next = cache->buckets[index];
+  cache->buckets[index] = entry;
+  lru_touch(cache, entry);
+  cache->count++;
+  return entry;
+}
+
+/**
+ * @brief Drop all cached inodes and attach the cache to an inode table.
+ *
+ * Dirty inodes are discarded, used after open and format.
+ *
+ * @param cache Cache to reset.
+ * @param storage Image storage. When its bytes are addressable (mmap) the
+ * inodes are used in place and nothing is cached, unless writes are
+ * deferred.
+ * @param table_start Byte offset of the inode table in the image.
+ */
+void icache_reset(struct inode_cache *cache, struct storage *storage,
+                  long table_start) {
+  icache_destroy(cache);
+  cache->storage = storage;
+  cache->table_start = table_start;
+}
+
+/**
+ * @brief Free all cached inodes without writing them back.
+ *
+ * @param cache Cache to destroy.
+ */
+void icache_destroy(struct inode_cache *cache) {
+  struct icache_entry *entry = cache->lru_head;
+  while (entry) {
+    struct icache_entry *next = entry->next;
+    free(entry);
+    entry = next;
+  }
+  free(cache->buckets);
+  // the lock and the capacity stay, they live as long as the mount
+  cache->buckets = NULL;
+  cache->bucket_count = cache->count = 0;
+  cache->lru_head = cache->lru_tail = NULL;
+  cache->storage = NULL;
+  cache->table_start = 0;
+  cache->deferred = false;
+  cache->hits = cache->misses = 0;
+}
+
+/**
+ * @brief Copy an inode out of the cache, reading it on first use.
+ *
+ * Several threads may get inodes at the same time. The inode is copied
+ * while the cache is locked, another thread may evict the entry right after.
+ *
+ * @param cache Cache to use.
+ * @param node_id Inode ID.
+ * @param inode Output inode.
+ * @return int 0 on success, -1 if the slot could not be read.
+ */
+int icache_get(struct inode_cache *cache, int node_id, struct inode *inode) {
+  if (in_place(cache)) {
+    memcpy(inode, cache->storage->map + slot_offset(cache, node_id),
+           sizeof(struct inode));
+    return 0;
+  }
+  int failed = 0;
+  pthread_mutex_lock(&cache->lock);
+  struct icache_entry *entry = lookup(cache, node_id);
+  if (entry) {
+    cache->hits++;
+    lru_touch(cache, entry);
+    *inode = entry->inode;
+  } else {
+    cache->misses++;
+    memset(inode, 0, sizeof(struct inode));
+    failed = storage_read(cache->storage, inode, sizeof(struct inode),
+                          slot_offset(cache, node_id));
+    // without memory for an entry the inode is read again next time
+    if (!failed)
+      insert(cache, node_id, inode);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return failed;
+}
+
+/**
+ * @brief Replace the cached copy of an inode and mark it dirty.
+ *
+ * @param cache Cache to use.
+ * @param inode New inode contents, inode->id selects the slot.
+ */
+void icache_store(struct inode_cache *cache, const struct inode *inode) {
+  if (in_place(cache)) {
+    memcpy(cache->storage->map + slot_offset(cache, inode->id), inode,
+           sizeof(struct inode));
+    return;
+  }
+  pthread_mutex_lock(&cache->lock);
+  struct icache_entry *entry = lookup(cache, inode->id);
+  if (!entry)
+    entry = insert(cache, inode->id, inode);
+  if (entry) {
+    entry->inode = *inode;
+    entry->dirty = true;
+    lru_touch(cache, entry);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  if (!entry) {
+    // no memory for the cache, write through
+    storage_write(cache->storage, inode, sizeof(struct inode),
+                  slot_offset(cache, inode->id));
+  }
+}
+
+/**
+ * @brief Compare two entries by inode ID, for qsort.
+ */
+static int compare_entries(const void *a, const void *b) {
+  const struct icache_entry *x = *(struct icache_entry *const *)a;
+  const struct icache_entry *y = *(struct icache_entry *const *)b;
+  return (x->node_id > y->node_id) - (x->node_id < y->node_id);
+}
+
+/**
+ * @brief Write all dirty inodes back to the inode table in ID order.
+ *
+ * Does not flush the storage, the caller decides when to do that.
+ *
+ * @param cache Cache to flush.
+ * @return int 0 on success, -1 if a write failed.
+ */
+int icache_flush(struct inode_cache *cache) {
+  cache->flush_count++;
+  int dirty_count = 0, failed = 0;
+  for (struct icache_entry *e = cache->lru_head; e; e = e->next)
+    dirty_count += e->dirty;
+  if (!dirty_count)
+    return 0;
+
+  struct icache_entry **dirty =
+      malloc(dirty_count * sizeof(struct icache_entry *));
+  struct inode *run = malloc(dirty_count * sizeof(struct inode));
+  if (!dirty || !run) {
+    free(dirty);
+    free(run);
+    return -1;
+  }
+  int n = 0;
+  for (struct icache_entry *e = cache->lru_head; e; e = e->next) {
+    if (e->dirty)
+      dirty[n++] = e;
+  }
+  qsort(dirty, n, sizeof(struct icache_entry *), compare_entries);
+
+  // neighbouring slots are gathered and written with one call
+  for (int i = 0; i < n;) {
+    int length = 0;
+    do {
+      run[length] = dirty[i + length]->inode;
+      dirty[i + length]->dirty = false;
+      dirty[i + length]->flushed = cache->flush_count;
+      length++;
+    } while (i + length < n &&
+             dirty[i + length]->node_id == dirty[i]->node_id + length);
+    if (storage_write(cache->storage, run, length * sizeof(struct inode),
+                      slot_offset(cache, dirty[i]->node_id)))
+      failed = -1;
+    i += length;
+  }
+  free(run);
+  free(dirty);
+  return failed;
+}
+
+/**
+ * @brief Mark the inodes written by the last icache_flush dirty again after
+ * a failed commit.
+ *
+ * @param cache Cache to mark.
+ */
+void icache_mark_dirty(struct inode_cache *cache) {
+  for (struct icache_entry *e = cache->lru_head; e; e = e->next) {
+    if (e->flushed == cache->flush_count)
+      e->dirty = true;
+  }
+}
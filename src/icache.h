@@ -0,0 +1,49 @@
+#ifndef ICACHE_H
+#define ICACHE_H
+
+// Included from dulafs.h once struct inode is defined.
+#include "storage.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+#define ICACHE_DEFAULT_ENTRIES 8192 // inodes the cache keeps at most
+
+// Cached copy of one inode of the inode table
+struct icache_entry {
+  int node_id;               // inode table slot the entry caches
+  struct inode inode;
+  bool dirty;                // changed since it was last written
+  long flushed;              // flush which last wrote the entry
+  struct icache_entry *prev, *next; // LRU list, most recently used first
+  struct icache_entry *hash_next;   // next entry in the same hash bucket
+};
+
+// Write-back cache of inodes, keyed by inode ID, with LRU eviction of clean
+// entries. icache_get may run on several threads, the other functions only
+// while it cannot.
+struct inode_cache {
+  struct icache_entry **buckets;
+  int bucket_count;
+  int count;        // number of cached inodes
+  int capacity;     // inodes kept at most, unless all of them are dirty
+  struct icache_entry *lru_head; // most recently used entry
+  struct icache_entry *lru_tail; // least recently used entry
+  struct storage *storage; // image the inode table is read from
+  long table_start; // byte offset of the inode table in the image
+  // changes wait for icache_flush: dirty entries are never evicted, the
+  // cache grows past capacity instead, and addressable images are cached
+  bool deferred;
+  long flush_count; // calls of icache_flush
+  long hits, misses;
+  pthread_mutex_t lock; // taken by lookups, sessions may look up in parallel
+};
+
+void icache_reset(struct inode_cache *cache, struct storage *storage,
+                  long table_start);
+void icache_destroy(struct inode_cache *cache);
+int icache_get(struct inode_cache *cache, int node_id, struct inode *inode);
+void icache_store(struct inode_cache *cache, const struct inode *inode);
+int icache_flush(struct inode_cache *cache);
+void icache_mark_dirty(struct inode_cache *cache);
+
+#endif
@@ -0,0 +1,434 @@
+#include "ioqueue.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+/**
+ * @brief Transfer the rest of a request with pread/pwrite, retrying short
+ * transfers.
+ *
+ * @param fd Image file descriptor.
+ * @param request Request to finish.
+ * @return int 0 on success, -1 on failure or end of file.
+ */
+static int transfer_fully(int fd, struct io_request *request) {
+  while (request->done < request->length) {
+    uint8_t *buf = (uint8_t *)request->buf + request->done;
+    size_t length = request->length - request->done;
+    long offset = request->offset + (long)request->done;
+    ssize_t n = request->write ? pwrite(fd, buf, length, offset)
+                               : pread(fd, buf, length, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    request->done += n;
+  }
+  return 0;
+}
+
+#ifdef __NR_io_uring_setup
+/**
+ * @brief Set up an io_uring instance with rings for depth requests.
+ *
+ * @param q Queue to set up.
+ * @return int 0 on success, -1 if io_uring is not available.
+ */
+static int uring_open(struct io_queue *q) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  q->ring_fd = syscall(__NR_io_uring_setup, q->depth, &params);
+  if (q->ring_fd < 0)
+    return -1;
+
+  q->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  q->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    if (q->cq_ring_size > q->sq_ring_size)
+      q->sq_ring_size = q->cq_ring_size;
+    q->cq_ring_size = q->sq_ring_size;
+  }
+  q->sq_ring = mmap(NULL, q->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQ_RING);
+  q->cq_ring = single_mmap ? q->sq_ring
+                           : mmap(NULL, q->cq_ring_size, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, q->ring_fd,
+                                  IORING_OFF_CQ_RING);
+  q->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  q->sqes = mmap(NULL, q->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQES);
+  if (q->sq_ring == MAP_FAILED || q->cq_ring == MAP_FAILED ||
+      q->sqes == MAP_FAILED)
+    return -1;
+
+  uint8_t *sq = q->sq_ring, *cq = q->cq_ring;
+  q->sq_head = (unsigned *)(sq + params.sq_off.head);
+  q->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  q->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  q->sq_array = (unsigned *)(sq + params.sq_off.array);
+  q->cq_head = (unsigned *)(cq + params.cq_off.head);
+  q->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  q->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  q->cqes = cq + params.cq_off.cqes;
+  if (params.sq_entries < (unsigned)q->depth)
+    q->depth = params.sq_entries;
+  return 0;
+}
+
+/**
+ * @brief Release the io_uring instance and its rings.
+ *
+ * @param q Queue to release.
+ */
+static void uring_close(struct io_queue *q) {
+  if (q->sqes && q->sqes != MAP_FAILED)
+    munmap(q->sqes, q->sqes_size);
+  if (q->cq_ring && q->cq_ring != MAP_FAILED && q->cq_ring != q->sq_ring)
+    munmap(q->cq_ring, q->cq_ring_size);
+  if (q->sq_ring && q->sq_ring != MAP_FAILED)
+    munmap(q->sq_ring, q->sq_ring_size);
+  if (q->ring_fd >= 0)
+    close(q->ring_fd);
+  q->ring_fd = -1;
+  q->sq_ring = q->cq_ring = q->sqes = NULL;
+}
+
+/**
+ * @brief Put the rest of a request into the submission ring.
+ *
+ * @param q Queue with a free submission entry.
+ * @param requests Requests of the batch.
+ * @param index Index of the request, returned in its completion.
+ * @param iov Vector of the request, must live until it completes.
+ */
+static void uring_prepare(struct io_queue *q, struct io_request *requests,
+                          int index, struct iovec *iov) {
+  struct io_request *request = &requests[index];
+  iov->iov_base = (uint8_t *)request->buf + request->done;
+  iov->iov_len = request->length - request->done;
+
+  unsigned tail = *q->sq_tail;
+  unsigned slot = tail & *q->sq_mask;
+  struct io_uring_sqe *sqe = (struct io_uring_sqe *)q->sqes + slot;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = q->fd;
+  sqe->addr = (uintptr_t)iov;
+  sqe->len = 1;
+  sqe->off = request->offset + request->done;
+  sqe->user_data = index;
+  q->sq_array[slot] = slot;
+  __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Take the completions off the completion ring.
+ *
+ * Short and interrupted transfers are queued to be submitted again for
+ * their rest.
+ *
+ * @param q Queue using io_uring.
+ * @param requests Requests of the batch.
+ * @param retry Indexes of requests to submit again.
+ * @param retry_count Number of indexes in retry, updated.
+ * @param failed Set to -1 if a request failed.
+ * @return int Number of completions taken.
+ */
+static int uring_reap(struct io_queue *q, struct io_request *requests,
+                      int *retry, int *retry_count, int *failed) {
+  unsigned head = *q->cq_head;
+  unsigned tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+  int reaped = 0;
+  for (; head != tail; head++, reaped++) {
+    struct io_uring_cqe *cqe =
+        (struct io_uring_cqe *)q->cqes + (head & *q->cq_mask);
+    int index = (int)cqe->user_data;
+    if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+      retry[(*retry_count)++] = index;
+    } else if (cqe->res <= 0) {
+      *failed = -1;
+    } else {
+      requests[index].done += cqe->res;
+      if (requests[index].done < requests[index].length)
+        retry[(*retry_count)++] = index;
+    }
+  }
+  __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+  return reaped;
+}
+
+/**
+ * @brief Give up io_uring after io_uring_enter failed.
+ *
+ * The requests the kernel took are waited for while it still delivers
+ * completions, then the ring is torn down, which cancels whatever is left,
+ * so no buffer of the batch is used after it returns. Later batches use
+ * plain synchronous transfers.
+ *
+ * @param q Queue using io_uring.
+ * @param requests Requests of the batch.
+ * @param retry Indexes of requests to submit again.
+ * @param retry_count Number of indexes in retry, updated.
+ * @param failed Set to -1 if a request failed.
+ * @param submitted Number of requests the kernel took and did not complete.
+ */
+static void uring_abandon(struct io_queue *q, struct io_request *requests,
+                          int *retry, int *retry_count, int *failed,
+                          int submitted) {
+  while (submitted > 0) {
+    submitted -= uring_reap(q, requests, retry, retry_count, failed);
+    if (submitted > 0 &&
+        syscall(__NR_io_uring_enter, q->ring_fd, 0, submitted,
+                IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+        errno != EINTR)
+      break;
+  }
+  uring_close(q);
+  q->engine = IO_ENGINE_SYNC;
+}
+
+/**
+ * @brief Run a batch through io_uring.
+ *
+ * Up to depth requests are in flight. Every io_uring_enter submits the
+ * newly prepared ones and waits for at least one completion, short
+ * transfers are submitted again for their rest. If io_uring_enter fails
+ * the ring is abandoned and the unfinished requests are transferred
+ * synchronously.
+ *
+ * @param q Queue using io_uring.
+ * @param requests Requests of the batch.
+ * @param count Number of requests.
+ * @return int 0 on success, -1 if a request failed.
+ */
+static int uring_run(struct io_queue *q, struct io_request *requests,
+                     int count) {
+  struct iovec *iov = malloc(count * sizeof(struct iovec));
+  int *retry = malloc(count * sizeof(int));
+  if (!iov || !retry) {
+    free(iov);
+    free(retry);
+    return -1;
+  }
+  int next = 0, retry_count = 0, in_flight = 0, failed = 0;
+  while (in_flight > 0 || (!failed && (next < count || retry_count > 0))) {
+    int prepared = 0;
+    while (!failed && in_flight < q->depth &&
+           (retry_count > 0 || next < count)) {
+      int index = retry_count > 0 ? retry[--retry_count] : next++;
+      uring_prepare(q, requests, index, &iov[index]);
+      in_flight++;
+      prepared++;
+    }
+
+    // an interrupted call is repeated, the entries it took stay taken
+    int result;
+    do {
+      result = syscall(__NR_io_uring_enter, q->ring_fd, prepared, 1,
+                       IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (result < 0 && errno == EINTR);
+    if (result < 0) {
+      // a failed call took none of the prepared entries
+      uring_abandon(q, requests, retry, &retry_count, &failed,
+                    in_flight - prepared);
+      for (int i = 0; i < count; i++) {
+        if (requests[i].done < requests[i].length)
+          failed |= transfer_fully(q->fd, &requests[i]);
+      }
+      break;
+    }
+
+    in_flight -= uring_reap(q, requests, retry, &retry_count, &failed);
+  }
+  free(iov);
+  free(retry);
+  return failed;
+}
+#endif
+
+/**
+ * @brief Thread of the fallback engine, takes requests of the running batch
+ * until the queue is closed.
+ *
+ * @param arg The io_queue.
+ * @return void* NULL.
+ */
+static void *queue_thread(void *arg) {
+  struct io_queue *q = arg;
+  pthread_mutex_lock(&q->lock);
+  while (!q->stop) {
+    if (q->next >= q->count) {
+      pthread_cond_wait(&q->work, &q->lock);
+      continue;
+    }
+    struct io_request *request = &q->requests[q->next++];
+    pthread_mutex_unlock(&q->lock);
+    int failed = transfer_fully(q->fd, request);
+    pthread_mutex_lock(&q->lock);
+    if (failed)
+      q->failed = true;
+    if (--q->pending == 0)
+      pthread_cond_signal(&q->finished);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+/**
+ * @brief Run a batch on the thread pool.
+ *
+ * @param q Queue using threads.
+ * @param requests Requests of the batch.
+ * @param count Number of requests.
+ * @return int 0 on success, -1 if a request failed.
+ */
+static int threads_run(struct io_queue *q, struct io_request *requests,
+                       int count) {
+  pthread_mutex_lock(&q->lock);
+  q->requests = requests;
+  q->count = count;
+  q->next = 0;
+  q->pending = count;
+  q->failed = false;
+  pthread_cond_broadcast(&q->work);
+  while (q->pending > 0)
+    pthread_cond_wait(&q->finished, &q->lock);
+  q->requests = NULL;
+  q->count = q->next = 0;
+  int failed = q->failed ? -1 : 0;
+  pthread_mutex_unlock(&q->lock);
+  return failed;
+}
+
+/**
+ * @brief Start the best engine available for an image file.
+ *
+ * io_uring is preferred, a pool of threads is used where it is not
+ * available, and a depth of 1 or a failure of both gives plain
+ * synchronous transfers, so the queue is always usable.
+ *
+ * @param q Queue to start.
+ * @param fd Image file descriptor, stays owned by the caller.
+ * @param depth Number of requests to keep in flight.
+ * @return int 0, the engine in use is in q->engine.
+ */
+int io_queue_open(struct io_queue *q, int fd, int depth) {
+  memset(q, 0, sizeof(*q));
+  q->fd = fd;
+  q->ring_fd = -1;
+  q->depth = depth > 0 ? depth : 1;
+  q->engine = IO_ENGINE_SYNC;
+  pthread_mutex_init(&q->run_lock, NULL);
+  if (q->depth == 1)
+    return 0;
+
+#ifdef __NR_io_uring_setup
+  if (!uring_open(q)) {
+    q->engine = IO_ENGINE_URING;
+    return 0;
+  }
+  uring_close(q);
+#endif
+
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->work, NULL);
+  pthread_cond_init(&q->finished, NULL);
+  int thread_count =
+      q->depth < IO_QUEUE_MAX_THREADS ? q->depth : IO_QUEUE_MAX_THREADS;
+  while (q->thread_count < thread_count &&
+         !pthread_create(&q->threads[q->thread_count], NULL, queue_thread, q))
+    q->thread_count++;
+  if (q->thread_count)
+    q->engine = IO_ENGINE_THREADS;
+  return 0;
+}
+
+/**
+ * @brief Transfer a batch of requests, keeping up to depth of them in
+ * flight. They complete in any order, each into its own buffer. Batches
+ * submitted by several threads run one after another.
+ *
+ * @param q Open queue.
+ * @param requests Requests, done is reset for each.
+ * @param count Number of requests.
+ * @return int 0 on success, -1 if a request failed.
+ */
+int io_queue_run(struct io_queue *q, struct io_request *requests, int count) {
+  if (count <= 0)
+    return 0;
+  for (int i = 0; i < count; i++)
+    requests[i].done = 0;
+  pthread_mutex_lock(&q->run_lock);
+  q->submitted += count;
+  q->batches++;
+
+  int failed = 0;
+#ifdef __NR_io_uring_setup
+  if (q->engine == IO_ENGINE_URING && count > 1) {
+    failed = uring_run(q, requests, count);
+    pthread_mutex_unlock(&q->run_lock);
+    return failed;
+  }
+#endif
+  if (q->engine == IO_ENGINE_THREADS && count > 1) {
+    failed = threads_run(q, requests, count);
+  } else {
+    for (int i = 0; i < count; i++)
+      failed |= transfer_fully(q->fd, &requests[i]);
+  }
+  pthread_mutex_unlock(&q->run_lock);
+  return failed;
+}
+
+/**
+ * @brief Name of the engine in use, for messages.
+ *
+ * @param q Open queue.
+ * @return const char* Engine name.
+ */
+const char *io_queue_engine_name(const struct io_queue *q) {
+  switch (q->engine) {
+  case IO_ENGINE_URING:
+    return "io_uring";
+  case IO_ENGINE_THREADS:
+    return "threads";
+  default:
+    return "sync";
+  }
+}
+
+/**
+ * @brief Stop the engine, no batch may be running.
+ *
+ * @param q Queue to close.
+ */
+void io_queue_close(struct io_queue *q) {
+  if (q->thread_count) {
+    pthread_mutex_lock(&q->lock);
+    q->stop = true;
+    pthread_cond_broadcast(&q->work);
+    pthread_mutex_unlock(&q->lock);
+    for (int i = 0; i < q->thread_count; i++)
+      pthread_join(q->threads[i], NULL);
+    pthread_cond_destroy(&q->finished);
+    pthread_cond_destroy(&q->work);
+    pthread_mutex_destroy(&q->lock);
+  }
+#ifdef __NR_io_uring_setup
+  uring_close(q);
+#endif
+  pthread_mutex_destroy(&q->run_lock);
+  memset(q, 0, sizeof(*q));
+  q->ring_fd = -1;
+}
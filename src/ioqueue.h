@@ -0,0 +1,58 @@
+#ifndef IOQUEUE_H
+#define IOQUEUE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define IO_QUEUE_DEFAULT_DEPTH 32 // requests kept in flight
+#define IO_QUEUE_MAX_THREADS 16   // threads of the fallback engine
+
+// One positional transfer between a buffer and the image file
+struct io_request {
+  void *buf;
+  size_t length;
+  long offset; // byte offset in the image
+  bool write;  // write buf into the image, read into buf otherwise
+  size_t done; // bytes transferred so far
+};
+
+enum io_engine {
+  IO_ENGINE_SYNC,    // one request at a time with pread/pwrite
+  IO_ENGINE_THREADS, // a pool of threads each doing pread/pwrite
+  IO_ENGINE_URING    // io_uring, all requests submitted with one syscall
+};
+
+// Engine keeping many requests on the image file in flight, they complete
+// in any order straight into their buffers
+struct io_queue {
+  enum io_engine engine;
+  int fd;    // image file descriptor
+  int depth; // requests kept in flight
+
+  // io_uring rings, mapped from ring_fd
+  int ring_fd;
+  void *sq_ring, *cq_ring, *sqes, *cqes;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+
+  // thread pool working on the requests of the running batch
+  pthread_t threads[IO_QUEUE_MAX_THREADS];
+  int thread_count;
+  pthread_mutex_t lock;
+  pthread_cond_t work, finished;
+  struct io_request *requests;
+  int count, next, pending;
+  bool failed, stop;
+
+  long submitted, batches; // statistics
+  pthread_mutex_t run_lock; // one batch runs at a time
+};
+
+int io_queue_open(struct io_queue *q, int fd, int depth);
+int io_queue_run(struct io_queue *q, struct io_request *requests, int count);
+const char *io_queue_engine_name(const struct io_queue *q);
+void io_queue_close(struct io_queue *q);
+
+#endif
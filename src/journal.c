@@ -0,0 +1,337 @@
+#include "journal.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Continue an FNV-1a hash over a byte range.
+ *
+ * @param hash Hash of the bytes before.
+ * @param data Bytes to add.
+ * @param length Number of bytes.
+ * @return uint32_t The hash.
+ */
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t length) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * @brief Checksum of a transaction, its header with checksum 0 and records.
+ *
+ * @param header Header of the transaction.
+ * @param records Records of the transaction, header->length bytes.
+ * @return uint32_t The checksum.
+ */
+static uint32_t transaction_checksum(const struct journal_header *header,
+                                     const uint8_t *records) {
+  struct journal_header copy = *header;
+  copy.checksum = 0;
+  uint32_t hash = fnv1a(2166136261u, &copy, sizeof(copy));
+  return fnv1a(hash, records, header->length);
+}
+
+/**
+ * @brief Byte offset of a slot in the image.
+ *
+ * @param j Open journal.
+ * @param sequence Transaction number, selects the slot.
+ * @return long Offset of the slot header.
+ */
+static long slot_offset(const struct journal *j, uint32_t sequence) {
+  return j->start + (long)(sequence % JOURNAL_SLOTS) * j->slot_size;
+}
+
+/**
+ * @brief Read the transaction stored in a slot and check it.
+ *
+ * @param j Open journal.
+ * @param slot Index of the slot.
+ * @param header Output header.
+ * @return uint8_t* Records of a complete transaction (must be freed), or NULL
+ * if the slot is empty, torn or unreadable.
+ */
+static uint8_t *read_slot(struct journal *j, int slot,
+                          struct journal_header *header) {
+  long offset = j->start + (long)slot * j->slot_size;
+  if (storage_read(j->storage, header, sizeof(*header), offset) ||
+      header->magic != JOURNAL_MAGIC ||
+      header->length > j->slot_size - sizeof(*header))
+    return NULL;
+  uint8_t *records = malloc(header->length ? header->length : 1);
+  if (!records)
+    return NULL;
+  if (storage_read(j->storage, records, header->length,
+                   offset + sizeof(*header)) ||
+      transaction_checksum(header, records) != header->checksum) {
+    free(records);
+    return NULL;
+  }
+  return records;
+}
+
+/**
+ * @brief Write the records of a transaction to their places in the image.
+ *
+ * @param st Image storage, not intercepted.
+ * @param records Records, each followed by its data.
+ * @param length Bytes of records.
+ * @return int 0 on success, -1 on failure.
+ */
+static int apply_records(struct storage *st, const uint8_t *records,
+                         size_t length) {
+  size_t position = 0;
+  while (position + sizeof(struct journal_record) <= length) {
+    struct journal_record record;
+    memcpy(&record, records + position, sizeof(record));
+    position += sizeof(record);
+    if (record.length > length - position)
+      return -1;
+    if (storage_write(st, records + position, record.length,
+                      (long)record.offset))
+      return -1;
+    position += record.length;
+  }
+  return 0;
+}
+
+/**
+ * @brief Empty both slots, the older one first, so no transaction is left to
+ * replay.
+ *
+ * A crash in between must not leave the older transaction as the one to
+ * replay, each cleared header is flushed before the next one is written.
+ *
+ * @param j Open journal, its intercept detached.
+ * @return int 0 on success, -1 on failure.
+ */
+static int clear_slots(struct journal *j) {
+  struct journal_header empty = {0};
+  for (uint32_t age = 1; age <= JOURNAL_SLOTS; age++) {
+    if (storage_write(j->storage, &empty, sizeof(empty),
+                      slot_offset(j, j->sequence + age)) ||
+        storage_flush(j->storage))
+      return -1;
+  }
+  j->sequence = 0;
+  return 0;
+}
+
+/**
+ * @brief Append one write of the open transaction, the storage intercept.
+ *
+ * @param context The journal.
+ * @param buf Bytes being written.
+ * @param length Number of bytes.
+ * @param offset Byte offset in the image.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int journal_capture(void *context, const void *buf, size_t length,
+                           long offset) {
+  struct journal *j = context;
+  size_t needed = j->length + sizeof(struct journal_record) + length;
+  if (needed > j->capacity) {
+    size_t capacity = j->capacity ? j->capacity : 65536;
+    while (capacity < needed)
+      capacity *= 2;
+    uint8_t *grown = realloc(j->records, capacity);
+    if (!grown) {
+      j->failed = true;
+      return -1;
+    }
+    j->records = grown;
+    j->capacity = capacity;
+  }
+  struct journal_record record = {(uint64_t)offset, (uint32_t)length, 0};
+  memcpy(j->records + j->length, &record, sizeof(record));
+  memcpy(j->records + j->length + sizeof(record), buf, length);
+  j->length = needed;
+  j->record_count++;
+  return 0;
+}
+
+/**
+ * @brief Attach a journal region of an image.
+ *
+ * Finds the number of the last complete transaction, nothing is replayed.
+ * Open batches stay open.
+ *
+ * @param j Journal to initialize.
+ * @param st Image storage.
+ * @param start Byte offset of the journal region.
+ * @param size Size of the region in bytes, 0 for an image without journal.
+ * @return int 0 on success, -1 if the region is too small for the slots.
+ */
+int journal_open(struct journal *j, struct storage *st, long start,
+                 long size) {
+  int batch_depth = j->batch_depth;
+  journal_close(j);
+  j->batch_depth = batch_depth;
+  if (size <= 0)
+    return 0;
+  if (size / JOURNAL_SLOTS <= (long)sizeof(struct journal_header))
+    return -1;
+  j->storage = st;
+  j->start = start;
+  j->slot_size = size / JOURNAL_SLOTS;
+
+  for (int slot = 0; slot < JOURNAL_SLOTS; slot++) {
+    struct journal_header header;
+    uint8_t *records = read_slot(j, slot, &header);
+    if (records && header.sequence > j->sequence)
+      j->sequence = header.sequence;
+    free(records);
+  }
+  return 0;
+}
+
+/**
+ * @brief Redo the last complete transaction after an unclean shutdown.
+ *
+ * Replaying a transaction which already reached its places is harmless, the
+ * records hold whole byte ranges. Only the newest one is needed, its commit
+ * flushed the in-place writes of all older ones.
+ *
+ * @param j Open journal.
+ * @return int Number of records replayed, 0 if there was nothing, -1 if the
+ * image could not be written.
+ */
+int journal_replay(struct journal *j) {
+  if (!j->storage)
+    return 0;
+  struct journal_header header;
+  uint8_t *records =
+      read_slot(j, j->sequence % JOURNAL_SLOTS, &header);
+  if (!records || header.sequence != j->sequence) {
+    free(records);
+    return 0;
+  }
+  int result = apply_records(j->storage, records, header.length) ||
+                       storage_flush(j->storage)
+                   ? -1
+                   : (int)header.record_count;
+  free(records);
+  return result;
+}
+
+/**
+ * @brief Mark the journal empty at a clean shutdown, so the next open has
+ * nothing to replay.
+ *
+ * @param j Open journal without an open transaction.
+ * @return int 0 on success, -1 on failure.
+ */
+int journal_checkpoint(struct journal *j) {
+  if (!j->storage || !j->sequence)
+    return 0;
+  return clear_slots(j);
+}
+
+/**
+ * @brief Detach the journal, an open transaction is dropped.
+ *
+ * @param j Journal to close.
+ */
+void journal_close(struct journal *j) {
+  if (j->storage && j->storage->intercept_context == j) {
+    j->storage->intercept = NULL;
+    j->storage->intercept_context = NULL;
+  }
+  free(j->records);
+  memset(j, 0, sizeof(*j));
+}
+
+/**
+ * @brief Start collecting image writes into a transaction.
+ *
+ * Does nothing for an image without journal, its writes go in place.
+ *
+ * @param j Open journal.
+ */
+void journal_begin(struct journal *j) {
+  if (!j->storage)
+    return;
+  j->length = 0;
+  j->record_count = 0;
+  j->failed = false;
+  j->storage->intercept = journal_capture;
+  j->storage->intercept_context = j;
+}
+
+/**
+ * @brief Commit the open transaction.
+ *
+ * The transaction is written into the next slot, flushed, and then its
+ * writes are done in place. A transaction larger than a slot is written in
+ * place between two flushes once both slots are emptied, which keeps the
+ * order but not the atomicity. A failed commit leaves it to the caller to
+ * keep the changes for the next one.
+ *
+ * @param j Journal with an open transaction.
+ * @return int 0 on success, -1 on failure.
+ */
+int journal_commit(struct journal *j) {
+  if (!j->storage)
+    return 0;
+  j->storage->intercept = NULL;
+  j->storage->intercept_context = NULL;
+  if (j->failed)
+    return -1;
+  if (!j->record_count)
+    return 0;
+
+  j->commits++;
+  if (j->length > j->slot_size - sizeof(struct journal_header)) {
+    // an older transaction replayed over these writes would undo them
+    j->flushes += JOURNAL_SLOTS + 2;
+    return clear_slots(j) || storage_flush(j->storage) ||
+                   apply_records(j->storage, j->records, j->length) ||
+                   storage_flush(j->storage)
+               ? -1
+               : 0;
+  }
+
+  struct journal_header header = {JOURNAL_MAGIC, j->sequence + 1,
+                                  (uint32_t)j->length, 0,
+                                  (uint32_t)j->record_count};
+  header.checksum = transaction_checksum(&header, j->records);
+  long offset = slot_offset(j, header.sequence);
+  j->flushes++;
+  if (storage_write(j->storage, &header, sizeof(header), offset) ||
+      storage_write(j->storage, j->records, j->length,
+                    offset + sizeof(header)) ||
+      storage_flush(j->storage))
+    return -1;
+  j->sequence = header.sequence;
+  return apply_records(j->storage, j->records, j->length);
+}
+
+/**
+ * @brief Open a batch, commits wait until the outermost batch ends so the
+ * batch becomes one transaction.
+ *
+ * @param j Journal.
+ */
+void journal_batch_begin(struct journal *j) { j->batch_depth++; }
+
+/**
+ * @brief Close a batch opened by journal_batch_begin.
+ *
+ * @param j Journal.
+ */
+void journal_batch_end(struct journal *j) {
+  if (j->batch_depth > 0)
+    j->batch_depth--;
+}
+
+/**
+ * @brief Whether commits are being held back by an open batch.
+ *
+ * @param j Journal.
+ * @return bool true inside a batch.
+ */
+bool journal_batched(const struct journal *j) { return j->batch_depth > 0; }
@@ -0,0 +1,59 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "storage.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define JOURNAL_MAGIC 0x324c5544 // "DUL2", records with 64-bit offsets
+#define JOURNAL_SLOTS 2           // transactions alternate between the slots
+
+// Start of a journal slot, followed by length bytes of records
+struct journal_header {
+  uint32_t magic;
+  uint32_t sequence;     // number of the transaction, grows by one
+  uint32_t length;       // bytes of records after the header
+  uint32_t checksum;     // FNV-1a of the header with checksum 0 and records
+  uint32_t record_count;
+};
+
+// One logged write, followed by length bytes of data
+struct journal_record {
+  uint64_t offset;   // byte offset in the image
+  uint32_t length;   // number of bytes
+  uint32_t reserved; // zero, keeps the records free of padding
+};
+
+// Redo log of metadata writes, file data is written in place before the
+// commit (ordered mode). Every commit is written into the slot after
+// the one of the previous commit and made durable with one storage flush
+// before the writes reach their places in the image, so a crash leaves either
+// the old or the new state. A slot is reused only after the following commit
+// flushed, which also made the in-place writes of the older one durable.
+struct journal {
+  struct storage *storage; // image the journal lives in, NULL if none
+  long start;              // byte offset of the journal region
+  long slot_size;          // bytes of one slot
+  uint32_t sequence;       // number of the last committed transaction
+  uint8_t *records;        // records of the open transaction
+  size_t length;           // bytes used at records
+  size_t capacity;         // bytes allocated at records
+  int record_count;        // number of records at records
+  bool failed;             // a record could not be stored
+  int batch_depth;         // open batches, commits wait for the outermost
+  long commits, flushes;   // statistics
+};
+
+int journal_open(struct journal *j, struct storage *st, long start,
+                 long size);
+int journal_replay(struct journal *j);
+int journal_checkpoint(struct journal *j);
+void journal_close(struct journal *j);
+
+void journal_begin(struct journal *j);
+int journal_commit(struct journal *j);
+void journal_batch_begin(struct journal *j);
+void journal_batch_end(struct journal *j);
+bool journal_batched(const struct journal *j);
+
+#endif
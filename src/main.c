@@ -1,80 +1,113 @@
-#include "dulafs.h"
+#include "mount.h"
 #include "repl.h"
+#include "server.h"
 #include <asm-generic/errno-base.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 /**
  * @brief Main entry point for the DulaFS filesystem shell.
  *
- * Validates command line arguments, opens the specified virtual disk file,
- * reads and validates the superblock, displays filesystem information,
- * and enters the Read-Eval-Print Loop.
+ * Validates command line arguments, mounts the specified virtual disk file
+ * with mount_open, displays filesystem information and enters the
+ * Read-Eval-Print Loop.
+ * Optional "--cache <clusters>" sets the size of the cluster cache,
+ * "--inode-cache <inodes>" the size of the inode cache, "--mmap"
+ * accesses the image through a shared memory mapping and "--memory" works on
+ * an in-memory copy whose changes are discarded at exit. By default the image
+ * is accessed with pread/pwrite, bulk data transfers keep up to
+ * "--queue-depth <requests>" requests in flight through io_uring, or through
+ * a pool of threads where io_uring is not available.
+ * With "--serve <pathToFile.dula> <socket>" the filesystem is served to
+ * clients connecting to a Unix socket instead of the REPL.
  *
  * @param argc Number of command line arguments.
  * @param argv Array of command line argument strings.
  * @return int Exit status code.
  */
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
+  char *file_path = NULL;
+  char *socket_path = NULL;
+  bool serving = false;
+  struct mount_options options;
+  mount_default_options(&options);
+  int positional = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--cache") && i + 1 < argc) {
+      options.cache_blocks = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--inode-cache") && i + 1 < argc) {
+      options.cache_inodes = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--queue-depth") && i + 1 < argc) {
+      options.queue_depth = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--mmap")) {
+      options.open_storage = storage_open_mmap;
+    } else if (!strcmp(argv[i], "--memory")) {
+      options.open_storage = storage_open_memory;
+    } else if (!strcmp(argv[i], "--serve")) {
+      serving = true;
+    } else {
+      if (positional == 0)
+        file_path = argv[i];
+      else
+        socket_path = argv[i];
+      positional++;
+    }
+  }
+  if (positional != 1 + serving || options.cache_blocks <= 0 ||
+      options.cache_inodes <= 0 || options.queue_depth <= 0) {
     fprintf(stderr,
-            "Invalid number of arguments: expected 1, got %d\nUsage: %s "
-            "<pathToFile.dula>\n",
-            argc - 1, argv[0]);
+            "Invalid arguments: expected %d files, got %d\nUsage: %s "
+            "[--cache <clusters>] [--inode-cache <inodes>] "
+            "[--queue-depth <requests>] "
+            "[--mmap | --memory] [--serve] <pathToFile.dula> [<socket>]\n",
+            1 + serving, positional, argv[0]);
     return EINVAL;
   }
-  char *file_path = argv[1];
+  struct session console;
+  session_init(&console, stdout, stderr);
 
   printf("Trying to open: %s\n", file_path);
 
-  if (access(file_path, F_OK)) {
-    fprintf(stderr, "File does not exist: %s\n", file_path);
-    return ENOENT;
-  }
-  if (access(file_path, W_OK | R_OK)) {
-    fprintf(stderr, "Insufficient permissions to read/write to: %s\n",
-            file_path);
-    return EACCES;
-  }
-
-  FILE *file_ptr = fopen(file_path, "rb+");
-
-  if (file_ptr == NULL) {
-    fprintf(stderr, "unable to open file %s", file_path);
-    return ENOENT;
-  }
+  int error;
+  struct SystemState *mount = mount_open(file_path, &options, &error);
+  if (!mount)
+    return error;
 
-  g_system_state.file_ptr = file_ptr;
-
-  if (fread(&g_system_state.sb, sizeof(struct superblock), 1, file_ptr) != 1) {
-    fprintf(stderr, "Failed to read superblock from file\n");
-  }
-
-  if (strcmp(g_system_state.sb.signature, "HEJDULA")) {
+  if (strcmp(mount->sb.signature, "HEJDULA")) {
     printf("The file does not have signature of .ula file(HEJDULA) and may not "
            "be properly formatted, format the file with format command");
   } else {
     printf("Valid .ula filesystem detected!\n");
     printf("\n=== Superblock Information ===\n");
-    printf("Signature: '%.8s'\n", g_system_state.sb.signature);
-    printf("Disk size: %d bytes\n", g_system_state.sb.disk_size);
-    printf("Cluster size: %d bytes\n", g_system_state.sb.cluster_size);
-    printf("Cluster count: %d\n", g_system_state.sb.cluster_count);
-    printf("Inode count: %d\n", g_system_state.sb.inode_count);
+    printf("Signature: '%.8s'\n", mount->sb.signature);
+    printf("Disk size: %d bytes\n", mount->sb.disk_size);
+    printf("Cluster size: %d bytes\n", mount->sb.cluster_size);
+    printf("Cluster count: %d\n", mount->sb.cluster_count);
+    printf("Inode count: %d\n", mount->sb.inode_count);
     printf("Inode bitmap start address: %d\n",
-           g_system_state.sb.bitmapi_start_address);
+           mount->sb.bitmapi_start_address);
     printf("Cluster bitmap start address: %d\n",
-           g_system_state.sb.bitmap_start_address);
-    printf("Inode start address: %d\n", g_system_state.sb.inode_start_address);
-    printf("Data start address: %d\n", g_system_state.sb.data_start_address);
+           mount->sb.bitmap_start_address);
+    printf("Inode start address: %d\n", mount->sb.inode_start_address);
+    printf("Data start address: %d\n", mount->sb.data_start_address);
     printf("===============================\n\n");
+    if (mount->replayed > 0)
+      printf("Replayed %d journaled writes\n", mount->replayed);
   }
 
-  repl();
-
-  fclose(file_ptr);
+  int status = 0;
+  if (serving) {
+    status = serve(mount, socket_path) ? EADDRINUSE : 0;
+  } else {
+    session_attach(mount, &console);
+    repl(mount, &console);
+    session_detach(mount, &console);
+  }
 
-  return 0;
+  mount_close(mount);
+  return status;
 }
@@ -0,0 +1,216 @@
+#include "mount.h"
+#include "commands.h"
+#include "repl.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define COMMAND_NAME_SIZE 32
+
+/**
+ * @brief Fill in the options used when none are given.
+ *
+ * @param options Options to fill in.
+ */
+void mount_default_options(struct mount_options *options) {
+  options->cache_blocks = CACHE_DEFAULT_BLOCKS;
+  options->cache_inodes = ICACHE_DEFAULT_ENTRIES;
+  options->queue_depth = IO_QUEUE_DEFAULT_DEPTH;
+  options->open_storage = storage_open_file;
+}
+
+/**
+ * @brief Free everything a mount holds without committing anything.
+ *
+ * @param mount Mount to free.
+ */
+static void release_mount(struct SystemState *mount) {
+  cache_destroy(&mount->cache);
+  icache_destroy(&mount->icache);
+  dcache_destroy(&mount->dcache);
+  journal_close(&mount->journal);
+  io_queue_close(&mount->io_queue);
+  storage_close(mount->storage);
+  bitmap_release(&mount->inode_bitmap);
+  bitmap_release(&mount->cluster_bitmap);
+  refcount_release(&mount->refcounts);
+  free(mount->freed_clusters);
+  pthread_mutex_destroy(&mount->icache.lock);
+  pthread_mutex_destroy(&mount->dcache.lock);
+  pthread_mutex_destroy(&mount->sessions_lock);
+  pthread_rwlock_destroy(&mount->lock);
+  free(mount);
+}
+
+/**
+ * @brief Open an image and mount the filesystem on it.
+ *
+ * The superblock is read, the journal replayed and the bitmaps loaded. An
+ * image without the filesystem signature is opened as well, so it can be
+ * formatted. Any number of images may be mounted at the same time, each
+ * with its own caches.
+ *
+ * @param path Path of the image.
+ * @param options How the image is accessed.
+ * @param error Output errno value on failure.
+ * @return struct SystemState* The mount, or NULL on failure.
+ */
+struct SystemState *mount_open(const char *path,
+                               const struct mount_options *options,
+                               int *error) {
+  if (access(path, F_OK)) {
+    fprintf(stderr, "File does not exist: %s\n", path);
+    *error = ENOENT;
+    return NULL;
+  }
+  if (access(path, W_OK | R_OK)) {
+    fprintf(stderr, "Insufficient permissions to read/write to: %s\n", path);
+    *error = EACCES;
+    return NULL;
+  }
+
+  struct SystemState *mount = calloc(1, sizeof(struct SystemState));
+  if (!mount) {
+    *error = ENOMEM;
+    return NULL;
+  }
+  mount->inode_bitmap.dirty_start = -1;
+  mount->cluster_bitmap.dirty_start = -1;
+  pthread_mutex_init(&mount->icache.lock, NULL);
+  mount->icache.capacity = options->cache_inodes;
+  pthread_mutex_init(&mount->dcache.lock, NULL);
+  pthread_mutex_init(&mount->sessions_lock, NULL);
+  pthread_rwlock_init(&mount->lock, NULL);
+
+  mount->storage = options->open_storage(path);
+  if (!mount->storage) {
+    fprintf(stderr, "unable to open file %s\n", path);
+    release_mount(mount);
+    *error = ENOENT;
+    return NULL;
+  }
+  // addressable images are copied from memory, there is nothing to queue
+  if (!mount->storage->map) {
+    io_queue_open(&mount->io_queue, mount->storage->fd, options->queue_depth);
+    mount->storage->queue = &mount->io_queue;
+  }
+  if (cache_init(&mount->cache, options->cache_blocks, CLUSTER_SIZE)) {
+    fprintf(stderr, "Failed to allocate cluster cache of %d clusters\n",
+            options->cache_blocks);
+    release_mount(mount);
+    *error = ENOMEM;
+    return NULL;
+  }
+  cache_reset(&mount->cache, mount->storage, 0);
+
+  *error = 0;
+  if (read_superblock(mount) != ERR_SUCCESS)
+    fprintf(stderr, "Failed to read superblock from file\n");
+  if (!strcmp(mount->sb.signature, "HEJDULA")) {
+    mount->replayed = replay_journal(mount);
+    if (mount->replayed < 0) {
+      fprintf(stderr, "Failed to replay the journal\n");
+      *error = EIO;
+    } else if (mount_filesystem(mount) != ERR_SUCCESS) {
+      fprintf(stderr, "Failed to load bitmaps from file\n");
+      *error = ENOMEM;
+    }
+  }
+
+  if (*error) {
+    release_mount(mount);
+    return NULL;
+  }
+  return mount;
+}
+
+/**
+ * @brief Commit the last changes of a mount, checkpoint its journal and
+ * close the image.
+ *
+ * @param mount Mount to close, no command may run on it.
+ */
+void mount_close(struct SystemState *mount) {
+  if (commit_changes(mount) == ERR_SUCCESS)
+    journal_checkpoint(&mount->journal);
+  release_mount(mount);
+}
+
+/**
+ * @brief Start a session in the root directory.
+ *
+ * @param session Session to initialize.
+ * @param out Stream the output of commands goes to.
+ * @param err Stream error messages go to.
+ */
+void session_init(struct session *session, FILE *out, FILE *err) {
+  session->curr_node_id = ROOT_NODE;
+  session->out = out;
+  session->err = err;
+  session->next = NULL;
+}
+
+/**
+ * @brief Make a session live on a mount, so that no command removes its
+ * working directory and format moves it back to the root.
+ *
+ * @param mount Mount the session works on.
+ * @param session Session to attach, detached before it goes away.
+ */
+void session_attach(struct SystemState *mount, struct session *session) {
+  pthread_mutex_lock(&mount->sessions_lock);
+  session->next = mount->sessions;
+  mount->sessions = session;
+  pthread_mutex_unlock(&mount->sessions_lock);
+}
+
+/**
+ * @brief Remove a session from the live sessions of a mount.
+ *
+ * @param mount Mount the session was attached to.
+ * @param session Session to detach.
+ */
+void session_detach(struct SystemState *mount, struct session *session) {
+  pthread_mutex_lock(&mount->sessions_lock);
+  struct session **link = &mount->sessions;
+  while (*link && *link != session)
+    link = &(*link)->next;
+  if (*link)
+    *link = session->next;
+  pthread_mutex_unlock(&mount->sessions_lock);
+}
+
+/**
+ * @brief Execute a command line of a session on a mount.
+ *
+ * Safe to call from any number of threads. Commands which only read the
+ * filesystem run in parallel, any other command waits until it can run
+ * alone and is committed before the next one starts.
+ *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
+ * @param line Command line.
+ * @return int Error code of the command.
+ */
+int mount_execute(struct SystemState *mount, struct session *session,
+                  const char *line) {
+  char name[COMMAND_NAME_SIZE];
+  const char *start = line + strspn(line, " ");
+  size_t length = strcspn(start, " ");
+  const struct CommandEntry *command = NULL;
+  if (length < sizeof(name)) {
+    memcpy(name, start, length);
+    name[length] = '\0';
+    command = find_command(name);
+  }
+
+  if (command && command->shared)
+    pthread_rwlock_rdlock(&mount->lock);
+  else
+    pthread_rwlock_wrlock(&mount->lock);
+  int error = execute_command_string(mount, session, line);
+  pthread_rwlock_unlock(&mount->lock);
+  return error;
+}
@@ -0,0 +1,26 @@
+#ifndef MOUNT_H
+#define MOUNT_H
+
+#include "dulafs.h"
+
+// How mount_open accesses an image
+struct mount_options {
+  int cache_blocks; // clusters the cluster cache holds
+  int cache_inodes; // inodes the inode cache holds
+  int queue_depth;  // requests bulk transfers keep in flight
+  // backend: storage_open_file, storage_open_mmap or storage_open_memory
+  struct storage *(*open_storage)(const char *path);
+};
+
+void mount_default_options(struct mount_options *options);
+struct SystemState *mount_open(const char *path,
+                               const struct mount_options *options,
+                               int *error);
+void mount_close(struct SystemState *mount);
+void session_init(struct session *session, FILE *out, FILE *err);
+void session_attach(struct SystemState *mount, struct session *session);
+void session_detach(struct SystemState *mount, struct session *session);
+int mount_execute(struct SystemState *mount, struct session *session,
+                  const char *line);
+
+#endif
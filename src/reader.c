@@ -0,0 +1,77 @@
+#include "dulafs.h"
+#include <stdlib.h>
+
+/**
+ * @brief Start reading a node from its beginning.
+ *
+ * @param mount Mount to work on.
+ * @param reader Reader to initialize.
+ * @param inode Node to read, copied so the caller's inode may change.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+int node_reader_open(struct SystemState *mount, struct node_reader *reader,
+                     const struct inode *inode) {
+  reader->mount = mount;
+  reader->inode = *inode;
+  reader->position = 0;
+  reader->buffer = malloc(NODE_READER_CLUSTERS * CLUSTER_SIZE);
+  return reader->buffer ? 0 : -1;
+}
+
+/**
+ * @brief Read the next chunk of the node.
+ *
+ * The chunk is filled by following the block map one run of consecutive
+ * clusters at a time, the image reads of all runs are submitted together.
+ *
+ * @param reader Open reader.
+ * @param data Output pointer to the chunk, valid until the next call.
+ * @return long Number of bytes in the chunk, 0 at the end of the node, or -1
+ * if the block map or the image could not be read.
+ */
+long node_reader_next(struct node_reader *reader, const uint8_t **data) {
+  struct SystemState *mount = reader->mount;
+  long remaining = reader->inode.file_size - reader->position;
+  if (remaining <= 0)
+    return 0;
+  long chunk = remaining < (long)NODE_READER_CLUSTERS * CLUSTER_SIZE
+                   ? remaining
+                   : (long)NODE_READER_CLUSTERS * CLUSTER_SIZE;
+
+  int first = reader->position / CLUSTER_SIZE;
+  int cluster_count = (chunk + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  struct cache_batch batch;
+  cache_batch_init(&batch);
+  for (int done = 0; done < cluster_count;) {
+    int length;
+    int start = node_run_at(mount, &reader->inode, first + done,
+                            cluster_count - done, &length);
+    if (start < 0) {
+      cache_submit(&mount->cache, &batch);
+      return -1;
+    }
+    long offset = (long)done * CLUSTER_SIZE;
+    long bytes = (long)length * CLUSTER_SIZE;
+    if (offset + bytes > chunk)
+      bytes = chunk - offset;
+    cache_queue_read(&mount->cache, &batch, start, reader->buffer + offset,
+                     bytes);
+    done += length;
+  }
+  if (cache_submit(&mount->cache, &batch))
+    return -1;
+
+  reader->position += chunk;
+  *data = reader->buffer;
+  return chunk;
+}
+
+/**
+ * @brief Free the reader's buffer.
+ *
+ * @param reader Reader to close.
+ */
+void node_reader_close(struct node_reader *reader) {
+  free(reader->buffer);
+  reader->buffer = NULL;
+}
@@ -0,0 +1,140 @@
+#include "refcount.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Extend the dirty entry range of the table to include an entry.
+ *
+ * @param rt Table to mark.
+ * @param i Index of the modified entry.
+ */
+static void mark_dirty(struct refcount_table *rt, int i) {
+  if (rt->dirty_start < 0) {
+    rt->dirty_start = i;
+    rt->dirty_end = i + 1;
+    return;
+  }
+  if (i < rt->dirty_start)
+    rt->dirty_start = i;
+  if (i + 1 > rt->dirty_end)
+    rt->dirty_end = i + 1;
+}
+
+/**
+ * @brief Read the reference count table from the image into memory.
+ *
+ * Any previously loaded copy is released first.
+ *
+ * @param rt Table to fill.
+ * @param st Image storage.
+ * @param disk_offset Byte offset of the table in the image.
+ * @param count Number of entries, one per cluster.
+ * @return int 0 on success, -1 on allocation or read failure.
+ */
+int refcount_load(struct refcount_table *rt, struct storage *st,
+                  int disk_offset, int count) {
+  refcount_release(rt);
+  if (count <= 0)
+    return 0;
+
+  uint16_t *counts = malloc(count * sizeof(uint16_t));
+  if (!counts)
+    return -1;
+  if (storage_read(st, counts, count * sizeof(uint16_t), disk_offset)) {
+    free(counts);
+    return -1;
+  }
+  rt->counts = counts;
+  rt->count = count;
+  rt->disk_offset = disk_offset;
+  return 0;
+}
+
+/**
+ * @brief Write the dirty entries of the table back to the image.
+ *
+ * Does not flush the storage, the caller decides when to do that.
+ *
+ * @param rt Table to write back.
+ * @param st Image storage.
+ * @return int 0 on success, -1 on write failure.
+ */
+int refcount_flush(struct refcount_table *rt, struct storage *st) {
+  if (!rt->counts || rt->dirty_start < 0)
+    return 0;
+
+  int length = (rt->dirty_end - rt->dirty_start) * sizeof(uint16_t);
+  if (storage_write(st, rt->counts + rt->dirty_start, length,
+                    rt->disk_offset + rt->dirty_start * sizeof(uint16_t)))
+    return -1;
+
+  rt->dirty_start = -1;
+  rt->dirty_end = 0;
+  return 0;
+}
+
+/**
+ * @brief Mark the whole table dirty again after a failed commit.
+ *
+ * @param rt Table to mark.
+ */
+void refcount_mark_dirty(struct refcount_table *rt) {
+  if (!rt->counts || !rt->count)
+    return;
+  rt->dirty_start = 0;
+  rt->dirty_end = rt->count;
+}
+
+/**
+ * @brief Drop the in-memory copy of the table without writing it back.
+ *
+ * @param rt Table to release.
+ */
+void refcount_release(struct refcount_table *rt) {
+  free(rt->counts);
+  memset(rt, 0, sizeof(*rt));
+  rt->dirty_start = -1;
+}
+
+/**
+ * @brief Check whether a cluster is referenced by more than one node.
+ *
+ * @param rt Table to read.
+ * @param i Cluster ID.
+ * @return int 1 if the cluster is shared, 0 otherwise or without a table.
+ */
+int refcount_shared(const struct refcount_table *rt, int i) {
+  return rt->counts && i >= 0 && i < rt->count && rt->counts[i] > 0;
+}
+
+/**
+ * @brief Add a reference to a cluster which already has an owner.
+ *
+ * @param rt Table to modify.
+ * @param i Cluster ID.
+ * @return int 0 on success, -1 without a table, out of range or when the
+ * count would overflow.
+ */
+int refcount_share(struct refcount_table *rt, int i) {
+  if (!rt->counts || i < 0 || i >= rt->count || rt->counts[i] == REFCOUNT_MAX)
+    return -1;
+  rt->counts[i]++;
+  mark_dirty(rt, i);
+  return 0;
+}
+
+/**
+ * @brief Drop one reference to a cluster.
+ *
+ * @param rt Table to modify.
+ * @param i Cluster ID.
+ * @return int 1 if other references remain, 0 if the caller held the last
+ * one and should free the cluster.
+ */
+int refcount_unshare(struct refcount_table *rt, int i) {
+  if (!refcount_shared(rt, i))
+    return 0;
+  rt->counts[i]--;
+  mark_dirty(rt, i);
+  return 1;
+}
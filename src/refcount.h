@@ -0,0 +1,30 @@
+#ifndef REFCOUNT_H
+#define REFCOUNT_H
+
+#include "storage.h"
+#include <stdint.h>
+
+#define REFCOUNT_MAX UINT16_MAX // most extra references one cluster can have
+
+// In-memory copy of the on-disk cluster reference count table.
+// Entry i counts the nodes sharing cluster i besides its first owner, so an
+// image in which nothing is shared has an all zero table.
+struct refcount_table {
+  uint16_t *counts; // cached table entries
+  int count;        // number of entries, one per cluster
+  int disk_offset;  // byte offset of the table in the image
+  int dirty_start;  // first dirty entry (inclusive), -1 when clean
+  int dirty_end;    // last dirty entry (exclusive)
+};
+
+int refcount_load(struct refcount_table *rt, struct storage *st,
+                  int disk_offset, int count);
+int refcount_flush(struct refcount_table *rt, struct storage *st);
+void refcount_mark_dirty(struct refcount_table *rt);
+void refcount_release(struct refcount_table *rt);
+
+int refcount_shared(const struct refcount_table *rt, int i);
+int refcount_share(struct refcount_table *rt, int i);
+int refcount_unshare(struct refcount_table *rt, int i);
+
+#endif
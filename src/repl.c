@@ -14,8 +14,11 @@
  * user for input, parses the command line, executes the corresponding command
  * function, and displays the result or error message. The loop terminates when
  * "exit" is entered or EOF is encountered.
+ *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  */
-void repl() {
+void repl(struct SystemState *mount, struct session *session) {
   printf("Welcome to dula REPL, available commands: ");
 
   // Print available commands
@@ -42,8 +45,10 @@ void repl() {
       }
     }
     last_command_executed = 0;
+    char *working_dir = inode_to_path(mount, session->curr_node_id);
     printf("\033[38;5;117mdulafs\033[0m:\033[38;5;227m%s\033[0m> ",
-           g_system_state.working_dir);
+           working_dir ? working_dir : "?");
+    free(working_dir);
     fflush(stdout);
 
     if (fgets(input, INPUT_BUFFER_SIZE, stdin) == NULL) {
@@ -110,7 +115,11 @@ void repl() {
           break;
         }
         // execute the command
-        last_error_num = commands[i].function(token_count, args);
+        last_error_num = commands[i].function(mount, session, token_count,
+                                              args);
+        int committed = commit_changes(mount);
+        if (last_error_num == ERR_SUCCESS)
+          last_error_num = committed;
         last_command_executed = 1;
         if (last_error_num != ERR_SUCCESS) {
           // Command failed, print error message
@@ -144,11 +153,14 @@ void repl() {
  * Tokenizes the input string into command and arguments, validates the argument
  * count, and calls the corresponding command function if found.
  *
+ * @param mount Mount to work on.
+ * @param session Session the command runs in.
  * @param input_string The full command line string to execute.
  * @return int The error code returned by the command, or
  * ERR_UNKNOWN/ERR_INVALID_ARGC/ERR_MEMORY_ALLOCATION.
  */
-int execute_command_string(const char *input_string) {
+int execute_command_string(struct SystemState *mount, struct session *session,
+                           const char *input_string) {
   if (!input_string || input_string[0] == '\0') {
     return ERR_SUCCESS; // Empty lines are OK
   }
@@ -158,7 +170,9 @@ int execute_command_string(const char *input_string) {
     return ERR_MEMORY_ALLOCATION;
   }
 
-  char *command_token = strtok(input_copy, " ");
+  // strtok_r, sessions of the server execute commands in parallel
+  char *save;
+  char *command_token = strtok_r(input_copy, " ", &save);
   if (command_token == NULL) {
     free(input_copy);
     return ERR_SUCCESS; // Empty or whitespace-only lines
@@ -166,7 +180,7 @@ int execute_command_string(const char *input_string) {
 
   // count tokens after first one
   int token_count = 1;
-  while (strtok(NULL, " ") != NULL)
+  while (strtok_r(NULL, " ", &save) != NULL)
     token_count++;
 
   // Free the first copy and make a fresh one for argument parsing
@@ -182,10 +196,10 @@ int execute_command_string(const char *input_string) {
     return ERR_MEMORY_ALLOCATION;
   }
 
-  args[0] = strtok(input_copy, " ");
+  args[0] = strtok_r(input_copy, " ", &save);
   char *command = args[0];
   for (int i = 1; i < token_count; i++) {
-    args[i] = strtok(NULL, " ");
+    args[i] = strtok_r(NULL, " ", &save);
   }
 
   if (!strcmp(input_copy, "exit")) {
@@ -203,8 +217,13 @@ int execute_command_string(const char *input_string) {
         error_code = ERR_INVALID_ARGC;
         break;
       }
-      // execute the command
-      error_code = commands[i].function(token_count, args);
+      // execute the command, shared commands have nothing to commit
+      error_code = commands[i].function(mount, session, token_count, args);
+      if (!commands[i].shared) {
+        int committed = commit_changes(mount);
+        if (error_code == ERR_SUCCESS)
+          error_code = committed;
+      }
       break;
     }
   }
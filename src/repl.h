@@ -1,7 +1,11 @@
 #ifndef REPL_H
 #define REPL_H
 
-void repl();
-int execute_command_string(const char* input_string);
+struct SystemState;
+struct session;
+
+void repl(struct SystemState* mount, struct session* session);
+int execute_command_string(struct SystemState* mount, struct session* session,
+                           const char* input_string);
 
 #endif
\ No newline at end of file
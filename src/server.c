@@ -0,0 +1,259 @@
+#include "server.h"
+#include "mount.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Protocol: a client sends one command per line. The output of the command
+// is sent back followed by a status line, "ok" or "error <code>: <message>".
+// The session ends with "exit" or when the client closes the connection.
+
+enum client_state { CLIENT_FREE, CLIENT_RUNNING, CLIENT_DONE };
+
+// Connection of one client, served by its own thread
+struct client {
+  enum client_state state;
+  int fd;
+  pthread_t thread;
+  struct SystemState *mount; // mount the commands run on
+};
+
+static struct client clients[SERVER_MAX_SESSIONS];
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile sig_atomic_t stopping;
+
+/**
+ * @brief Signal handler asking the server to stop.
+ *
+ * @param signal Signal number.
+ */
+static void stop_serving(int signal) {
+  (void)signal;
+  stopping = 1;
+}
+
+/**
+ * @brief Send the status line of a finished command.
+ *
+ * @param out Stream of the client.
+ * @param error Error code of the command.
+ */
+static void send_status(FILE *out, int error) {
+  const char *message = get_error_message((ErrorCode)error);
+  if (error == ERR_SUCCESS)
+    fprintf(out, "ok\n");
+  else if (message)
+    fprintf(out, "error %d: %s\n", error, message);
+  else
+    fprintf(out, "error %d\n", error);
+}
+
+/**
+ * @brief Serve one client until it leaves or the server stops.
+ *
+ * The client has a session of its own, with its own working directory and
+ * the output of its commands going to the socket.
+ *
+ * @param arg The client.
+ * @return void* NULL.
+ */
+static void *session_thread(void *arg) {
+  struct client *client = arg;
+  int out_fd = dup(client->fd);
+  FILE *in = fdopen(client->fd, "r");
+  FILE *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+  struct session session;
+  session_init(&session, out, out);
+  session_attach(client->mount, &session);
+
+  char line[SERVER_LINE_SIZE];
+  while (in && out && fgets(line, sizeof(line), in)) {
+    size_t length = strcspn(line, "\n");
+    if (!line[length] && !feof(in)) {
+      // the rest of a line too long to be a command is skipped
+      int c;
+      while ((c = fgetc(in)) != EOF && c != '\n')
+        ;
+      fprintf(out, "error: line too long\n");
+    } else {
+      line[length] = '\0';
+      if (length && line[length - 1] == '\r')
+        line[length - 1] = '\0';
+      if (!strcmp(line, "exit"))
+        break;
+      send_status(out, mount_execute(client->mount, &session, line));
+    }
+    if (fflush(out))
+      break;
+  }
+  session_detach(client->mount, &session);
+
+  pthread_mutex_lock(&clients_lock);
+  client->state = CLIENT_DONE;
+  pthread_mutex_unlock(&clients_lock);
+  if (out)
+    fclose(out);
+  else if (out_fd >= 0)
+    close(out_fd);
+  if (in)
+    fclose(in);
+  else
+    close(client->fd);
+  return NULL;
+}
+
+/**
+ * @brief Wait for the threads of clients which left, freeing their slots.
+ *
+ * @param all Also wait for the clients still being served.
+ */
+static void reap_clients(bool all) {
+  for (int i = 0; i < SERVER_MAX_SESSIONS; i++) {
+    pthread_mutex_lock(&clients_lock);
+    enum client_state state = clients[i].state;
+    pthread_mutex_unlock(&clients_lock);
+    if (state == CLIENT_DONE || (all && state == CLIENT_RUNNING)) {
+      pthread_join(clients[i].thread, NULL);
+      pthread_mutex_lock(&clients_lock);
+      clients[i].state = CLIENT_FREE;
+      pthread_mutex_unlock(&clients_lock);
+    }
+  }
+}
+
+/**
+ * @brief Start serving a new connection.
+ *
+ * The connection is refused when SERVER_MAX_SESSIONS clients are served.
+ *
+ * @param mount Mount the client works on.
+ * @param fd Accepted connection.
+ */
+static void start_client(struct SystemState *mount, int fd) {
+  reap_clients(false);
+  pthread_mutex_lock(&clients_lock);
+  int slot = 0;
+  while (slot < SERVER_MAX_SESSIONS && clients[slot].state != CLIENT_FREE)
+    slot++;
+  if (slot < SERVER_MAX_SESSIONS) {
+    clients[slot].fd = fd;
+    clients[slot].mount = mount;
+    clients[slot].state = CLIENT_RUNNING;
+    if (!pthread_create(&clients[slot].thread, NULL, session_thread,
+                        &clients[slot])) {
+      pthread_mutex_unlock(&clients_lock);
+      return;
+    }
+    clients[slot].state = CLIENT_FREE;
+  }
+  pthread_mutex_unlock(&clients_lock);
+  const char *busy = "error: server busy\n";
+  if (write(fd, busy, strlen(busy)) < 0)
+    perror("write");
+  close(fd);
+}
+
+/**
+ * @brief Create the listening socket, a stale socket left at the path by a
+ * previous server is replaced.
+ *
+ * @param socket_path Path of the socket.
+ * @return int Socket descriptor, or -1 on failure.
+ */
+static int open_listener(const char *socket_path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", socket_path);
+    return -1;
+  }
+  strlcpy(address.sun_path, socket_path, sizeof(address.sun_path));
+
+  struct stat st;
+  if (!lstat(socket_path, &st)) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "Not a socket, refusing to replace: %s\n", socket_path);
+      return -1;
+    }
+    unlink(socket_path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) ||
+      listen(fd, SERVER_MAX_SESSIONS)) {
+    perror(socket_path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * @brief Serve a mounted filesystem to clients connecting to a Unix socket,
+ * until SIGINT or SIGTERM.
+ *
+ * Every client gets a thread and a session with its own working directory,
+ * its commands run through mount_execute.
+ *
+ * @param mount Mount to serve.
+ * @param socket_path Path of the socket to create.
+ * @return int 0 on success, -1 if the socket could not be created.
+ */
+int serve(struct SystemState *mount, const char *socket_path) {
+  int listener = open_listener(socket_path);
+  if (listener < 0)
+    return -1;
+
+  // a client closing its end early must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+  struct sigaction action = {.sa_handler = stop_serving};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  // only this thread takes the signals, so they interrupt accept
+  sigset_t stop_signals, previous;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+
+  printf("Serving on %s, at most %d clients\n", socket_path,
+         SERVER_MAX_SESSIONS);
+  fflush(stdout);
+  while (!stopping) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED)
+        perror("accept");
+      continue;
+    }
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &previous);
+    start_client(mount, fd);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  }
+
+  // sessions see the end of their input once the current command is done
+  pthread_mutex_lock(&clients_lock);
+  for (int i = 0; i < SERVER_MAX_SESSIONS; i++) {
+    if (clients[i].state == CLIENT_RUNNING)
+      shutdown(clients[i].fd, SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&clients_lock);
+  reap_clients(true);
+
+  close(listener);
+  unlink(socket_path);
+  printf("Server stopped\n");
+  return 0;
+}
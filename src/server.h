@@ -0,0 +1,11 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#define SERVER_MAX_SESSIONS 64 // clients served at the same time
+#define SERVER_LINE_SIZE 1024  // longest command line accepted
+
+struct SystemState;
+
+int serve(struct SystemState *mount, const char *socket_path);
+
+#endif
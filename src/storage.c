@@ -0,0 +1,525 @@
+#define _GNU_SOURCE // copy_file_range
+#include "storage.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief Allocate a storage handle.
+ *
+ * @param ops Backend operations.
+ * @param name Backend name.
+ * @param fd Image file descriptor, or -1.
+ * @return struct storage* The handle, or NULL on allocation failure.
+ */
+static struct storage *storage_new(const struct storage_ops *ops,
+                                   const char *name, int fd) {
+  struct storage *st = calloc(1, sizeof(struct storage));
+  if (!st)
+    return NULL;
+  st->ops = ops;
+  st->name = name;
+  st->fd = fd;
+  return st;
+}
+
+/**
+ * @brief Read a byte range of a file descriptor, retrying short reads.
+ *
+ * @param fd File descriptor.
+ * @param buf Destination buffer.
+ * @param length Number of bytes.
+ * @param offset File offset.
+ * @return int 0 on success, -1 on failure or end of file.
+ */
+static int read_fully(int fd, void *buf, size_t length, long offset) {
+  uint8_t *out = buf;
+  while (length > 0) {
+    ssize_t n = pread(fd, out, length, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    out += n;
+    length -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+/**
+ * @brief Write a byte range of a file descriptor, retrying short writes.
+ *
+ * @param fd File descriptor.
+ * @param buf Source buffer.
+ * @param length Number of bytes.
+ * @param offset File offset.
+ * @return int 0 on success, -1 on failure.
+ */
+static int write_fully(int fd, const void *buf, size_t length, long offset) {
+  const uint8_t *in = buf;
+  while (length > 0) {
+    ssize_t n = pwrite(fd, in, length, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    in += n;
+    length -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+/**
+ * @brief Size of the file behind a descriptor.
+ *
+ * @param fd File descriptor.
+ * @return long Size in bytes, -1 on failure.
+ */
+static long file_size(int fd) {
+  struct stat st;
+  if (fstat(fd, &st))
+    return -1;
+  return st.st_size;
+}
+
+/**
+ * @brief Write buffers as one byte range by writing them one at a time.
+ *
+ * Used by the backends whose writes are plain memory copies.
+ *
+ * @param st Storage to write to.
+ * @param iov Buffers in image order.
+ * @param iovcnt Number of buffers.
+ * @param offset Byte offset of the first buffer in the image.
+ * @return int 0 on success, -1 on failure.
+ */
+static int writev_each(struct storage *st, const struct iovec *iov, int iovcnt,
+                       long offset) {
+  for (int i = 0; i < iovcnt; i++) {
+    if (st->ops->write_at(st, iov[i].iov_base, iov[i].iov_len, offset))
+      return -1;
+    offset += iov[i].iov_len;
+  }
+  return 0;
+}
+
+// ---- positional I/O backend ----
+
+static int file_read_at(struct storage *st, void *buf, size_t length,
+                        long offset) {
+  return read_fully(st->fd, buf, length, offset);
+}
+
+static int file_write_at(struct storage *st, const void *buf, size_t length,
+                         long offset) {
+  return write_fully(st->fd, buf, length, offset);
+}
+
+static int file_writev_at(struct storage *st, const struct iovec *iov,
+                          int iovcnt, long offset) {
+  struct iovec rest[STORAGE_IOV_MAX];
+  if (iovcnt > STORAGE_IOV_MAX)
+    return writev_each(st, iov, iovcnt, offset);
+  memcpy(rest, iov, iovcnt * sizeof(struct iovec));
+
+  // a short write leaves the remaining buffers, the first one partly written
+  struct iovec *pending = rest;
+  while (iovcnt > 0) {
+    ssize_t n = pwritev(st->fd, pending, iovcnt, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    offset += n;
+    while (iovcnt > 0 && (size_t)n >= pending->iov_len) {
+      n -= pending->iov_len;
+      pending++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      pending->iov_base = (uint8_t *)pending->iov_base + n;
+      pending->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+static int file_flush(struct storage *st) { return fdatasync(st->fd); }
+
+static long file_size_of(struct storage *st) { return file_size(st->fd); }
+
+static void file_close(struct storage *st) {
+  close(st->fd);
+  free(st);
+}
+
+static const struct storage_ops file_ops = {file_read_at, file_write_at,
+                                            file_writev_at, file_flush,
+                                            file_size_of, file_close};
+
+/**
+ * @brief Open an image accessed with pread/pwrite.
+ *
+ * Transfers do not share a file position, so they need no seeking and may
+ * be issued from several threads at once.
+ *
+ * @param path Path to the image.
+ * @return struct storage* The storage, or NULL on failure.
+ */
+struct storage *storage_open_file(const char *path) {
+  int fd = open(path, O_RDWR);
+  if (fd < 0)
+    return NULL;
+  struct storage *st = storage_new(&file_ops, "pread", fd);
+  if (!st)
+    close(fd);
+  return st;
+}
+
+// ---- mmap backend ----
+
+/**
+ * @brief Map the image again after its size changed.
+ *
+ * @param st Storage of the mmap backend.
+ * @param size New size of the image in bytes.
+ * @return int 0 on success, -1 on failure.
+ */
+static int mmap_remap(struct storage *st, size_t size) {
+  if (st->map) {
+    munmap(st->map, st->map_size);
+    st->map = NULL;
+    st->map_size = 0;
+  }
+  if (size == 0)
+    return 0;
+  void *map =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, st->fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  st->map = map;
+  st->map_size = size;
+  return 0;
+}
+
+static int mmap_read_at(struct storage *st, void *buf, size_t length,
+                        long offset) {
+  if (offset < 0 || offset + length > st->map_size)
+    return -1;
+  memcpy(buf, st->map + offset, length);
+  return 0;
+}
+
+static int mmap_write_at(struct storage *st, const void *buf, size_t length,
+                         long offset) {
+  if (offset < 0)
+    return -1;
+  if (offset + length > st->map_size &&
+      (ftruncate(st->fd, offset + length) || mmap_remap(st, offset + length)))
+    return -1;
+  memcpy(st->map + offset, buf, length);
+  return 0;
+}
+
+static int mmap_flush(struct storage *st) {
+  return st->map ? msync(st->map, st->map_size, MS_SYNC) : 0;
+}
+
+static long mmap_size_of(struct storage *st) { return st->map_size; }
+
+static void mmap_close(struct storage *st) {
+  mmap_flush(st);
+  mmap_remap(st, 0);
+  close(st->fd);
+  free(st);
+}
+
+static const struct storage_ops mmap_ops = {mmap_read_at, mmap_write_at,
+                                            writev_each, mmap_flush,
+                                            mmap_size_of, mmap_close};
+
+/**
+ * @brief Open an image mapped into memory with a shared mapping.
+ *
+ * The mapping is exposed through st->map, so callers can use the image bytes
+ * in place. Writes past the end grow the file and move the mapping.
+ *
+ * @param path Path to the image.
+ * @return struct storage* The storage, or NULL on failure.
+ */
+struct storage *storage_open_mmap(const char *path) {
+  int fd = open(path, O_RDWR);
+  if (fd < 0)
+    return NULL;
+  struct storage *st = storage_new(&mmap_ops, "mmap", fd);
+  long size = file_size(fd);
+  if (!st || size < 0 || mmap_remap(st, size)) {
+    free(st);
+    close(fd);
+    return NULL;
+  }
+  return st;
+}
+
+// ---- in-memory backend ----
+
+static int memory_write_at(struct storage *st, const void *buf, size_t length,
+                           long offset) {
+  if (offset < 0)
+    return -1;
+  size_t end = offset + length;
+  if (end > st->map_size) {
+    uint8_t *grown = realloc(st->map, end);
+    if (!grown)
+      return -1;
+    memset(grown + st->map_size, 0, end - st->map_size);
+    st->map = grown;
+    st->map_size = end;
+  }
+  memcpy(st->map + offset, buf, length);
+  return 0;
+}
+
+static int memory_flush(struct storage *st) {
+  (void)st;
+  return 0;
+}
+
+static void memory_close(struct storage *st) {
+  free(st->map);
+  free(st);
+}
+
+static const struct storage_ops memory_ops = {mmap_read_at, memory_write_at,
+                                              writev_each, memory_flush,
+                                              mmap_size_of, memory_close};
+
+/**
+ * @brief Load a copy of an image into memory.
+ *
+ * All changes stay in memory and are discarded when the storage is closed,
+ * which suits tests and dry runs.
+ *
+ * @param path Path to the image.
+ * @return struct storage* The storage, or NULL on failure.
+ */
+struct storage *storage_open_memory(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  long size = file_size(fd);
+  struct storage *st = storage_new(&memory_ops, "memory", -1);
+  if (!st || size < 0) {
+    free(st);
+    close(fd);
+    return NULL;
+  }
+  if (size > 0) {
+    st->map = malloc(size);
+    st->map_size = size;
+    if (!st->map || read_fully(fd, st->map, size, 0)) {
+      close(fd);
+      memory_close(st);
+      return NULL;
+    }
+  }
+  close(fd);
+  return st;
+}
+
+// ---- dispatch ----
+
+/**
+ * @brief Read bytes of the image.
+ *
+ * @param st Storage to read from.
+ * @param buf Destination buffer.
+ * @param length Number of bytes.
+ * @param offset Byte offset in the image.
+ * @return int 0 on success, -1 on failure.
+ */
+int storage_read(struct storage *st, void *buf, size_t length, long offset) {
+  return st->ops->read_at(st, buf, length, offset);
+}
+
+/**
+ * @brief Write bytes of the image.
+ *
+ * @param st Storage to write to.
+ * @param buf Source buffer.
+ * @param length Number of bytes.
+ * @param offset Byte offset in the image.
+ * @return int 0 on success, -1 on failure.
+ */
+int storage_write(struct storage *st, const void *buf, size_t length,
+                  long offset) {
+  if (st->intercept)
+    return st->intercept(st->intercept_context, buf, length, offset);
+  return st->ops->write_at(st, buf, length, offset);
+}
+
+/**
+ * @brief Write several buffers to one byte range of the image.
+ *
+ * @param st Storage to write to.
+ * @param iov Buffers in image order.
+ * @param iovcnt Number of buffers, beyond STORAGE_IOV_MAX they are written
+ * one at a time.
+ * @param offset Byte offset of the first buffer in the image.
+ * @return int 0 on success, -1 on failure.
+ */
+int storage_writev(struct storage *st, const struct iovec *iov, int iovcnt,
+                   long offset) {
+  if (!st->intercept)
+    return st->ops->writev_at(st, iov, iovcnt, offset);
+  for (int i = 0; i < iovcnt; i++) {
+    if (st->intercept(st->intercept_context, iov[i].iov_base, iov[i].iov_len,
+                      offset))
+      return -1;
+    offset += iov[i].iov_len;
+  }
+  return 0;
+}
+
+/**
+ * @brief Transfer many byte ranges between buffers and the image at once.
+ *
+ * With an io queue attached to a file image the requests are kept in flight
+ * together and complete in any order. Otherwise, or when writes are being
+ * intercepted, they are done one by one through storage_read and
+ * storage_write.
+ *
+ * @param st Storage to use.
+ * @param requests Requests of the batch.
+ * @param count Number of requests.
+ * @return int 0 on success, -1 if a request failed.
+ */
+int storage_submit(struct storage *st, struct io_request *requests,
+                   int count) {
+  if (st->queue && !st->map && !st->intercept)
+    return io_queue_run(st->queue, requests, count);
+  int failed = 0;
+  for (int i = 0; i < count; i++) {
+    struct io_request *request = &requests[i];
+    failed |= request->write ? storage_write(st, request->buf,
+                                             request->length, request->offset)
+                             : storage_read(st, request->buf, request->length,
+                                            request->offset);
+  }
+  return failed;
+}
+
+/**
+ * @brief Append bytes of the image to another file without a user buffer.
+ *
+ * Tries copy_file_range, then sendfile, then falls back to pread and write
+ * through a bounce buffer. Backends without a file descriptor write straight
+ * from their memory. Data still held in the block cache is not seen, the
+ * caller reads such data through the cache.
+ *
+ * @param st Storage to copy from.
+ * @param offset Byte offset in the image.
+ * @param length Number of bytes.
+ * @param out_fd Destination, written at its current file position.
+ * @return int 0 on success, -1 on failure.
+ */
+int storage_copy_out(struct storage *st, long offset, size_t length,
+                     int out_fd) {
+  if (st->fd < 0) {
+    if (offset < 0 || offset + length > st->map_size)
+      return -1;
+    const uint8_t *in = st->map + offset;
+    while (length > 0) {
+      ssize_t n = write(out_fd, in, length);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      in += n;
+      length -= n;
+    }
+    return 0;
+  }
+
+  loff_t in_offset = offset;
+  bool kernel_copy = true, use_sendfile = true;
+  while (length > 0) {
+    ssize_t n = -1;
+    if (kernel_copy) {
+      n = copy_file_range(st->fd, &in_offset, out_fd, NULL, length, 0);
+      // not supported for this pair of files, older kernels refuse to copy
+      // across file systems
+      if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                    errno == EOPNOTSUPP)) {
+        kernel_copy = false;
+        continue;
+      }
+    } else if (use_sendfile) {
+      off_t sent_offset = in_offset;
+      n = sendfile(out_fd, st->fd, &sent_offset, length);
+      if (n < 0 && (errno == ENOSYS || errno == EINVAL)) {
+        use_sendfile = false;
+        continue;
+      }
+      if (n > 0)
+        in_offset = sent_offset;
+    } else {
+      uint8_t buffer[65536];
+      size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+      if (read_fully(st->fd, buffer, chunk, in_offset))
+        return -1;
+      const uint8_t *in = buffer;
+      for (size_t left = chunk; left > 0;) {
+        ssize_t written = write(out_fd, in, left);
+        if (written < 0 && errno == EINTR)
+          continue;
+        if (written <= 0)
+          return -1;
+        in += written;
+        left -= written;
+      }
+      n = chunk;
+      in_offset += n;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    length -= n;
+  }
+  return 0;
+}
+
+/**
+ * @brief Make everything written so far durable.
+ *
+ * @param st Storage to flush.
+ * @return int 0 on success, -1 on failure.
+ */
+int storage_flush(struct storage *st) { return st->ops->flush(st); }
+
+/**
+ * @brief Current size of the image.
+ *
+ * @param st Storage to query.
+ * @return long Size in bytes, -1 on failure.
+ */
+long storage_size(struct storage *st) { return st->ops->size(st); }
+
+/**
+ * @brief Close the storage and free it.
+ *
+ * @param st Storage to close, may be NULL.
+ */
+void storage_close(struct storage *st) {
+  if (st)
+    st->ops->close(st);
+}
@@ -0,0 +1,65 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "ioqueue.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define STORAGE_IOV_MAX 64 // buffers passed to one vectored write
+
+struct storage;
+
+// Operations of one storage backend, all offsets are bytes from image start
+struct storage_ops {
+  // read exactly length bytes, 0 on success, -1 on failure or short read
+  int (*read_at)(struct storage *st, void *buf, size_t length, long offset);
+  // write exactly length bytes, growing the image if needed, 0 or -1
+  int (*write_at)(struct storage *st, const void *buf, size_t length,
+                  long offset);
+  // write the buffers back to back as one byte range starting at offset
+  int (*writev_at)(struct storage *st, const struct iovec *iov, int iovcnt,
+                   long offset);
+  // make all written data durable, 0 or -1
+  int (*flush)(struct storage *st);
+  // current size of the image in bytes, -1 on failure
+  long (*size)(struct storage *st);
+  // release the backend, the image is flushed first where that applies
+  void (*close)(struct storage *st);
+};
+
+// Open image, reached only through its backend operations
+struct storage {
+  const struct storage_ops *ops;
+  const char *name; // backend name for messages
+  int fd;           // image file descriptor, -1 for the memory backend
+  uint8_t *map;     // image bytes when the backend keeps them addressable
+  size_t map_size;  // number of bytes at map
+  // when set, storage_write and storage_writev hand writes to it instead of
+  // the backend, the journal collects a transaction this way
+  int (*intercept)(void *context, const void *buf, size_t length,
+                   long offset);
+  void *intercept_context;
+  // engine of storage_submit for a file image, NULL for one transfer at a
+  // time
+  struct io_queue *queue;
+};
+
+struct storage *storage_open_file(const char *path);
+struct storage *storage_open_mmap(const char *path);
+struct storage *storage_open_memory(const char *path);
+
+int storage_read(struct storage *st, void *buf, size_t length, long offset);
+int storage_write(struct storage *st, const void *buf, size_t length,
+                  long offset);
+int storage_writev(struct storage *st, const struct iovec *iov, int iovcnt,
+                   long offset);
+int storage_submit(struct storage *st, struct io_request *requests,
+                   int count);
+int storage_copy_out(struct storage *st, long offset, size_t length,
+                     int out_fd);
+int storage_flush(struct storage *st);
+long storage_size(struct storage *st);
+void storage_close(struct storage *st);
+
+#endif